@@ -0,0 +1,198 @@
+#ifndef CHANGEFEED_HPP
+#define CHANGEFEED_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// What happened to a file. RESET means any file may have changed (a snapshot was
+// loaded); it has no name, and a watcher should list the files again.
+enum class ChangeKind : uint8_t {
+    CREATE = 1,
+    WRITE = 2,
+    DELETE = 3,
+    RESET = 4
+};
+
+// One change as a watcher sees it. `sequence` numbers the events queued for the
+// watcher from 1 on, in the order it receives them. `size` is the file's size after
+// the change (0 after a delete).
+class ChangeEvent {
+public:
+    uint64_t sequence = 0;
+    uint64_t size = 0;
+    ChangeKind kind = ChangeKind::RESET;
+    string filename;
+};
+
+// Subscription to the changes of files whose names start with `prefix` (see
+// MemFS::watch). Producers are the threads changing files, any number at once; the
+// consumer is one thread. Events go through a bounded ring of cells in the style of
+// Vyukov's MPMC queue: each cell carries a turn counter, and a producer claims the next
+// position with a compare-and-swap and publishes the cell by bumping its turn, so
+// neither side ever takes a lock. A producer that finds the ring full drops its event
+// and counts it instead of waiting. Cells keep their name strings between laps, so
+// once warm an event costs no allocation.
+//
+// A consumer either blocks in wait(), or, with a wake descriptor (an eventfd), adds it
+// to its poll set, calls arm() before sleeping and drains with poll() when it fires.
+// Producers only wake a consumer that said it was going to sleep.
+class Watcher {
+private:
+    class Cell {
+    public:
+        atomic<uint64_t> turn{0};
+        ChangeEvent event;
+    };
+
+    string prefix;
+    vector<Cell> cells;
+    size_t mask;
+    char padding[64];
+    // Next position producers claim.
+    atomic<uint64_t> tail{0};
+    atomic<uint64_t> dropped{0};
+    char padding_after[64];
+    // Consumer side.
+    uint64_t head = 0;
+    uint64_t dropped_reported = 0;
+    atomic<bool> sleeping{false};
+    int wake_fd;
+    mutex wake_mutex;
+    condition_variable wake_cv;
+
+    void wake() {
+        if (!sleeping.load() || !sleeping.exchange(false)) {
+            return;
+        }
+        if (wake_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = ::write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        } else {
+            lock_guard<mutex> lock(wake_mutex);
+            wake_cv.notify_one();
+        }
+    }
+
+public:
+    // `capacity` is rounded up to a power of two.
+    Watcher(const string &prefix, size_t capacity, int wake_fd = -1)
+        : prefix(prefix), cells(capacity_for(capacity)), mask(cells.size() - 1), wake_fd(wake_fd) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            cells[i].turn.store(i, memory_order_relaxed);
+        }
+    }
+
+    Watcher(const Watcher &) = delete;
+    Watcher &operator=(const Watcher &) = delete;
+
+    static size_t capacity_for(size_t capacity) {
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    const string &watched_prefix() const {
+        return prefix;
+    }
+
+    size_t capacity() const {
+        return cells.size();
+    }
+
+    bool matches(const string &filename) const {
+        return filename.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    // Producer side: queues the event if the ring has room, else counts it as dropped.
+    void offer(ChangeKind kind, const string &filename, uint64_t size) {
+        uint64_t position = tail.load(memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &cells[position & mask];
+            uint64_t turn = cell->turn.load(memory_order_acquire);
+            if (turn == position) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (turn < position) {
+                // The cell still holds the event from the previous lap.
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+        cell->event.sequence = position + 1;
+        cell->event.size = size;
+        cell->event.kind = kind;
+        cell->event.filename.assign(filename);
+        // Sequentially consistent, as are the consumer's store to `sleeping` and its
+        // check for an event: either it sees this event or wake() sees it sleeping.
+        cell->turn.store(position + 1);
+        wake();
+    }
+
+    // Consumer side from here on.
+
+    bool empty() const {
+        return cells[head & mask].turn.load() != head + 1;
+    }
+
+    // Moves up to `max` queued events into `events` (which is cleared first) and
+    // returns how many, setting `lost` to the events dropped since the previous poll.
+    // A producer that has claimed a cell but not yet filled it holds back the events
+    // after it until the next poll.
+    size_t poll(vector<ChangeEvent> &events, uint64_t &lost, size_t max = SIZE_MAX) {
+        events.clear();
+        while (events.size() < max && !empty()) {
+            Cell &cell = cells[head & mask];
+            events.push_back(cell.event);
+            cell.turn.store(head + cells.size(), memory_order_release);
+            ++head;
+        }
+        uint64_t total = dropped.load(memory_order_relaxed);
+        lost = total - dropped_reported;
+        dropped_reported = total;
+        return events.size();
+    }
+
+    // Events dropped since the subscription started.
+    uint64_t dropped_total() const {
+        return dropped.load(memory_order_relaxed);
+    }
+
+    // Blocks until an event is queued or `timeout` passes; true if one is queued.
+    bool wait(milliseconds timeout) {
+        if (!empty()) {
+            return true;
+        }
+        unique_lock<mutex> lock(wake_mutex);
+        sleeping.store(true);
+        bool ready = wake_cv.wait_for(lock, timeout, [this]() { return !empty(); });
+        sleeping.store(false);
+        return ready;
+    }
+
+    // For a consumer woken through its wake descriptor: asks to be woken by the next
+    // event. False if one is queued already, in which case the caller polls instead of
+    // sleeping.
+    bool arm() {
+        sleeping.store(true);
+        return empty();
+    }
+};
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef CLIENT_HPP
+#define CLIENT_HPP
+
+#include "Protocol.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+class Response {
+public:
+    ResponseStatus status = ResponseStatus::DISCONNECTED;
+    string content;
+};
+
+// Blocking client for MemFSServer. Requests can be pipelined: queue any number with
+// send(), then call receive() once per request to get the responses in order
+// (receive flushes whatever is still queued). The one-call helpers below do a full
+// round trip each, discarding any responses still outstanding before theirs, and
+// return DISCONNECTED if the connection is lost. Not thread-safe; use one client
+// per thread.
+class MemFSClient {
+private:
+    int fd = -1;
+    string out;
+    string in;
+    size_t in_start = 0;
+    size_t waiting = 0;
+
+    void disconnect() {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        out.clear();
+        in.clear();
+        in_start = 0;
+        waiting = 0;
+    }
+
+    // Reads until at least `bytes` are buffered past in_start.
+    bool fill(size_t bytes) {
+        char chunk[64 * 1024];
+        while (in.size() - in_start < bytes) {
+            ssize_t got = ::read(fd, chunk, sizeof(chunk));
+            if (got > 0) {
+                in.append(chunk, static_cast<size_t>(got));
+            } else if (got < 0 && errno == EINTR) {
+                continue;
+            } else {
+                disconnect();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool read_frame(Response &response) {
+        if (!fill(Protocol::HEADER_BYTES)) {
+            return false;
+        }
+        size_t body = Protocol::get<uint32_t>(&in[in_start]);
+        if (!fill(Protocol::HEADER_BYTES + body)) {
+            return false;
+        }
+        response.status = static_cast<ResponseStatus>(in[in_start + 4]);
+        response.content.assign(in, in_start + Protocol::HEADER_BYTES, body);
+        in_start += Protocol::HEADER_BYTES + body;
+        if (in_start == in.size()) {
+            in.clear();
+            in_start = 0;
+        }
+        return true;
+    }
+
+    ResponseStatus call(RequestOp op, const string &name, const string &content, string *result) {
+        if (!send(op, name, content)) {
+            return ResponseStatus::BAD_REQUEST;
+        }
+        Response response;
+        while (waiting > 0) {
+            if (!receive(response)) {
+                return ResponseStatus::DISCONNECTED;
+            }
+        }
+        if (result) {
+            result->swap(response.content);
+        }
+        return response.status;
+    }
+
+public:
+    MemFSClient() = default;
+    MemFSClient(const MemFSClient &) = delete;
+    MemFSClient &operator=(const MemFSClient &) = delete;
+
+    ~MemFSClient() {
+        disconnect();
+    }
+
+    // Returns false and sets `error` if the server cannot be reached.
+    bool connect(const string &socket_path, string &error) {
+        disconnect();
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+            error = "invalid socket path " + socket_path;
+            return false;
+        }
+        memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+            error = "connect " + socket_path + ": " + strerror(errno);
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+
+    bool connected() const {
+        return fd >= 0;
+    }
+
+    // Requests sent (or queued) whose responses have not been received yet.
+    size_t outstanding() const {
+        return waiting;
+    }
+
+    // Queues a request; false, with nothing queued, if it cannot be framed (a name
+    // over 65535 bytes or a body over Protocol::MAX_BODY).
+    bool send(RequestOp op, const string &name, const string &content = string()) {
+        if (name.size() > UINT16_MAX || name.size() + content.size() > Protocol::MAX_BODY) {
+            return false;
+        }
+        Protocol::append_request(out, op, name, content);
+        ++waiting;
+        return true;
+    }
+
+    bool flush() {
+        size_t done = 0;
+        while (fd >= 0 && done < out.size()) {
+            ssize_t sent = ::send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+            if (sent > 0) {
+                done += static_cast<size_t>(sent);
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                disconnect();
+                return false;
+            }
+        }
+        out.clear();
+        return fd >= 0;
+    }
+
+    // Next response, in request order. False if nothing is outstanding or the
+    // connection failed.
+    bool receive(Response &response) {
+        if (waiting == 0 || (!out.empty() && !flush()) || !read_frame(response)) {
+            return false;
+        }
+        --waiting;
+        return true;
+    }
+
+    ResponseStatus create(const string &filename) {
+        return call(RequestOp::CREATE, filename, string(), nullptr);
+    }
+
+    ResponseStatus write(const string &filename, const string &content) {
+        return call(RequestOp::WRITE, filename, content, nullptr);
+    }
+
+    ResponseStatus read(const string &filename, string &content) {
+        return call(RequestOp::READ, filename, string(), &content);
+    }
+
+    ResponseStatus remove(const string &filename) {
+        return call(RequestOp::DELETE, filename, string(), nullptr);
+    }
+
+    ResponseStatus mkdir(const string &path) {
+        return call(RequestOp::MKDIR, path, string(), nullptr);
+    }
+
+    ResponseStatus copy(const string &source, const string &target) {
+        return call(RequestOp::COPY, source, target, nullptr);
+    }
+
+    ResponseStatus rename(const string &source, const string &target) {
+        return call(RequestOp::RENAME, source, target, nullptr);
+    }
+
+    // Turns the connection into a feed of the changes to files whose names start with
+    // `prefix`; once this returns OK, only next_event may be called.
+    ResponseStatus watch(const string &prefix) {
+        return call(RequestOp::WATCH, prefix, string(), nullptr);
+    }
+
+    // Blocks for the next change; `dropped` is set to the changes lost before it
+    // because this client fell behind. False if the connection was lost.
+    bool next_event(ChangeEvent &event, uint64_t &dropped) {
+        Response response;
+        if (!read_frame(response) || !Protocol::parse_event(response.content, event, dropped)) {
+            disconnect();
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
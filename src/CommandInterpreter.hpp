@@ -2,287 +2,989 @@
 #define CI_HPP
 
 #include "MemFS.hpp"
+#include <cctype>
+#include <climits>
 #include <cstddef>
+#include <cstring>
 #include <ctime>
 #include <iostream>
-#include <regex>
-#include <sstream>
+#include <istream>
 #include <string>
 #include <vector>
 
 using namespace std;
 using namespace std::chrono;
 
+// One token of a command line, as a span into the line. A quoted token spans only the
+// text between its quotes.
+class Token {
+public:
+    size_t begin;
+    size_t length;
+    bool quoted;
+};
+
 class ValidationResult {
 public:
     bool success;
     string errmsg;
     vector<string> filenames;
     vector<string> contents;
-    bool long_format = false;
+    ListOptions list_options;
     int file_count = 0;
+    // Descriptor, offsets and sizes of the file handle commands.
+    vector<uint64_t> numbers;
+    // Seconds to live given to a create or write with --ttl; 0 if none.
+    uint64_t ttl = 0;
 };
 
 class CommandInterpreter {
 private:
     MemFS fs;
+    // Reused across commands so tokenizing a line does not allocate once warmed up.
+    vector<Token> tokens;
+    // Set by the watch command; its events are printed after every command.
+    shared_ptr<Watcher> watcher;
+    vector<ChangeEvent> events;
 
-    static vector<string> split(const string &str) {
-        vector<string> tokens;
-        string token;
-        bool inQuotes = false;
-        for (size_t i = 0; i < str.length(); ++i) {
-            char c = str[i];
-            if (c == '"') {
-                inQuotes = !inQuotes;
-            } else if (isspace(c) && !inQuotes) {
-                if (!token.empty()) {
-                    tokens.push_back(token);
-                    token.clear();
+    // Single pass over the line: tokens are separated by whitespace, and a token that
+    // starts with a quote runs to the closing quote and must end there.
+    static bool tokenize(const string &line, vector<Token> &tokens) {
+        tokens.clear();
+        size_t i = 0;
+        size_t n = line.size();
+        while (true) {
+            while (i < n && isspace(static_cast<unsigned char>(line[i]))) {
+                ++i;
+            }
+            if (i == n) {
+                return true;
+            }
+            Token token;
+            if (line[i] == '"') {
+                size_t close = line.find('"', i + 1);
+                if (close == string::npos) {
+                    return false;
+                }
+                token.begin = i + 1;
+                token.length = close - i - 1;
+                token.quoted = true;
+                i = close + 1;
+                if (i < n && !isspace(static_cast<unsigned char>(line[i]))) {
+                    return false;
                 }
             } else {
-                token += c;
+                token.begin = i;
+                while (i < n && !isspace(static_cast<unsigned char>(line[i]))) {
+                    if (line[i] == '"') {
+                        return false;
+                    }
+                    ++i;
+                }
+                token.length = i - token.begin;
+                token.quoted = false;
             }
-        }
-        if (!token.empty()) {
             tokens.push_back(token);
         }
-        return tokens;
     }
 
-    void help_menu() {
-        cout << "Available commands:" << endl
-             << "  create <filename>                             - Create a new file with the specified filename" << endl
-             << "  create -n <count> <filenames...>              - Create multiple files; expects <count> filenames" << endl
-             << "  write <filename> \"<content>\"                  - Write content to a file" << endl
-             << "  write -n <count> <filename> \"<content>\" ...   - Write to multiple files; expects <count> filename/content pairs" << endl
-             << "  read <filename>                               - Read and display the content of a file" << endl
-             << "  delete <filename>                             - Delete a specific file" << endl
-             << "  delete -n <count> <filenames...>              - Delete multiple files; expects <count> filenames" << endl
-             << "  ls                                            - List directory contents" << endl
-             << "  ls -l                                         - List directory contents in long format" << endl
-             << "  help                                          - Show this help menu" << endl
-             << "  exit                                          - Exit the program" << endl
-             << "  clear                                         - Clear the screen" << endl;
+    static bool equals(const string &line, const Token &token, const char *word) {
+        size_t len = strlen(word);
+        return !token.quoted && token.length == len && line.compare(token.begin, len, word) == 0;
     }
 
-    static bool validateCreate(const string &input, ValidationResult &result, const vector<string> &tokens) {
-        static const regex createSimple(R"(^create\s+[a-zA-Z0-9_]+\.[a-zA-Z0-9]+$)");
-        static const regex createMultiple(R"(^create\s+-n\s+(\d+)\s+(.+)$)");
-        static const regex validFilename(R"([a-zA-Z0-9_]+\.[a-zA-Z0-9]+)");
+    static string text(const string &line, const Token &token) {
+        return line.substr(token.begin, token.length);
+    }
 
-        if (regex_match(input, createSimple)) {
-            result.success = true;
-            result.file_count = 1;
-            result.filenames.push_back(input.substr(7));
-            return true;
+    static bool isNameChar(char c) {
+        return isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    // Advances p over a run of name characters; false if the run is empty.
+    static bool skipName(const char *&p, const char *end) {
+        const char *start = p;
+        while (p < end && isNameChar(*p)) {
+            ++p;
         }
+        return p != start;
+    }
 
-        smatch matches;
-        if (regex_match(input, matches, createMultiple)) {
-            int expectedFiles = stoi(matches[1]);
-            istringstream iss(matches[2].str());
+    // <dir>/<dir>/...: one or more names separated by single slashes.
+    static bool validDirectory(const string &line, const Token &token) {
+        if (token.quoted || token.length == 0) {
+            return false;
+        }
+        const char *p = line.data() + token.begin;
+        const char *end = p + token.length;
+        while (skipName(p, end)) {
+            if (p == end) {
+                return true;
+            }
+            if (*p++ != '/') {
+                return false;
+            }
+        }
+        return false;
+    }
 
-            for (size_t i = 3; i < tokens.size(); ++i) {
-                if (!regex_match(tokens[i], validFilename)) {
-                    result.success = false;
-                    result.errmsg = "Invalid filename: " + tokens[i];
-                    return false;
-                }
-                result.filenames.push_back(tokens[i]);
+    // [<dir>/...]<name>.<ext>: an optional directory path, then a name and an
+    // extension, all non-empty runs of letters, digits and underscores.
+    static bool validFilename(const string &line, const Token &token) {
+        if (token.quoted || token.length == 0) {
+            return false;
+        }
+        const char *p = line.data() + token.begin;
+        const char *end = p + token.length;
+        while (true) {
+            if (!skipName(p, end) || p == end) {
+                return false;
             }
+            if (*p != '/') {
+                break;
+            }
+            ++p;
+        }
+        if (*p++ != '.') {
+            return false;
+        }
+        return skipName(p, end) && p == end;
+    }
 
-            result.success = (result.filenames.size() == static_cast<size_t>(expectedFiles));
-            if (!result.success) {
-                result.errmsg = "Expected " + to_string(expectedFiles) +
-                                " files, but got " + to_string(result.filenames.size());
+    static bool parseCount(const string &line, const Token &token, int &count) {
+        if (token.quoted || token.length == 0 || token.length > 9) {
+            return false;
+        }
+        count = 0;
+        for (size_t i = 0; i < token.length; ++i) {
+            char c = line[token.begin + i];
+            if (c < '0' || c > '9') {
+                return false;
             }
-            result.file_count = result.filenames.size();
-            return result.success;
+            count = count * 10 + (c - '0');
         }
+        return true;
+    }
 
+    static bool parseNumber(const string &line, const Token &token, uint64_t &number) {
+        if (token.quoted || token.length == 0 || token.length > 18) {
+            return false;
+        }
+        number = 0;
+        for (size_t i = 0; i < token.length; ++i) {
+            char c = line[token.begin + i];
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            number = number * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return true;
+    }
+
+    static bool fail(ValidationResult &result, const string &errmsg) {
         result.success = false;
-        result.errmsg = "Invalid command format. Use 'help' command for usage";
+        result.errmsg = errmsg;
         return false;
     }
 
-    static bool validateWrite(const string &input, ValidationResult &result, const vector<string> &tokens) {
-        static const regex writeSimple(R"(^write\s+([a-zA-Z0-9_]+\.[a-zA-Z0-9_]+)\s+\"([^"]*)\"$)");
-        static const regex writeMultiple(R"(^write\s+-n\s+(\d+)\s+(.+)$)");
-        static const regex validFilename(R"([a-zA-Z0-9_]+\.[a-zA-Z0-9]+)");
-        smatch matches;
+    static bool invalidFormat(ValidationResult &result) {
+        return fail(result, "Invalid command format. Use 'help' command for usage");
+    }
+
+    // Takes a leading "--ttl <seconds>" off a create or write command, so the rest
+    // validates as usual.
+    static bool takeTtl(const string &line, vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() < 2 || !equals(line, tokens[1], "--ttl")) {
+            return true;
+        }
+        if (tokens.size() < 3 || !parseNumber(line, tokens[2], result.ttl) || result.ttl == 0) {
+            return fail(result, tokens.size() < 3 ? "Invalid command format. Use 'help' command for usage"
+                                                  : "Invalid number: " + text(line, tokens[2]));
+        }
+        tokens.erase(tokens.begin() + 1, tokens.begin() + 3);
+        return true;
+    }
 
-        if (regex_match(input, matches, writeSimple)) {
+    // Shared by create/read/delete: either "<cmd> <file>" or "<cmd> -n <count> <files...>".
+    static bool validateFileList(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() == 2) {
+            if (!validFilename(line, tokens[1])) {
+                return invalidFormat(result);
+            }
             result.success = true;
             result.file_count = 1;
-            result.filenames.push_back(matches[1]);
-            result.contents.push_back(matches[2]);
+            result.filenames.push_back(text(line, tokens[1]));
             return true;
         }
 
-        if (regex_match(input, matches, writeMultiple)) {
-            int expectedFiles = stoi(matches[1]);
-            istringstream iss(matches[2].str());
-            string token;
-            bool expectingFilename = true;
+        int expectedFiles;
+        if (tokens.size() < 4 || !equals(line, tokens[1], "-n") || !parseCount(line, tokens[2], expectedFiles)) {
+            return invalidFormat(result);
+        }
+        result.filenames.reserve(tokens.size() - 3);
+        for (size_t i = 3; i < tokens.size(); ++i) {
+            if (!validFilename(line, tokens[i])) {
+                return fail(result, "Invalid filename: " + text(line, tokens[i]));
+            }
+            result.filenames.push_back(text(line, tokens[i]));
+        }
 
-            for (size_t i = 3; i < tokens.size(); ++i) {
-                if (expectingFilename) {
-                    if (!regex_match(tokens[i], validFilename)) {
-                        result.success = false;
-                        result.errmsg = "Invalid filename: " + tokens[i];
-                        return false;
-                    }
-                    result.filenames.push_back(tokens[i]);
-                    expectingFilename = false;
-                } else {
-                    result.contents.push_back(tokens[i]);
-                    expectingFilename = true;
+        result.success = (result.filenames.size() == static_cast<size_t>(expectedFiles));
+        if (!result.success) {
+            result.errmsg = "Expected " + to_string(expectedFiles) +
+                            " files, but got " + to_string(result.filenames.size());
+        }
+        result.file_count = result.filenames.size();
+        return result.success;
+    }
+
+    static bool validateWrite(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() == 3 && validFilename(line, tokens[1]) && tokens[2].quoted) {
+            result.success = true;
+            result.file_count = 1;
+            result.filenames.push_back(text(line, tokens[1]));
+            result.contents.push_back(text(line, tokens[2]));
+            return true;
+        }
+
+        int expectedFiles;
+        if (tokens.size() < 4 || !equals(line, tokens[1], "-n") || !parseCount(line, tokens[2], expectedFiles)) {
+            return invalidFormat(result);
+        }
+        result.filenames.reserve((tokens.size() - 2) / 2);
+        result.contents.reserve((tokens.size() - 2) / 2);
+        for (size_t i = 3; i < tokens.size(); ++i) {
+            if ((i - 3) % 2 == 0) {
+                if (!validFilename(line, tokens[i])) {
+                    return fail(result, "Invalid filename: " + text(line, tokens[i]));
                 }
+                result.filenames.push_back(text(line, tokens[i]));
+            } else {
+                result.contents.push_back(text(line, tokens[i]));
             }
+        }
 
-            result.success = (result.filenames.size() == static_cast<size_t>(expectedFiles) && result.contents.size() == static_cast<size_t>(expectedFiles));
-            if (!result.success) {
-                result.errmsg = "Expected " + to_string(expectedFiles) +
-                                " files and contents, but got " + to_string(result.filenames.size()) +
-                                " files and " + to_string(result.contents.size()) + " contents.";
+        result.success = (result.filenames.size() == static_cast<size_t>(expectedFiles) && result.contents.size() == static_cast<size_t>(expectedFiles));
+        if (!result.success) {
+            result.errmsg = "Expected " + to_string(expectedFiles) +
+                            " files and contents, but got " + to_string(result.filenames.size()) +
+                            " files and " + to_string(result.contents.size()) + " contents.";
+        }
+        result.file_count = result.filenames.size();
+        return result.success;
+    }
+
+    // "ls [-l] [-r] [--sort name|size|mtime|ctime] [--min-size <bytes>]
+    // [--max-size <bytes>] [--mtime <seconds>] [--ctime <seconds>] [<dir>]", options in
+    // any order before the directory; "/" names the root, as does leaving it out.
+    static bool validateLs(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        ListOptions &options = result.list_options;
+        size_t next = 1;
+        for (; next < tokens.size(); ++next) {
+            const Token &token = tokens[next];
+            if (equals(line, token, "-l")) {
+                options.long_format = true;
+                continue;
+            }
+            if (equals(line, token, "-r")) {
+                options.reverse = true;
+                continue;
+            }
+            bool sort = equals(line, token, "--sort");
+            bool min_size = equals(line, token, "--min-size");
+            bool max_size = equals(line, token, "--max-size");
+            bool mtime = equals(line, token, "--mtime");
+            bool ctime = equals(line, token, "--ctime");
+            if (!sort && !min_size && !max_size && !mtime && !ctime) {
+                break;
+            }
+            if (++next == tokens.size()) {
+                return invalidFormat(result);
+            }
+            const Token &value = tokens[next];
+            if (sort) {
+                if (equals(line, value, "name")) {
+                    options.order = ListOrder::NAME;
+                } else if (equals(line, value, "size")) {
+                    options.order = ListOrder::SIZE;
+                } else if (equals(line, value, "mtime")) {
+                    options.order = ListOrder::MTIME;
+                } else if (equals(line, value, "ctime")) {
+                    options.order = ListOrder::CTIME;
+                } else {
+                    return fail(result, "Invalid sort key: " + text(line, value));
+                }
+                continue;
+            }
+            uint64_t number;
+            if (!parseNumber(line, value, number) || ((mtime || ctime) && number == 0)) {
+                return fail(result, "Invalid number: " + text(line, value));
+            }
+            if (min_size) {
+                options.min_size = number;
+            } else if (max_size) {
+                options.max_size = number;
+            } else if (mtime) {
+                options.mtime_within = number;
+            } else {
+                options.ctime_within = number;
             }
-            result.file_count = result.filenames.size();
-            return result.success;
         }
+        string dir;
+        if (tokens.size() > next) {
+            if (!equals(line, tokens[next], "/")) {
+                if (!validDirectory(line, tokens[next])) {
+                    return fail(result, "Invalid directory: " + text(line, tokens[next]));
+                }
+                dir = text(line, tokens[next]);
+            }
+            ++next;
+        }
+        if (tokens.size() != next) {
+            return invalidFormat(result);
+        }
+        result.success = true;
+        result.filenames.push_back(dir);
+        return true;
+    }
 
-        result.success = false;
-        result.errmsg = "Invalid command format. Use 'help' command for usage";
-        return false;
+    static bool validateMkdir(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() != 2) {
+            return invalidFormat(result);
+        }
+        if (!validDirectory(line, tokens[1])) {
+            return fail(result, "Invalid directory: " + text(line, tokens[1]));
+        }
+        result.success = true;
+        result.filenames.push_back(text(line, tokens[1]));
+        return true;
     }
 
-    static bool validateLs(const string &input, ValidationResult &result) {
-        if (input != "ls" && input != "ls -l") {
-            result.success = false;
-            result.errmsg = "Invalid command format. Use 'help' command for usage";
-            return false;
+    // "<cmd> <path>"; the path may be quoted to allow spaces.
+    static bool validatePath(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() != 2 || tokens[1].length == 0) {
+            return invalidFormat(result);
         }
         result.success = true;
-        result.long_format = (input == "ls -l");
+        result.filenames.push_back(text(line, tokens[1]));
         return true;
     }
 
-    static bool validateRead(const string &input, ValidationResult &result) {
-        static const regex read(R"(^read\s+([a-zA-Z0-9_]+\.[a-zA-Z0-9_]+)$)");
-        smatch matches;
+    // "compact [<seconds>]": the idle time defaults to 0, i.e. every file.
+    static bool validateCompact(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() > 2) {
+            return invalidFormat(result);
+        }
+        uint64_t idle = 0;
+        if (tokens.size() == 2 && !parseNumber(line, tokens[1], idle)) {
+            return fail(result, "Invalid number: " + text(line, tokens[1]));
+        }
+        result.success = true;
+        result.numbers.push_back(idle);
+        return true;
+    }
 
-        if (regex_match(input, matches, read)) {
-            result.success = true;
-            result.file_count = 1;
-            result.filenames.push_back(matches[1]);
-            return true;
+    // A prefix is the start of a path, such as a directory with its trailing slash.
+    static bool validPrefix(const string &line, const Token &token) {
+        for (size_t i = 0; i < token.length; ++i) {
+            char c = line[token.begin + i];
+            if (token.quoted || (!isNameChar(c) && c != '/' && c != '.')) {
+                return false;
+            }
         }
+        return true;
+    }
 
-        result.success = false;
-        result.errmsg = "Invalid command format. Use 'help' command for usage";
-        return false;
+    // "grep <pattern> [<prefix>]": the pattern may be quoted to hold spaces.
+    static bool validateGrep(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() < 2 || tokens.size() > 3 || tokens[1].length == 0) {
+            return invalidFormat(result);
+        }
+        if (tokens.size() == 3 && !validPrefix(line, tokens[2])) {
+            return fail(result, "Invalid prefix: " + text(line, tokens[2]));
+        }
+        result.success = true;
+        result.contents.push_back(text(line, tokens[1]));
+        result.filenames.push_back(tokens.size() == 3 ? text(line, tokens[2]) : string());
+        return true;
+    }
+
+    // "watch [<prefix>]": every file by default.
+    static bool validateWatch(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() > 2) {
+            return invalidFormat(result);
+        }
+        if (tokens.size() == 2 && !validPrefix(line, tokens[1])) {
+            return fail(result, "Invalid prefix: " + text(line, tokens[1]));
+        }
+        result.success = true;
+        result.filenames.push_back(tokens.size() == 2 ? text(line, tokens[1]) : string());
+        return true;
     }
-    static bool validateDelete(const string &input, ValidationResult &result, const vector<string> &tokens) {
-        static const regex deleteFile(R"(^delete\s+([a-zA-Z0-9_]+\.[a-zA-Z0-9_]+)$)");
-        static const regex deleteMultiple(R"(^delete\s+-n\s+(\d+)\s+(.+)$)");
-        static const regex validFilename(R"([a-zA-Z0-9_]+\.[a-zA-Z0-9]+)");
-        smatch matches;
 
-        if (regex_match(input, matches, deleteFile)) {
+    // "cp <source> <target>" and "mv <source> <target>".
+    static bool validateTransfer(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        if (tokens.size() != 3) {
+            return invalidFormat(result);
+        }
+        for (size_t i = 1; i < 3; ++i) {
+            if (!validFilename(line, tokens[i])) {
+                return fail(result, "Invalid filename: " + text(line, tokens[i]));
+            }
+            result.filenames.push_back(text(line, tokens[i]));
+        }
+        result.success = true;
+        return true;
+    }
+
+    static bool isHandleCommand(const string &line, const Token &command) {
+        return equals(line, command, "open") || equals(line, command, "close") || equals(line, command, "pread") ||
+               equals(line, command, "pwrite") || equals(line, command, "truncate");
+    }
+
+    // "open <filename>", "close <fd>", "pread <fd> <offset> <length>",
+    // "pwrite <fd> <offset> \"<content>\"" and "truncate <fd> <size>".
+    static bool validateHandle(const string &line, const vector<Token> &tokens, ValidationResult &result) {
+        const Token &command = tokens[0];
+        if (equals(line, command, "open")) {
+            if (tokens.size() != 2 || !validFilename(line, tokens[1])) {
+                return invalidFormat(result);
+            }
             result.success = true;
-            result.file_count = 1;
-            result.filenames.push_back(matches[1]);
+            result.filenames.push_back(text(line, tokens[1]));
             return true;
         }
+        size_t numbers = equals(line, command, "close") ? 1 : equals(line, command, "pread") ? 3 : 2;
+        bool content = equals(line, command, "pwrite");
+        if (tokens.size() != 1 + numbers + (content ? 1 : 0) || (content && !tokens.back().quoted)) {
+            return invalidFormat(result);
+        }
+        for (size_t i = 1; i <= numbers; ++i) {
+            uint64_t number;
+            if (!parseNumber(line, tokens[i], number)) {
+                return fail(result, "Invalid number: " + text(line, tokens[i]));
+            }
+            result.numbers.push_back(number);
+        }
+        if (content) {
+            result.contents.push_back(text(line, tokens.back()));
+        }
+        result.success = true;
+        return true;
+    }
 
-        if (regex_match(input, matches, deleteMultiple)) {
-            int expectedFiles = stoi(matches[1]);
-            istringstream iss(matches[2].str());
+    void reportHandle(int fd, FileStatus status) {
+        switch (status) {
+        case FileStatus::BAD_DESCRIPTOR:
+            cout << "Error: bad file descriptor " << fd << endl;
+            break;
+        case FileStatus::NOT_FOUND:
+            cout << "Error: the file open as descriptor " << fd << " no longer exists" << endl;
+            break;
+        case FileStatus::SIZE_LIMIT_EXCEEDED:
+            cout << "Error: descriptor " << fd << " would exceed the maximum file size of " << fs.options.max_file_size
+                 << " bytes" << endl;
+            break;
+        case FileStatus::MEMORY_LIMIT_EXCEEDED:
+            cout << "Error: memory limit of " << fs.budget.bytes_limit() << " bytes reached, cannot write to descriptor "
+                 << fd << endl;
+            break;
+        case FileStatus::LOG_FAILED:
+            cout << "Error: descriptor " << fd << " was changed, but the write-ahead log has failed; the change will be"
+                 << " lost on restart" << endl;
+            break;
+        default:
+            break;
+        }
+    }
 
-            for (size_t i = 3; i < tokens.size(); ++i) {
-                if (!regex_match(tokens[i], validFilename)) {
-                    result.success = false;
-                    result.errmsg = "Invalid filename: " + tokens[i];
-                    return false;
-                }
-                result.filenames.push_back(tokens[i]);
+    // Runs a validated file handle command; `quiet` drops the success messages.
+    void runHandle(const string &line, const Token &command, const ValidationResult &result, bool quiet) {
+        if (equals(line, command, "open")) {
+            int fd;
+            FileStatus status = fs.open_file(result.filenames[0], fd);
+            if (status != FileStatus::OK) {
+                fs.report(OpType::WRITE, result.filenames[0], status);
+            } else if (!quiet) {
+                cout << "opened " << result.filenames[0] << " as descriptor " << fd << endl;
+            }
+            return;
+        }
+        int fd = static_cast<int>(min<uint64_t>(result.numbers[0], INT_MAX));
+        FileStatus status;
+        if (equals(line, command, "close")) {
+            status = fs.close_file(fd);
+            if (status == FileStatus::OK && !quiet) {
+                cout << "descriptor " << fd << " closed" << endl;
+            }
+        } else if (equals(line, command, "pread")) {
+            FileView view;
+            status = fs.pread(fd, result.numbers[1], result.numbers[2], view);
+            if (status == FileStatus::OK) {
+                cout.flush();
+                ScatterWriter writer(STDOUT_FILENO);
+                view.write_to(writer);
+                writer.newline();
+                writer.flush();
             }
+        } else if (equals(line, command, "pwrite")) {
+            status = fs.pwrite(fd, result.numbers[1], result.contents[0]);
+            if (status == FileStatus::OK && !quiet) {
+                cout << "successfully written to descriptor " << fd << " at offset " << result.numbers[1] << endl;
+            }
+        } else {
+            status = fs.truncate(fd, result.numbers[1]);
+            if (status == FileStatus::OK && !quiet) {
+                cout << "descriptor " << fd << " truncated to " << result.numbers[1] << " bytes" << endl;
+            }
+        }
+        reportHandle(fd, status);
+    }
+
+    // Replaces the subscription, if any, with one to the files under `prefix`; quiet
+    // drops the confirmation.
+    void runWatch(const string &prefix, bool quiet) {
+        printEvents();
+        if (watcher) {
+            fs.unwatch(watcher);
+        }
+        watcher = fs.watch(prefix);
+        if (!quiet) {
+            cout << "watching " << (prefix.empty() ? string("all files") : "files under " + prefix) << endl;
+        }
+    }
+
+    void runUnwatch(bool quiet) {
+        if (!watcher) {
+            throw runtime_error("Not watching");
+        }
+        printEvents();
+        fs.unwatch(watcher);
+        watcher.reset();
+        if (!quiet) {
+            cout << "stopped watching" << endl;
+        }
+    }
 
-            result.success = (result.filenames.size() == static_cast<size_t>(expectedFiles));
-            if (!result.success) {
-                result.errmsg = "Expected " + to_string(expectedFiles) +
-                                " files, but got " + to_string(result.filenames.size());
+    // Prints the changes the watcher has queued, and how many it had to drop.
+    void printEvents() {
+        if (!watcher) {
+            return;
+        }
+        static const char *const KINDS[] = {"", "created", "written", "deleted", "reset"};
+        uint64_t lost = 0;
+        watcher->poll(events, lost);
+        for (const auto &event : events) {
+            cout << "[" << event.sequence << "] " << KINDS[static_cast<size_t>(event.kind)];
+            if (event.kind == ChangeKind::RESET) {
+                cout << ": a snapshot was loaded" << endl;
+            } else if (event.kind == ChangeKind::DELETE) {
+                cout << " " << event.filename << endl;
+            } else {
+                cout << " " << event.filename << " (" << event.size << " bytes)" << endl;
             }
-            result.file_count = result.filenames.size();
-            return result.success;
         }
+        if (lost > 0) {
+            cout << "[watch] " << lost << " changes dropped" << endl;
+        }
+    }
 
-        result.success = false;
-        result.errmsg = "Invalid command format. Use 'help' command for usage";
-        return false;
+    // Runs a validated cp or mv; `quiet` drops the success message.
+    void runTransfer(const string &line, const Token &command, const ValidationResult &result, bool quiet) {
+        const string &source = result.filenames[0];
+        const string &target = result.filenames[1];
+        bool copy = equals(line, command, "cp");
+        FileStatus status = copy ? fs.copy_file(source, target) : fs.rename_file(source, target);
+        if (status == FileStatus::NOT_FOUND) {
+            fs.report(OpType::WRITE, source, status);
+        } else if (status != FileStatus::OK) {
+            fs.report(OpType::CREATE, target, status);
+        } else if (!quiet) {
+            cout << (copy ? "copied " : "renamed ") << source << " to " << target << endl;
+        }
+    }
+
+    void help_menu() {
+        cout << "Available commands:" << endl
+             << "  create <filename>                             - Create a new file with the specified filename" << endl
+             << "  create -n <count> <filenames...>              - Create multiple files, all or none; expects <count> filenames" << endl
+             << "  write <filename> \"<content>\"                  - Write content to a file" << endl
+             << "  write -n <count> <filename> \"<content>\" ...   - Write to multiple files, all or none; expects <count> filename/content pairs" << endl
+             << "  create|write --ttl <seconds> ...              - Same, deleting the files <seconds> later; a write without --ttl keeps any expiry" << endl
+             << "  read <filename>                               - Read and display the content of a file" << endl
+             << "  read -n <count> <filenames...>                - Read multiple files; expects <count> filenames" << endl
+             << "  delete <filename>                             - Delete a specific file" << endl
+             << "  delete -n <count> <filenames...>              - Delete multiple files, all or none; expects <count> filenames" << endl
+             << "  cp <source> <target>                          - Copy a file; the copy shares content until either is written" << endl
+             << "  mv <source> <target>                          - Rename a file, possibly into another directory" << endl
+             << "  grep <pattern> [<prefix>]                     - List files containing <pattern>, with its offsets" << endl
+             << "  mkdir <dir>                                   - Create a directory; its parent must exist" << endl
+             << "  ls [<dir>]                                    - List directory contents (the root by default)" << endl
+             << "  ls -l [<dir>]                                 - List directory contents in long format" << endl
+             << "  ls [-l] [-r] --sort name|size|mtime|ctime     - List sorted by a key (-r reverses); files only after dirs" << endl
+             << "  ls [-l] --min-size|--max-size <bytes> [<dir>] - List only files within a size range" << endl
+             << "  ls [-l] --mtime|--ctime <seconds> [<dir>]     - List only files modified/created in the last <seconds>" << endl
+             << "  open <filename>                               - Open a file and print its descriptor" << endl
+             << "  close <fd>                                    - Close a descriptor" << endl
+             << "  pread <fd> <offset> <length>                  - Read up to <length> bytes starting at <offset>" << endl
+             << "  pwrite <fd> <offset> \"<content>\"              - Overwrite bytes starting at <offset>, growing the file if needed" << endl
+             << "  truncate <fd> <size>                          - Cut or zero-extend a file to <size> bytes" << endl
+             << "  save <path>                                   - Save all files to a snapshot image" << endl
+             << "  load <path>                                   - Replace all files with a snapshot image" << endl
+             << "  stats                                         - Show operation, lock and worker pool metrics" << endl
+             << "  compact [<seconds>]                           - Compress files idle for at least <seconds> (default 0)" << endl
+             << "  watch [<prefix>]                              - Print every later change to files under <prefix> after each command" << endl
+             << "  unwatch                                       - Stop printing changes" << endl
+             << "  help                                          - Show this help menu" << endl
+             << "  exit                                          - Exit the program" << endl
+             << "  clear                                         - Clear the screen" << endl;
+    }
+
+    // Script mode state: consecutive single-file create/write/delete commands
+    // accumulate into one mixed MemFS batch, consecutive reads into one scatter-gather
+    // read. Commands on several files are transactions (see queue_command).
+    static const size_t MAX_PIPELINE_OPS = 65536;
+
+    class ScriptState {
+    public:
+        vector<OpType> ops;
+        vector<string> filenames;
+        vector<string> contents;
+        vector<string> reads;
+        PendingBatch inflight;
+        bool has_inflight = false;
+    };
+
+    void drain(ScriptState &state) {
+        if (state.has_inflight) {
+            fs.finish(state.inflight);
+            state.has_inflight = false;
+        }
+    }
+
+    // The previous batch has to finish before the next starts (it may touch the same
+    // files), but the caller keeps parsing the following lines while it runs.
+    void submit(ScriptState &state) {
+        if (state.ops.empty()) {
+            return;
+        }
+        drain(state);
+        state.inflight = fs.submit_ops(move(state.ops), move(state.filenames), move(state.contents));
+        state.has_inflight = true;
+        state.ops.clear();
+        state.filenames.clear();
+        state.contents.clear();
+    }
+
+    void flush_reads(ScriptState &state) {
+        if (!state.reads.empty()) {
+            int count = static_cast<int>(state.reads.size());
+            fs.read_files(count, move(state.reads));
+            state.reads.clear();
+        }
+    }
+
+    // Makes everything queued so far visible: mutations applied, pending reads printed.
+    void barrier(ScriptState &state) {
+        submit(state);
+        drain(state);
+        flush_reads(state);
+        printEvents();
+    }
+
+    static void queue_mutations(ScriptState &state, OpType op, ValidationResult &result) {
+        for (size_t i = 0; i < result.filenames.size(); ++i) {
+            state.ops.push_back(op);
+            state.filenames.push_back(move(result.filenames[i]));
+            state.contents.push_back(op == OpType::WRITE ? move(result.contents[i]) : string());
+        }
+    }
+
+    // A command on one file joins the pipelined batch. One on several files must apply
+    // to all of them or none, so it waits for the batch and commits as a transaction;
+    // so does one with --ttl, since batches do not set expiries.
+    void queue_command(ScriptState &state, OpType op, ValidationResult &result) {
+        if (result.filenames.size() == 1 && result.ttl == 0) {
+            flush_reads(state);
+            queue_mutations(state, op, result);
+            return;
+        }
+        barrier(state);
+        Transaction tx;
+        for (size_t i = 0; i < result.filenames.size(); ++i) {
+            tx.add(op, result.filenames[i], op == OpType::WRITE ? result.contents[i] : string());
+        }
+        if (result.ttl > 0) {
+            tx.expire_after(result.ttl);
+        }
+        fs.apply_transaction(tx, nullptr, op == OpType::CREATE  ? "no files were created"
+                                          : op == OpType::WRITE ? "no files were written"
+                                                                : "no files were deleted");
     }
 
 public:
     CommandInterpreter(size_t thread_count) : fs(thread_count) {}
+    CommandInterpreter(size_t thread_count, const MemFSOptions &options) : fs(thread_count, options) {}
+
+    // Loads a snapshot image quietly; used for the --load startup flag.
+    bool restore(const string &path) {
+        SnapshotStatus status = fs.load_snapshot(path);
+        if (!status.ok) {
+            cerr << "Error: " << status.error << endl;
+        }
+        return status.ok;
+    }
+
+    // Replays and then keeps the write-ahead log, if one was configured.
+    bool open_log() {
+        LogStatus status = fs.open_log();
+        if (!status.ok) {
+            cerr << "Error: " << status.error << endl;
+        }
+        return status.ok;
+    }
+
+    // Changes a watch command asked for are printed before and after the command's own
+    // output, so those made meanwhile by expiry show up too.
     void process(const string &line) {
+        printEvents();
         try {
-            vector<string> tokens = split(line);
+            if (!tokenize(line, tokens)) {
+                throw runtime_error("Invalid command format. Use 'help' command for usage");
+            }
             if (tokens.empty()) {
                 return;
             }
-            const string &command = tokens[0];
-            if (command == "create") {
+            const Token &command = tokens[0];
+            if (equals(line, command, "create")) {
+                ValidationResult result;
+                if (!takeTtl(line, tokens, result) || !validateFileList(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.create_files(result.file_count, move(result.filenames), result.ttl);
+            } else if (equals(line, command, "write")) {
+                ValidationResult result;
+                if (!takeTtl(line, tokens, result) || !validateWrite(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.write_files(result.file_count, move(result.filenames), move(result.contents), result.ttl);
+            } else if (equals(line, command, "read")) {
+                ValidationResult result;
+                if (!validateFileList(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.read_files(result.file_count, move(result.filenames));
+            } else if (equals(line, command, "delete")) {
+                ValidationResult result;
+                if (!validateFileList(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.delete_files(result.file_count, move(result.filenames));
+            } else if (equals(line, command, "ls")) {
+                ValidationResult result;
+                if (!validateLs(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.ls(result.filenames[0], result.list_options);
+            } else if (equals(line, command, "mkdir")) {
+                ValidationResult result;
+                if (!validateMkdir(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.create_directory(result.filenames[0]);
+            } else if (equals(line, command, "grep")) {
+                ValidationResult result;
+                if (!validateGrep(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                fs.grep_files(result.contents[0], result.filenames[0]);
+            } else if (equals(line, command, "cp") || equals(line, command, "mv")) {
                 ValidationResult result;
-                if (!validateCreate(line, result, tokens)) {
+                if (!validateTransfer(line, tokens, result)) {
                     throw runtime_error(result.errmsg);
                 }
-                int number_of_files = result.file_count;
-                vector<string> filenames = result.filenames;
-                fs.create_files(number_of_files, filenames);
-            } else if (command == "write") {
+                runTransfer(line, command, result, false);
+            } else if (isHandleCommand(line, command)) {
                 ValidationResult result;
-                if (!validateWrite(line, result, tokens)) {
+                if (!validateHandle(line, tokens, result)) {
                     throw runtime_error(result.errmsg);
                 }
-                int number_of_files = result.file_count;
-                vector<string> filenames = result.filenames;
-                vector<string> contents = result.contents;
-                fs.write_files(number_of_files, filenames, contents);
-            } else if (command == "read") {
+                runHandle(line, command, result, false);
+            } else if (equals(line, command, "save")) {
                 ValidationResult result;
-                if (!validateRead(line, result)) {
+                if (!validatePath(line, tokens, result)) {
                     throw runtime_error(result.errmsg);
                 }
-                string filename = result.filenames[0];
-                fs.read_file(filename);
-            } else if (command == "delete") {
+                SnapshotStatus status = fs.save_snapshot(result.filenames[0]);
+                if (!status.ok) {
+                    throw runtime_error(status.error);
+                }
+                cout << "saved " << status.files << " files to " << result.filenames[0] << endl;
+            } else if (equals(line, command, "load")) {
                 ValidationResult result;
-                if (!validateDelete(line, result, tokens)) {
+                if (!validatePath(line, tokens, result)) {
                     throw runtime_error(result.errmsg);
                 }
-                int number_of_files = result.file_count;
-                vector<string> filenames = result.filenames;
-                fs.delete_files(number_of_files, filenames);
-            } else if (command == "ls") {
+                SnapshotStatus status = fs.load_snapshot(result.filenames[0]);
+                if (!status.ok) {
+                    throw runtime_error(status.error);
+                }
+                cout << "loaded " << status.files << " files from " << result.filenames[0] << endl;
+            } else if (equals(line, command, "stats")) {
+                fs.stats();
+            } else if (equals(line, command, "compact")) {
                 ValidationResult result;
-                if (!validateLs(line, result)) {
+                if (!validateCompact(line, tokens, result)) {
                     throw runtime_error(result.errmsg);
                 }
-                bool long_format = result.long_format;
-                fs.ls(long_format);
-            } else if (command == "help") {
+                cout << "compressed " << fs.compact_cold(result.numbers[0]) << " files" << endl;
+            } else if (equals(line, command, "watch")) {
+                ValidationResult result;
+                if (!validateWatch(line, tokens, result)) {
+                    throw runtime_error(result.errmsg);
+                }
+                runWatch(result.filenames[0], false);
+            } else if (equals(line, command, "unwatch")) {
+                if (tokens.size() != 1) {
+                    throw runtime_error("Invalid command format. Use 'help' command for usage");
+                }
+                runUnwatch(false);
+            } else if (equals(line, command, "help")) {
                 help_menu();
-            } else if (command == "exit") {
+            } else if (equals(line, command, "exit")) {
                 cout << "exiting memFS" << endl;
                 exit(0);
-            } else if (command == "clear") {
+            } else if (equals(line, command, "clear")) {
                 cout << "\033[2J\033[1;1H";
             } else {
-                throw runtime_error("Unknown command: " + command);
+                throw runtime_error("Unknown command: " + text(line, command));
             }
         } catch (const exception &e) {
             cerr << "Error: " << e.what() << endl;
         }
+        printEvents();
+    }
+
+    // Non-interactive mode: runs every command from `in` without prompts or success
+    // messages (failures and read/ls output are still printed). Mutations are
+    // pipelined as described at ScriptState; every other command acts as a barrier.
+    void run_script(istream &in) {
+        ScriptState state;
+        size_t line_number = 0;
+        for (string line; getline(in, line);) {
+            ++line_number;
+            try {
+                if (!tokenize(line, tokens)) {
+                    throw runtime_error("Invalid command format. Use 'help' command for usage");
+                }
+                if (tokens.empty()) {
+                    continue;
+                }
+                const Token &command = tokens[0];
+                ValidationResult result;
+                if (equals(line, command, "create") || equals(line, command, "delete")) {
+                    if ((equals(line, command, "create") && !takeTtl(line, tokens, result)) ||
+                        !validateFileList(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    queue_command(state, equals(line, command, "create") ? OpType::CREATE : OpType::DELETE, result);
+                } else if (equals(line, command, "write")) {
+                    if (!takeTtl(line, tokens, result) || !validateWrite(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    queue_command(state, OpType::WRITE, result);
+                } else if (equals(line, command, "read")) {
+                    if (!validateFileList(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    submit(state);
+                    drain(state);
+                    for (auto &filename : result.filenames) {
+                        state.reads.push_back(move(filename));
+                    }
+                    if (state.reads.size() >= MAX_PIPELINE_OPS) {
+                        flush_reads(state);
+                    }
+                } else if (equals(line, command, "ls")) {
+                    if (!validateLs(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    fs.ls(result.filenames[0], result.list_options);
+                } else if (equals(line, command, "mkdir")) {
+                    if (!validateMkdir(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    FileStatus status = fs.make_directory(result.filenames[0]);
+                    if (status != FileStatus::OK) {
+                        fs.report(OpType::CREATE, result.filenames[0], status);
+                    }
+                } else if (equals(line, command, "grep")) {
+                    if (!validateGrep(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    fs.grep_files(result.contents[0], result.filenames[0]);
+                } else if (equals(line, command, "cp") || equals(line, command, "mv")) {
+                    if (!validateTransfer(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    runTransfer(line, command, result, true);
+                } else if (isHandleCommand(line, command)) {
+                    if (!validateHandle(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    runHandle(line, command, result, true);
+                } else if (equals(line, command, "save") || equals(line, command, "load")) {
+                    if (!validatePath(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    SnapshotStatus status = equals(line, command, "save") ? fs.save_snapshot(result.filenames[0])
+                                                                          : fs.load_snapshot(result.filenames[0]);
+                    if (!status.ok) {
+                        throw runtime_error(status.error);
+                    }
+                } else if (equals(line, command, "stats")) {
+                    barrier(state);
+                    fs.stats();
+                } else if (equals(line, command, "compact")) {
+                    if (!validateCompact(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    fs.compact_cold(result.numbers[0]);
+                } else if (equals(line, command, "watch")) {
+                    if (!validateWatch(line, tokens, result)) {
+                        throw runtime_error(result.errmsg);
+                    }
+                    barrier(state);
+                    runWatch(result.filenames[0], true);
+                } else if (equals(line, command, "unwatch")) {
+                    if (tokens.size() != 1) {
+                        throw runtime_error("Invalid command format. Use 'help' command for usage");
+                    }
+                    barrier(state);
+                    runUnwatch(true);
+                } else if (equals(line, command, "help")) {
+                    barrier(state);
+                    help_menu();
+                } else if (equals(line, command, "exit")) {
+                    break;
+                } else if (!equals(line, command, "clear")) {
+                    throw runtime_error("Unknown command: " + text(line, command));
+                }
+                if (state.ops.size() >= MAX_PIPELINE_OPS) {
+                    submit(state);
+                }
+            } catch (const exception &e) {
+                cerr << "Error: line " << line_number << ": " << e.what() << endl;
+            }
+        }
+        barrier(state);
     }
 };
 
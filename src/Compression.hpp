@@ -0,0 +1,169 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+// Byte-oriented LZ77 codec in the style of LZ4, used for cold file contents. It
+// favours speed over ratio: one hash probe per position and no entropy coding, so
+// both directions run at memory-copy speeds on text.
+//
+// The output is a run of sequences, each a token byte (literal count in the high
+// nibble, match length - MIN_MATCH in the low one; 15 means more length bytes
+// follow, each added until one is below 255), the literals, then a 2-byte
+// little-endian offset back into the output and any extra match length bytes. The
+// last sequence has literals only. The decoded size is not stored; the caller
+// keeps it.
+class LZCodec {
+private:
+    static const size_t MIN_MATCH = 4;
+    static const size_t MAX_OFFSET = 65535;
+    // The last bytes are always sent as literals, so a match never runs to the end.
+    static const size_t TAIL_LITERALS = 5;
+    static const unsigned MAX_HASH_BITS = 12;
+
+    static uint32_t read32(const char *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static void put_length(string &out, size_t length) {
+        while (length >= 255) {
+            out.push_back(static_cast<char>(255));
+            length -= 255;
+        }
+        out.push_back(static_cast<char>(length));
+    }
+
+    static bool get_length(const unsigned char *&in, const unsigned char *end, size_t &length) {
+        unsigned char byte;
+        do {
+            if (in == end) {
+                return false;
+            }
+            byte = *in++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    }
+
+    static void put_sequence(string &out, const char *literals, size_t literal_count, size_t offset, size_t match) {
+        size_t extra = match - MIN_MATCH;
+        out.push_back(static_cast<char>((min<size_t>(literal_count, 15) << 4) | min<size_t>(extra, 15)));
+        if (literal_count >= 15) {
+            put_length(out, literal_count - 15);
+        }
+        out.append(literals, literal_count);
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (extra >= 15) {
+            put_length(out, extra - 15);
+        }
+    }
+
+public:
+    // Largest output compress() can produce for `size` input bytes.
+    static size_t bound(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    static void compress(const char *in, size_t size, string &out) {
+        out.clear();
+        out.reserve(bound(size));
+        // Small inputs get a small table, so clearing it never costs more than the input.
+        unsigned bits = 8;
+        while (bits < MAX_HASH_BITS && (size_t(1) << bits) < size) {
+            ++bits;
+        }
+        uint32_t table[size_t(1) << MAX_HASH_BITS];
+        memset(table, 0, sizeof(uint32_t) << bits);
+
+        size_t anchor = 0;
+        size_t limit = size > TAIL_LITERALS + MIN_MATCH ? size - TAIL_LITERALS : 0;
+        size_t pos = 0;
+        while (pos + MIN_MATCH <= limit) {
+            uint32_t word = read32(in + pos);
+            size_t slot = (word * 2654435761u) >> (32 - bits);
+            size_t candidate = table[slot];
+            table[slot] = static_cast<uint32_t>(pos);
+            if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(in + candidate) != word) {
+                // Step faster through data that keeps missing.
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+            size_t length = MIN_MATCH;
+            while (pos + length < limit && in[candidate + length] == in[pos + length]) {
+                ++length;
+            }
+            while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+                --pos;
+                --candidate;
+                ++length;
+            }
+            put_sequence(out, in + anchor, pos - anchor, pos - candidate, length);
+            pos += length;
+            anchor = pos;
+        }
+        size_t literal_count = size - anchor;
+        out.push_back(static_cast<char>(min<size_t>(literal_count, 15) << 4));
+        if (literal_count >= 15) {
+            put_length(out, literal_count - 15);
+        }
+        out.append(in + anchor, literal_count);
+    }
+
+    // Decodes exactly `size` bytes into `out`; false if the input is malformed or
+    // does not decode to that size.
+    static bool decompress(const char *in, size_t in_size, char *out, size_t size) {
+        const unsigned char *ip = reinterpret_cast<const unsigned char *>(in);
+        const unsigned char *end = ip + in_size;
+        size_t op = 0;
+        while (ip < end) {
+            unsigned token = *ip++;
+            size_t literal_count = token >> 4;
+            if (literal_count == 15 && !get_length(ip, end, literal_count)) {
+                return false;
+            }
+            if (literal_count > static_cast<size_t>(end - ip) || literal_count > size - op) {
+                return false;
+            }
+            memcpy(out + op, ip, literal_count);
+            ip += literal_count;
+            op += literal_count;
+            if (ip == end) {
+                break;
+            }
+            if (end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+            ip += 2;
+            size_t length = token & 15;
+            if (length == 15 && !get_length(ip, end, length)) {
+                return false;
+            }
+            length += MIN_MATCH;
+            if (offset == 0 || offset > op || length > size - op) {
+                return false;
+            }
+            if (offset >= length) {
+                memcpy(out + op, out + op - offset, length);
+            } else {
+                // Overlapping match: a short pattern repeated, copied forward byte by byte.
+                for (size_t i = 0; i < length; ++i) {
+                    out[op + i] = out[op + i - offset];
+                }
+            }
+            op += length;
+        }
+        return op == size;
+    }
+};
+
+#endif
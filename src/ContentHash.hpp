@@ -0,0 +1,179 @@
+#ifndef CONTENTHASH_HPP
+#define CONTENTHASH_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Streaming 64-bit hash of file contents, for deduplication. It follows the shape of
+// XXH3: eight 64-bit accumulators take one 64-byte stripe at a time with a 32x32
+// multiply per lane against a per-stripe key, and are scrambled every kilobyte. With
+// SSE2 two lanes go per instruction; the scalar loop computes the same values.
+// Segments may be fed in any split, so a version is hashed straight from its blocks,
+// and a saved state lets an append hash only the bytes it adds. Not for use on disk:
+// the value depends on byte order.
+class ContentHash {
+public:
+    static const size_t STRIPE = 64;
+    static const size_t LANES = 8;
+
+private:
+    static const size_t STRIPES_PER_SCRAMBLE = 16;
+    static const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+    static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+
+    uint64_t acc[LANES];
+    unsigned char buffer[STRIPE];
+    size_t buffered = 0;
+    size_t stripes = 0;
+    uint64_t total = 0;
+
+    // Stripe s of a scramble round uses keys s to s + LANES - 1, so equal data in
+    // different stripes of a round adds different terms.
+    static const uint64_t *keys() {
+        static const uint64_t values[LANES + STRIPES_PER_SCRAMBLE] = {
+            0x6b01a1c12a3a2107ULL, 0x6b0404f2b09490b8ULL, 0x48007596a28f5b37ULL, 0xd7e11b1b7aa6540dULL,
+            0xfd5e5ee3374cb756ULL, 0x79827b7acaea0518ULL, 0xf69542b8cecf8a17ULL, 0x2eff2f128330550fULL,
+            0x870d6796814d31e8ULL, 0xc9d4d0203c6e3096ULL, 0x039d74ed00d0722dULL, 0xeeca8c285efcea76ULL,
+            0x6d9deeee95da5109ULL, 0x25199d6011bb55f8ULL, 0xc056855fcb33444bULL, 0xebe718df3b74e9fbULL,
+            0xb1a4a4f93b91e572ULL, 0x6fd5ca040ad67e72ULL, 0xfed0c435ff602bdaULL, 0xc54cb0e4bd1aa3f1ULL,
+            0x682204bbe0029715ULL, 0x711c718a9daaf919ULL, 0xf4ee9a0308b8d0a0ULL, 0x8a473a6a5434b6b5ULL};
+        return values;
+    }
+
+    static uint64_t read64(const unsigned char *p) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    void scramble() {
+        const uint64_t *key = keys() + STRIPES_PER_SCRAMBLE;
+        for (size_t i = 0; i < LANES; ++i) {
+            acc[i] ^= acc[i] >> 47;
+            acc[i] ^= key[i];
+            acc[i] *= PRIME32_1;
+        }
+    }
+
+    // Takes `count` whole stripes from p.
+    void accumulate(const unsigned char *p, size_t count) {
+#ifdef __SSE2__
+        // The lanes stay in registers between scrambles.
+        __m128i lanes[LANES / 2];
+        for (size_t i = 0; i < LANES / 2; ++i) {
+            lanes[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + 2 * i));
+        }
+        for (; count > 0; --count, p += STRIPE) {
+            const uint64_t *key = keys() + stripes % STRIPES_PER_SCRAMBLE;
+            for (size_t i = 0; i < LANES / 2; ++i) {
+                __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+                __m128i mixed = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i *>(key + 2 * i)));
+                __m128i product = _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32));
+                __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+                lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+            }
+            if (++stripes % STRIPES_PER_SCRAMBLE == 0) {
+                for (size_t i = 0; i < LANES / 2; ++i) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + 2 * i), lanes[i]);
+                }
+                scramble();
+                for (size_t i = 0; i < LANES / 2; ++i) {
+                    lanes[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + 2 * i));
+                }
+            }
+        }
+        for (size_t i = 0; i < LANES / 2; ++i) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + 2 * i), lanes[i]);
+        }
+#else
+        for (; count > 0; --count, p += STRIPE) {
+            const uint64_t *key = keys() + stripes % STRIPES_PER_SCRAMBLE;
+            for (size_t i = 0; i < LANES; ++i) {
+                uint64_t data = read64(p + 8 * i);
+                uint64_t mixed = data ^ key[i];
+                acc[i ^ 1] += data;
+                acc[i] += (mixed & 0xffffffffULL) * (mixed >> 32);
+            }
+            if (++stripes % STRIPES_PER_SCRAMBLE == 0) {
+                scramble();
+            }
+        }
+#endif
+    }
+
+    static uint64_t fold(uint64_t a, uint64_t b) {
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
+
+public:
+    ContentHash() {
+        static const uint64_t seeds[LANES] = {0xC2B2AE3DULL,         0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL,
+                                              0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL,
+                                              0x27D4EB2F165667C5ULL, 0x9E3779B1ULL};
+        memcpy(acc, seeds, sizeof(acc));
+    }
+
+    // The state after the whole stripes hashed so far is just the accumulators:
+    // saved with save() after `hashed` bytes, resume(lanes, hashed) continues from there
+    // once given the input from hashed / STRIPE * STRIPE on.
+    void save(uint64_t *lanes) const {
+        memcpy(lanes, acc, sizeof(acc));
+    }
+
+    static ContentHash resume(const uint64_t *lanes, uint64_t hashed) {
+        ContentHash hash;
+        memcpy(hash.acc, lanes, sizeof(hash.acc));
+        hash.stripes = hashed / STRIPE;
+        hash.total = hash.stripes * STRIPE;
+        return hash;
+    }
+
+    void update(const char *data, size_t len) {
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+        total += len;
+        if (buffered > 0) {
+            size_t take = min(len, STRIPE - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            len -= take;
+            if (buffered < STRIPE) {
+                return;
+            }
+            accumulate(buffer, 1);
+            buffered = 0;
+        }
+        size_t whole = len / STRIPE;
+        accumulate(p, whole);
+        p += whole * STRIPE;
+        len -= whole * STRIPE;
+        memcpy(buffer, p, len);
+        buffered = len;
+    }
+
+    uint64_t digest() const {
+        ContentHash last = *this;
+        if (last.buffered > 0) {
+            memset(last.buffer + last.buffered, 0, STRIPE - last.buffered);
+            last.accumulate(last.buffer, 1);
+        }
+        const uint64_t *key = keys();
+        uint64_t result = total * PRIME64_1;
+        for (size_t i = 0; i < LANES; i += 2) {
+            result += fold(last.acc[i] ^ key[(i + 3) % LANES], last.acc[i + 1] ^ key[(i + 4) % LANES]);
+        }
+        result ^= result >> 37;
+        result *= 0x165667919E3779F9ULL;
+        return result ^ (result >> 32);
+    }
+};
+
+#endif
@@ -0,0 +1,324 @@
+#ifndef DIRECTORYTREE_HPP
+#define DIRECTORYTREE_HPP
+
+#include "FileIndex.hpp"
+#include "RWLock.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// A file as its directory lists it: the leaf name and the hash of the full path.
+class DirectoryEntry {
+public:
+    string name;
+    size_t hash;
+};
+
+// One directory. Files are indexed by leaf name only (their content lives in the MemFS
+// file table under the full path, whose hash each entry keeps); subdirectories own
+// their nodes. `lock` guards both. Nodes are shared so a listing can keep the one it
+// is reading alive after dropping every lock.
+//
+// Listing walks this directory's children and nothing else. The files are listed
+// from an immutable name-ordered view, cached until files are added or removed, and
+// each secondary order (see MemFS::ls) is cached as a permutation of that view.
+class Directory : public enable_shared_from_this<Directory> {
+public:
+    static const size_t SECONDARY_ORDERS = 3;
+
+    mutable RWLock lock;
+    system_clock::time_point created_at;
+    // Leaf name -> hash of the full path.
+    FileIndex<size_t> files;
+    map<string, shared_ptr<Directory>> directories;
+    // Bumped by every file added or removed, under the exclusive lock.
+    uint64_t generation = 0;
+
+    // The listing cache, guarded by listing_mutex.
+    mutex listing_mutex;
+    shared_ptr<const vector<DirectoryEntry>> listed;
+    uint64_t listed_generation = UINT64_MAX;
+    shared_ptr<const vector<uint32_t>> orders[SECONDARY_ORDERS];
+
+    Directory() : created_at(system_clock::now()) {}
+    explicit Directory(system_clock::time_point created_at) : created_at(created_at) {}
+
+    // Caller holds lock (shared is enough).
+    bool has_child(const string &leaf, size_t leaf_hash) {
+        return files.find(leaf, leaf_hash) || directories.count(leaf) != 0;
+    }
+
+    // Caller holds lock (shared is enough). The cached view, or null if files were
+    // added or removed since it was built.
+    shared_ptr<const vector<DirectoryEntry>> cached_files() {
+        lock_guard<mutex> guard(listing_mutex);
+        return listed_generation == generation ? listed : nullptr;
+    }
+
+    // Caller holds lock (shared is enough). The files in index order, for building a
+    // new view outside the lock.
+    vector<DirectoryEntry> file_entries() {
+        vector<DirectoryEntry> entries;
+        entries.reserve(files.size());
+        files.for_each([&entries](const FileKey &key, size_t hash) {
+            DirectoryEntry entry;
+            entry.name = key.str();
+            entry.hash = hash;
+            entries.push_back(move(entry));
+        });
+        return entries;
+    }
+
+    // Installs a view built from file_entries() at `built_generation`, unless a newer
+    // one is already cached. Needs no lock.
+    void cache_files(shared_ptr<const vector<DirectoryEntry>> view, uint64_t built_generation) {
+        lock_guard<mutex> guard(listing_mutex);
+        if (listed_generation == UINT64_MAX || built_generation > listed_generation) {
+            listed = move(view);
+            listed_generation = built_generation;
+            for (auto &order : orders) {
+                order.reset();
+            }
+        }
+    }
+
+    // The cached permutation of `view` for secondary order k, if it is for that view.
+    shared_ptr<const vector<uint32_t>> cached_order(size_t k, const shared_ptr<const vector<DirectoryEntry>> &view) {
+        lock_guard<mutex> guard(listing_mutex);
+        return listed == view ? orders[k] : nullptr;
+    }
+
+    void cache_order(size_t k, const shared_ptr<const vector<DirectoryEntry>> &view,
+                     shared_ptr<const vector<uint32_t>> order) {
+        lock_guard<mutex> guard(listing_mutex);
+        if (listed == view) {
+            orders[k] = move(order);
+        }
+    }
+
+    // Bytes a subdirectory costs beyond its file index: its node and make_shared
+    // control block, and its entry in the parent's map (a tree node holding the name,
+    // heap-allocated past 15 characters). The listing cache is not charged.
+    static size_t directory_footprint(size_t leaf_size) {
+        return sizeof(Directory) + 2 * sizeof(void *) + 4 * sizeof(void *) + sizeof(string) +
+               sizeof(shared_ptr<Directory>) + (leaf_size > 15 ? leaf_size + 1 : 0);
+    }
+
+    // Bytes charged for this directory's own file index and names.
+    size_t files_footprint() {
+        size_t bytes = files.memory_bytes();
+        files.for_each([&bytes](const FileKey &key, size_t) { bytes += FileKey::footprint(key.size()); });
+        return bytes;
+    }
+};
+
+// Bounded cache from directory path to node, so resolving the parent of a deep path
+// is one hash probe instead of a walk from the root. It is split into SHARDS, each a
+// FileIndex behind an RWLock: a hit takes the lock shared and only marks the entry as
+// referenced, a miss inserts under the exclusive lock. A full shard is swept CLOCK
+// style, in bulk: entries not referenced since the last sweep are dropped and the
+// rest are unmarked.
+class PathCache {
+private:
+    static const size_t SHARDS = 16;
+
+    class Entry {
+    public:
+        Directory *directory;
+        atomic<bool> referenced;
+
+        explicit Entry(Directory *directory) : directory(directory), referenced(false) {}
+        Entry(Entry &&other) : directory(other.directory), referenced(other.referenced.load(memory_order_relaxed)) {}
+    };
+
+    class CacheShard {
+    public:
+        RWLock lock;
+        FileIndex<Entry> entries;
+    };
+
+    size_t shard_capacity;
+    unique_ptr<CacheShard[]> shards;
+
+    CacheShard &shard_for(size_t hash) {
+        return shards[(hash >> 32) % SHARDS];
+    }
+
+    // Caller holds shard.lock exclusively.
+    static void sweep(CacheShard &shard) {
+        vector<string> stale;
+        shard.entries.for_each([&stale](const FileKey &key, Entry &entry) {
+            if (!entry.referenced.exchange(false, memory_order_relaxed)) {
+                stale.push_back(key.str());
+            }
+        });
+        for (auto &path : stale) {
+            shard.entries.erase(path, hash<string>()(path));
+        }
+    }
+
+public:
+    static const size_t DEFAULT_CAPACITY = 65536;
+
+    explicit PathCache(size_t capacity = DEFAULT_CAPACITY)
+        : shard_capacity(max<size_t>(capacity / SHARDS, 1)), shards(new CacheShard[SHARDS]) {}
+
+    Directory *find(const string &path, size_t hash) {
+        CacheShard &shard = shard_for(hash);
+        SharedLock lock(shard.lock);
+        Entry *entry = shard.entries.find(path, hash);
+        if (!entry) {
+            return nullptr;
+        }
+        if (!entry->referenced.load(memory_order_relaxed)) {
+            entry->referenced.store(true, memory_order_relaxed);
+        }
+        return entry->directory;
+    }
+
+    void insert(const string &path, size_t hash, Directory *directory) {
+        CacheShard &shard = shard_for(hash);
+        lock_guard<RWLock> lock(shard.lock);
+        if (shard.entries.size() >= shard_capacity) {
+            sweep(shard);
+            if (shard.entries.size() >= shard_capacity) {
+                return;
+            }
+        }
+        shard.entries.emplace(path, hash, directory);
+    }
+
+    void clear() {
+        for (size_t s = 0; s < SHARDS; ++s) {
+            FileIndex<Entry> empty;
+            lock_guard<RWLock> lock(shards[s].lock);
+            shards[s].entries.swap(empty);
+        }
+    }
+};
+
+// The directory hierarchy. Paths are relative to the root, with components separated
+// by '/' and no leading or trailing slash; "" is the root itself. There is no lock
+// over the whole tree: each Directory guards its own children, nodes are never
+// removed, and MemFS only swaps in another tree (on snapshot load) while it holds
+// every shard lock, so whoever holds any shard lock may keep raw node pointers.
+class DirectoryTree {
+private:
+    shared_ptr<Directory> root;
+    PathCache cache;
+
+    Directory *walk(const string &path) {
+        static thread_local string component;
+        Directory *node = root.get();
+        size_t begin = 0;
+        while (node && begin <= path.size()) {
+            size_t end = path.find('/', begin);
+            if (end == string::npos) {
+                end = path.size();
+            }
+            component.assign(path, begin, end - begin);
+            SharedLock lock(node->lock);
+            auto it = node->directories.find(component);
+            node = it == node->directories.end() ? nullptr : it->second.get();
+            begin = end + 1;
+        }
+        return node;
+    }
+
+    template <typename F>
+    static void visit(const string &path, Directory &dir, F &f) {
+        SharedLock lock(dir.lock);
+        for (auto &child : dir.directories) {
+            string child_path = path.empty() ? child.first : path + "/" + child.first;
+            f(child_path, *child.second);
+            visit(child_path, *child.second, f);
+        }
+    }
+
+public:
+    DirectoryTree() : root(make_shared<Directory>()) {}
+
+    DirectoryTree(const DirectoryTree &) = delete;
+    DirectoryTree &operator=(const DirectoryTree &) = delete;
+
+    // Position where the last component of `path` starts.
+    static size_t leaf_start(const string &path) {
+        size_t slash = path.rfind('/');
+        return slash == string::npos ? 0 : slash + 1;
+    }
+
+    // The last component of `path`; refers to `path` itself when it has no directory
+    // part, so a root-level name is never copied.
+    static const string &leaf_name(const string &path, size_t leaf, string &scratch) {
+        if (leaf == 0) {
+            return path;
+        }
+        scratch.assign(path, leaf, string::npos);
+        return scratch;
+    }
+
+    // Node of the directory at `path`, or nullptr if there is none.
+    Directory *find(const string &path) {
+        if (path.empty()) {
+            return root.get();
+        }
+        size_t hash = std::hash<string>()(path);
+        Directory *dir = cache.find(path, hash);
+        if (!dir) {
+            dir = walk(path);
+            if (dir) {
+                cache.insert(path, hash, dir);
+            }
+        }
+        return dir;
+    }
+
+    // Directory that holds `path`, whose last component starts at `leaf`.
+    Directory *parent_of(const string &path, size_t leaf) {
+        if (leaf == 0) {
+            return root.get();
+        }
+        static thread_local string parent;
+        parent.assign(path, 0, leaf - 1);
+        return find(parent);
+    }
+
+    // Calls f(path, directory) for every directory below the root, parents before
+    // their children and siblings in name order.
+    template <typename F>
+    void for_each_directory(F f) {
+        visit(string(), *root, f);
+    }
+
+    // Bytes charged for the whole tree: every directory node and file index.
+    size_t memory_bytes() {
+        size_t bytes;
+        {
+            SharedLock lock(root->lock);
+            bytes = root->files_footprint();
+        }
+        for_each_directory([&bytes](const string &path, Directory &dir) {
+            SharedLock lock(dir.lock);
+            bytes += Directory::directory_footprint(path.size() - leaf_start(path)) + dir.files_footprint();
+        });
+        return bytes;
+    }
+
+    void swap(DirectoryTree &other) {
+        root.swap(other.root);
+        cache.clear();
+        other.cache.clear();
+    }
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef FILEINDEX_HPP
+#define FILEINDEX_HPP
+
+#include "SlabPool.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+using namespace std;
+
+// Filename stored in 24 bytes: names up to INLINE_CAPACITY characters live inside
+// the key itself, longer ones spill to a buffer from the NameArena.
+class FileKey {
+private:
+    static const uint32_t INLINE_CAPACITY = 20;
+
+    uint32_t len;
+    union {
+        char inline_data[INLINE_CAPACITY];
+        char *heap_data;
+    };
+
+public:
+    // What a lookup passes for the key (see HashIndex).
+    typedef string Lookup;
+
+    FileKey(const char *data, size_t length) : len(static_cast<uint32_t>(length)) {
+        char *dest = inline_data;
+        if (len > INLINE_CAPACITY) {
+            heap_data = NameArena::allocate(len);
+            dest = heap_data;
+        }
+        memcpy(dest, data, len);
+    }
+
+    explicit FileKey(const string &name) : FileKey(name.data(), name.size()) {}
+
+    FileKey(FileKey &&other) : len(other.len) {
+        memcpy(inline_data, other.inline_data, sizeof(inline_data));
+        other.len = 0;
+    }
+
+    FileKey(const FileKey &) = delete;
+    FileKey &operator=(const FileKey &) = delete;
+
+    ~FileKey() {
+        if (len > INLINE_CAPACITY) {
+            NameArena::deallocate(heap_data, len);
+        }
+    }
+
+    // Heap bytes held for a key of the given length (0 when it fits inline).
+    static size_t footprint(size_t length) {
+        return length > INLINE_CAPACITY ? NameArena::footprint(length) : 0;
+    }
+
+    const char *data() const {
+        return len > INLINE_CAPACITY ? heap_data : inline_data;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    bool equals(const string &name) const {
+        return name.size() == len && memcmp(data(), name.data(), len) == 0;
+    }
+
+    string str() const {
+        return string(data(), len);
+    }
+};
+
+// Open-addressing (linear probing) table from Key to V. Each slot keeps the full hash
+// next to an inline key and the value, so a lookup is one probe sequence over a flat
+// array, with a key compare only on a hash match. Erase uses backward-shift deletion,
+// so there are no tombstones. Not thread-safe; callers hold the lock guarding it.
+//
+// Key is built from, and compared with, a Key::Lookup, which is what callers pass in
+// along with its hash: a FileKey from the name (see FileIndex), or a key that always
+// compares equal when the hash is the whole key.
+template <typename Key, typename V>
+class HashIndex {
+private:
+    typedef typename Key::Lookup Lookup;
+
+    static const size_t INITIAL_CAPACITY = 16;
+
+    struct Slot {
+        size_t hash; // 0 marks an empty slot
+        typename aligned_storage<sizeof(Key), alignof(Key)>::type key_storage;
+        typename aligned_storage<sizeof(V), alignof(V)>::type value_storage;
+
+        Key &key() {
+            return *reinterpret_cast<Key *>(&key_storage);
+        }
+        V &value() {
+            return *reinterpret_cast<V *>(&value_storage);
+        }
+    };
+
+    Slot *slots;
+    size_t capacity;
+    size_t count;
+
+    static size_t stored_hash(size_t hash) {
+        return hash == 0 ? 1 : hash;
+    }
+
+    static void destroy(Slot &slot) {
+        slot.key().~Key();
+        slot.value().~V();
+        slot.hash = 0;
+    }
+
+    static void relocate(Slot &from, Slot &to) {
+        to.hash = from.hash;
+        new (&to.key_storage) Key(move(from.key()));
+        new (&to.value_storage) V(move(from.value()));
+        destroy(from);
+    }
+
+    size_t probe(const Lookup &name, size_t hash) const {
+        size_t mask = capacity - 1;
+        size_t i = hash & mask;
+        while (slots[i].hash != 0 && !(slots[i].hash == hash && slots[i].key().equals(name))) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow(size_t new_capacity) {
+        Slot *old_slots = slots;
+        size_t old_capacity = capacity;
+        capacity = new_capacity;
+        slots = new Slot[capacity]();
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].hash == 0) {
+                continue;
+            }
+            size_t j = old_slots[i].hash & mask;
+            while (slots[j].hash != 0) {
+                j = (j + 1) & mask;
+            }
+            relocate(old_slots[i], slots[j]);
+        }
+        delete[] old_slots;
+    }
+
+public:
+    HashIndex() : slots(new Slot[INITIAL_CAPACITY]()), capacity(INITIAL_CAPACITY), count(0) {}
+
+    HashIndex(const HashIndex &) = delete;
+    HashIndex &operator=(const HashIndex &) = delete;
+
+    ~HashIndex() {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (slots[i].hash != 0) {
+                destroy(slots[i]);
+            }
+        }
+        delete[] slots;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Bytes held by the slot array itself (keys' spilled names and values' own
+    // allocations are not included).
+    size_t memory_bytes() const {
+        return capacity * sizeof(Slot);
+    }
+
+    // Grows the table once so that n entries fit without further resizing.
+    void reserve(size_t n) {
+        size_t new_capacity = capacity;
+        while (n * 4 > new_capacity * 3) {
+            new_capacity *= 2;
+        }
+        if (new_capacity != capacity) {
+            grow(new_capacity);
+        }
+    }
+
+    void swap(HashIndex &other) {
+        std::swap(slots, other.slots);
+        std::swap(capacity, other.capacity);
+        std::swap(count, other.count);
+    }
+
+    V *find(const Lookup &name, size_t hash) {
+        hash = stored_hash(hash);
+        Slot &slot = slots[probe(name, hash)];
+        return slot.hash == 0 ? nullptr : &slot.value();
+    }
+
+    // Returns the value for name and whether it was newly inserted (constructed from args).
+    // The table only grows for a new name, so memory_bytes() is unchanged when the name
+    // is there already.
+    template <typename... Args>
+    pair<V *, bool> emplace(const Lookup &name, size_t hash, Args &&...args) {
+        hash = stored_hash(hash);
+        size_t i = probe(name, hash);
+        if (slots[i].hash != 0) {
+            return make_pair(&slots[i].value(), false);
+        }
+        if ((count + 1) * 4 > capacity * 3) {
+            grow(capacity * 2);
+            i = probe(name, hash);
+        }
+        Slot &slot = slots[i];
+        new (&slot.key_storage) Key(name);
+        new (&slot.value_storage) V(forward<Args>(args)...);
+        slot.hash = hash;
+        ++count;
+        return make_pair(&slot.value(), true);
+    }
+
+    bool erase(const Lookup &name, size_t hash) {
+        hash = stored_hash(hash);
+        size_t i = probe(name, hash);
+        if (slots[i].hash == 0) {
+            return false;
+        }
+        destroy(slots[i]);
+        --count;
+
+        size_t mask = capacity - 1;
+        for (size_t j = (i + 1) & mask; slots[j].hash != 0; j = (j + 1) & mask) {
+            size_t home = slots[j].hash & mask;
+            // Move slot j back into the hole unless its home lies cyclically in (i, j].
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                relocate(slots[j], slots[i]);
+                i = j;
+            }
+        }
+        return true;
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (slots[i].hash != 0) {
+                f(slots[i].key(), slots[i].value());
+            }
+        }
+    }
+};
+
+// Table from filename to V, the names kept in FileKeys.
+template <typename V>
+using FileIndex = HashIndex<FileKey, V>;
+
+#endif
@@ -1,278 +1,3996 @@
 #ifndef MEMFS_HPP
 #define MEMFS_HPP
 
+#include "ChangeFeed.hpp"
+#include "Compression.hpp"
+#include "ContentHash.hpp"
+#include "DirectoryTree.hpp"
+#include "FileIndex.hpp"
+#include "MemoryBudget.hpp"
+#include "Metrics.hpp"
+#include "RWLock.hpp"
+#include "ScatterWriter.hpp"
+#include "Search.hpp"
+#include "SlabPool.hpp"
+#include "Snapshot.hpp"
+#include "ThreadPool.hpp"
+#include "TimerWheel.hpp"
+#include "WriteAheadLog.hpp"
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <fcntl.h>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
-#include <map>
+#include <memory>
 #include <mutex>
 #include <ostream>
 #include <queue>
-#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 using namespace std::chrono;
 
+class FileVersion;
+
+// Content-addressed index for deduplication: a content hash (see ContentHash) maps to
+// the version that was first indexed with that content and is still alive. Entries do
+// not keep versions alive; a version erases its own entry when it is destroyed. Sharded
+// by hash, each shard a HashIndex behind its own mutex.
+class BlobIndex {
+private:
+    static const size_t SHARDS = 64;
+
+    // The content hash is the whole key, so any two entries with the same hash match.
+    class ContentKey {
+    public:
+        typedef uint64_t Lookup;
+
+        explicit ContentKey(uint64_t) {}
+
+        bool equals(uint64_t) const {
+            return true;
+        }
+    };
+
+    class Entry {
+    public:
+        const FileVersion *version = nullptr;
+        weak_ptr<const FileVersion> ref;
+    };
+
+    class Shard {
+    public:
+        mutex lock;
+        HashIndex<ContentKey, Entry> entries;
+    };
+
+    Shard shards[SHARDS];
+
+    Shard &shard_for(uint64_t hash) {
+        return shards[(hash >> 40) % SHARDS];
+    }
+
+public:
+    // Rough cost of an entry, its slot at the table's load factor, charged with every
+    // version.
+    static const size_t ENTRY_BYTES = 64;
+
+    // The live version indexed under `hash`, which may still hold other content; if
+    // there is none, indexes `version` instead and returns null.
+    shared_ptr<const FileVersion> find_or_insert(uint64_t hash, const shared_ptr<const FileVersion> &version) {
+        Shard &shard = shard_for(hash);
+        lock_guard<mutex> guard(shard.lock);
+        pair<Entry *, bool> slot = shard.entries.emplace(hash, hash);
+        if (!slot.second) {
+            // A dead entry's version is about to erase it, and will leave this one be.
+            shared_ptr<const FileVersion> found = slot.first->ref.lock();
+            if (found) {
+                return found;
+            }
+        }
+        slot.first->version = version.get();
+        slot.first->ref = version;
+        return nullptr;
+    }
+
+    // Drops the entry for `hash` if it is still `version`'s.
+    void erase(uint64_t hash, const FileVersion *version) {
+        Shard &shard = shard_for(hash);
+        lock_guard<mutex> guard(shard.lock);
+        Entry *entry = shard.entries.find(hash, hash);
+        if (entry && entry->version == version) {
+            shard.entries.erase(hash, hash);
+        }
+    }
+};
+
+// Immutable content of a file at one point in time, stored as a list of slab Blocks.
+// Successive versions share their blocks, so an append only touches the tail.
+// A file restored from a snapshot starts with its content still in the mapped image:
+// the first `mapped_size` bytes are read from there, and blocks only hold what was
+// appended since. Mapped bytes are file-backed and not charged to the memory budget.
+// A cold file's version may instead be packed: its content compressed into one
+// buffer (see LZCodec and MemFS::compact_cold), with no blocks and no mapping. And a
+// version may be an alias, holding nothing but a pointer to the version whose content
+// it shares (see alias()); copies and deduplicated writes are aliases.
+class FileVersion {
+public:
+    size_t size;
+    system_clock::time_point updated_at;
+    vector<Block *> blocks;
+    shared_ptr<const MappedImage> image;
+    const char *mapped;
+    size_t mapped_size;
+    unique_ptr<char[]> packed;
+    size_t packed_size;
+    // The version whose content an alias shares; never itself an alias.
+    shared_ptr<const FileVersion> origin;
+    // Set, once and before the version is published, when it is entered in a BlobIndex.
+    mutable shared_ptr<BlobIndex> index;
+    mutable uint64_t content_hash;
+    // Saved hash state (see ContentHash::save), kept on indexed versions too big to
+    // rehash on every write so an append hashes only what it adds.
+    mutable unique_ptr<uint64_t[]> hashing;
+    static const size_t HASHING_BYTES = ContentHash::LANES * sizeof(uint64_t);
+    // Numbers the content: a new version takes a fresh number, and only pack() and
+    // unpacked() pass one on, since they keep the content as it was. Two versions with
+    // the same number have the same content (see MemFS::commit).
+    uint64_t sequence;
+    // Numbers are handed to each thread this many at a time.
+    static const uint64_t SEQUENCE_BATCH = 1024;
+
+    explicit FileVersion(system_clock::time_point updated_at)
+        : size(0), updated_at(updated_at), mapped(nullptr), mapped_size(0), packed_size(0), content_hash(0),
+          sequence(next_sequence()) {}
+
+    FileVersion(system_clock::time_point updated_at, shared_ptr<const MappedImage> image, const char *mapped,
+                size_t mapped_size)
+        : size(mapped_size), updated_at(updated_at), image(move(image)), mapped(mapped), mapped_size(mapped_size),
+          packed_size(0), content_hash(0), sequence(next_sequence()) {}
+
+    FileVersion(const FileVersion &) = delete;
+    FileVersion &operator=(const FileVersion &) = delete;
+
+    ~FileVersion() {
+        if (index) {
+            index->erase(content_hash, this);
+        }
+        for (Block *block : blocks) {
+            block->release();
+        }
+    }
+
+    static uint64_t next_sequence() {
+        static atomic<uint64_t> claimed{0};
+        static thread_local uint64_t next = 0;
+        static thread_local uint64_t end = 0;
+        if (next == end) {
+            next = claimed.fetch_add(SEQUENCE_BATCH, memory_order_relaxed) + 1;
+            end = next + SEQUENCE_BATCH;
+        }
+        return next++;
+    }
+
+    // The version that actually holds this one's content.
+    const FileVersion &body() const {
+        return origin ? *origin : *this;
+    }
+
+    // A version with the content of `base` and its own mtime. Nothing is copied and no
+    // block is retained: the alias only points at base (or at what base aliases).
+    static shared_ptr<const FileVersion> alias(const shared_ptr<const FileVersion> &base,
+                                               system_clock::time_point now) {
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(now);
+        next->origin = base->origin ? base->origin : base;
+        next->size = base->size;
+        return next;
+    }
+
+    // Builds the version that is `base` followed by `content`. Existing bytes are never
+    // copied: the blocks are shared, and the new bytes go into the free tail of the last
+    // block if this writer is the first to claim it (otherwise that one block is copied).
+    static shared_ptr<const FileVersion> append(const FileVersion &base, const string &content,
+                                                system_clock::time_point now) {
+        if (base.origin) {
+            return append(*base.origin, content, now);
+        }
+        if (base.packed) {
+            return append(*unpacked(base), content, now);
+        }
+        const size_t capacity = Block::CAPACITY;
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(now, base.image, base.mapped, base.mapped_size);
+        next->blocks.reserve(blocks_for(base.block_bytes() + content.size()));
+        for (Block *block : base.blocks) {
+            block->retain();
+            next->blocks.push_back(block);
+        }
+        next->size = base.size;
+
+        const char *src = content.data();
+        size_t left = content.size();
+        if (left > 0 && !next->blocks.empty()) {
+            uint32_t tail = static_cast<uint32_t>(base.block_bytes() - (base.blocks.size() - 1) * capacity);
+            size_t take = min(left, capacity - tail);
+            if (take > 0) {
+                Block *last = next->blocks.back();
+                uint32_t expected = tail;
+                if (!last->used.compare_exchange_strong(expected, static_cast<uint32_t>(tail + take))) {
+                    Block *copy = Block::create();
+                    memcpy(copy->data, last->data, tail);
+                    copy->used = static_cast<uint32_t>(tail + take);
+                    last->release();
+                    next->blocks.back() = copy;
+                    last = copy;
+                }
+                memcpy(last->data + tail, src, take);
+                src += take;
+                left -= take;
+                next->size += take;
+            }
+        }
+        while (left > 0) {
+            Block *block = Block::create();
+            size_t take = min(left, capacity);
+            memcpy(block->data, src, take);
+            block->used = static_cast<uint32_t>(take);
+            next->blocks.push_back(block);
+            src += take;
+            left -= take;
+            next->size += take;
+        }
+        return next;
+    }
+
+    // Builds the version that is `base` with the bytes at `offset` replaced by `data`,
+    // growing the file if the write runs past its end; a write that starts past the
+    // end first fills the gap with zeros. Only the blocks the range touches are
+    // copied, every other block is shared, and a write at the end is an append.
+    // Content still in a mapped image or packed is first copied into blocks.
+    static shared_ptr<const FileVersion> splice(const FileVersion &base, size_t offset, const string &data,
+                                                system_clock::time_point now) {
+        if (offset >= base.size) {
+            string tail(offset - base.size, '\0');
+            tail += data;
+            return append(base, tail, now);
+        }
+        if (data.empty()) {
+            return append(base, data, now);
+        }
+        if (base.origin) {
+            return splice(*base.origin, offset, data, now);
+        }
+        if (base.packed || offset < base.mapped_size) {
+            return splice(*unpacked(base), offset, data, now);
+        }
+        const size_t capacity = Block::CAPACITY;
+        size_t old_bytes = base.block_bytes();
+        size_t begin = offset - base.mapped_size;
+        size_t end = begin + data.size();
+        size_t new_bytes = max(old_bytes, end);
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(now, base.image, base.mapped, base.mapped_size);
+        size_t count = blocks_for(new_bytes);
+        next->blocks.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            size_t block_begin = i * capacity;
+            size_t block_end = min(block_begin + capacity, new_bytes);
+            // Growth lies inside [begin, end), so an untouched block is one of base's.
+            if (block_end <= begin || block_begin >= end) {
+                base.blocks[i]->retain();
+                next->blocks.push_back(base.blocks[i]);
+                continue;
+            }
+            Block *block = Block::create();
+            if (block_begin < old_bytes) {
+                memcpy(block->data, base.blocks[i]->data, min(capacity, old_bytes - block_begin));
+            }
+            size_t from = max(begin, block_begin);
+            size_t to = min(end, block_end);
+            memcpy(block->data + (from - block_begin), data.data() + (from - begin), to - from);
+            block->used = static_cast<uint32_t>(block_end - block_begin);
+            next->blocks.push_back(block);
+        }
+        next->size = base.mapped_size + new_bytes;
+        return next;
+    }
+
+    // Builds `base` cut to, or zero-extended to, `size` bytes. Cutting shares the
+    // blocks that remain; the last one may then hold stale bytes past the new end,
+    // which the next append copies the block to overwrite (its `used` no longer
+    // matches).
+    static shared_ptr<const FileVersion> resize(const FileVersion &base, size_t size, system_clock::time_point now) {
+        if (size >= base.size) {
+            return append(base, string(size - base.size, '\0'), now);
+        }
+        if (base.origin) {
+            return resize(*base.origin, size, now);
+        }
+        if (base.packed) {
+            return resize(*unpacked(base), size, now);
+        }
+        if (size <= base.mapped_size) {
+            return make_shared<const FileVersion>(now, size > 0 ? base.image : nullptr, base.mapped, size);
+        }
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(now, base.image, base.mapped, base.mapped_size);
+        size_t count = blocks_for(size - base.mapped_size);
+        next->blocks.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            base.blocks[i]->retain();
+            next->blocks.push_back(base.blocks[i]);
+        }
+        next->size = size;
+        return next;
+    }
+
+    static size_t blocks_for(size_t size) {
+        const size_t capacity = Block::CAPACITY;
+        return (size + capacity - 1) / capacity;
+    }
+
+    // Bytes held by a version with block_count blocks: the version itself and its
+    // make_shared control block, its BlobIndex entry, the block pointer array and the
+    // blocks.
+    static size_t footprint(size_t block_count) {
+        return sizeof(FileVersion) + 2 * sizeof(void *) + BlobIndex::ENTRY_BYTES +
+               block_count * (sizeof(Block *) + Block::SIZE);
+    }
+
+    // A packed version holds its compressed bytes instead of blocks. An alias is
+    // charged what its origin is, as if the content were its own: the memory budget
+    // counts every file in full, shared or not (shared content shows in stats).
+    size_t footprint() const {
+        if (origin) {
+            return origin->footprint();
+        }
+        return footprint(blocks.size()) + packed_size + (hashing ? HASHING_BYTES : 0);
+    }
+
+    // Bytes the content occupies: the compressed buffer of a packed version, else the
+    // mapped bytes plus the whole of each block, and nothing for an alias. `size` is
+    // the logical size.
+    size_t stored_bytes() const {
+        if (origin) {
+            return 0;
+        }
+        return packed ? packed_size : mapped_size + blocks.size() * Block::SIZE;
+    }
+
+    // The same content with everything copied into blocks, out of a mapped image or
+    // the packed buffer.
+    static shared_ptr<const FileVersion> unpacked(const FileVersion &base) {
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(base.updated_at);
+        next->size = base.size;
+        next->sequence = base.sequence;
+        const size_t capacity = Block::CAPACITY;
+        string content = base.str();
+        next->blocks.reserve(blocks_for(content.size()));
+        for (size_t at = 0; at < content.size(); at += capacity) {
+            Block *block = Block::create();
+            size_t take = min(content.size() - at, capacity);
+            memcpy(block->data, content.data() + at, take);
+            block->used = static_cast<uint32_t>(take);
+            next->blocks.push_back(block);
+        }
+        return next;
+    }
+
+    // The packed form of `base`, or null if it is empty, already packed or an alias, or
+    // if compressing it would not use less memory. Mapped bytes cost nothing, so a file
+    // still mostly in a mapped image is normally left as it is. Same size and mtime.
+    static shared_ptr<const FileVersion> pack(const FileVersion &base) {
+        if (base.size == 0 || base.packed || base.origin) {
+            return nullptr;
+        }
+        string content = base.str();
+        string compressed;
+        LZCodec::compress(content.data(), content.size(), compressed);
+        if (footprint(0) + compressed.size() >= base.footprint()) {
+            return nullptr;
+        }
+        // The blocks go once the packed version is published, so make sure it decodes
+        // to the content first.
+        string decoded(content.size(), '\0');
+        if (!LZCodec::decompress(compressed.data(), compressed.size(), &decoded[0], decoded.size()) ||
+            decoded != content) {
+            return nullptr;
+        }
+        shared_ptr<FileVersion> next = make_shared<FileVersion>(base.updated_at);
+        next->size = base.size;
+        next->sequence = base.sequence;
+        next->packed.reset(new char[compressed.size()]);
+        memcpy(next->packed.get(), compressed.data(), compressed.size());
+        next->packed_size = compressed.size();
+        return next;
+    }
+
+    // Content bytes held in blocks rather than in the mapped image.
+    size_t block_bytes() const {
+        return size - mapped_size;
+    }
+
+    // Calls f(data, len) for each contiguous run of content, in order.
+    template <typename F>
+    void for_each_segment(F f) const {
+        for_each_segment_in(0, size, f);
+    }
+
+    // Same, for the bytes in [offset, offset + length) only; starts at the block
+    // holding `offset` rather than walking the ones before it. A packed version is
+    // decoded into a temporary for the call, so f must not keep the pointer then;
+    // MemFS unpacks a file before handing out a view of it.
+    template <typename F>
+    void for_each_segment_in(size_t offset, size_t length, F f) const {
+        if (origin) {
+            origin->for_each_segment_in(offset, length, f);
+            return;
+        }
+        const size_t capacity = Block::CAPACITY;
+        size_t end = offset + min(length, size - min(offset, size));
+        if (packed) {
+            if (offset < end) {
+                string content = str();
+                f(content.data() + offset, end - offset);
+            }
+            return;
+        }
+        if (offset < mapped_size && offset < end) {
+            size_t take = min(end, mapped_size) - offset;
+            f(mapped + offset, take);
+            offset += take;
+        }
+        size_t position = offset - min(offset, mapped_size);
+        size_t stop = end - min(end, mapped_size);
+        for (size_t i = position / capacity; position < stop; ++i) {
+            size_t within = position - i * capacity;
+            size_t take = min(capacity - within, stop - position);
+            f(static_cast<const char *>(blocks[i]->data) + within, take);
+            position += take;
+        }
+    }
+
+    void write_to(ostream &out) const {
+        for_each_segment([&out](const char *data, size_t len) { out.write(data, len); });
+    }
+
+    string str() const {
+        if (origin) {
+            return origin->str();
+        }
+        string content;
+        if (packed) {
+            content.resize(size);
+            if (!LZCodec::decompress(packed.get(), packed_size, &content[0], size)) {
+                // pack() checked the buffer decoded, so it has been overwritten since;
+                // the content is gone, and serving the garbage as the file is worse.
+                cerr << "Error: the compressed content of a file is corrupt" << endl;
+                abort();
+            }
+            return content;
+        }
+        content.reserve(size);
+        for_each_segment([&content](const char *data, size_t len) { content.append(data, len); });
+        return content;
+    }
+};
+
+// Zero-copy, read-only view of a file's content. It pins the version it was taken
+// from, so the bytes stay valid (and unchanged) however the file is later written to
+// or deleted, and no lock is held while the view is alive. A view may cover only a
+// byte range of the file (see MemFS::pread).
+class FileView {
+private:
+    shared_ptr<const FileVersion> version;
+    size_t offset = 0;
+    size_t length = 0;
+
+public:
+    FileView() = default;
+    explicit FileView(shared_ptr<const FileVersion> version) : version(move(version)) {
+        length = this->version ? this->version->size : 0;
+    }
+    // The bytes in [offset, offset + length), clipped to the end of the file.
+    FileView(shared_ptr<const FileVersion> version, size_t offset, size_t length)
+        : version(move(version)), offset(offset) {
+        size_t size = this->version ? this->version->size : 0;
+        this->length = offset < size ? min(length, size - offset) : 0;
+    }
+
+    bool valid() const {
+        return static_cast<bool>(version);
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    system_clock::time_point updated_at() const {
+        return version->updated_at;
+    }
+
+    template <typename F>
+    void for_each_segment(F f) const {
+        if (version) {
+            version->for_each_segment_in(offset, length, f);
+        }
+    }
+
+    void write_to(ScatterWriter &writer) const {
+        for_each_segment([&writer](const char *data, size_t len) { writer.add(data, len); });
+    }
+
+    string str() const {
+        string content;
+        content.reserve(length);
+        for_each_segment([&content](const char *data, size_t len) { content.append(data, len); });
+        return content;
+    }
+};
+
+// ctime-style text for a time point ("Wed Jun 30 21:49:08 1993"). A listing prints the
+// same few seconds over and over, so each thread keeps the text of recent seconds in a
+// small direct-mapped table and only formats on a miss. localtime_r, unlike ctime, is
+// safe to call from several threads at once.
+class TimeText {
+private:
+    static const size_t SLOTS = 256;
+
+    class Slot {
+    public:
+        bool valid = false;
+        time_t seconds = 0;
+        size_t length = 0;
+        char text[32];
+    };
+
+public:
+    static void append(string &out, system_clock::time_point point) {
+        static thread_local Slot slots[SLOTS];
+        time_t seconds = system_clock::to_time_t(point);
+        Slot &slot = slots[static_cast<size_t>(seconds) % SLOTS];
+        if (!slot.valid || slot.seconds != seconds) {
+            tm parts;
+            localtime_r(&seconds, &parts);
+            slot.length = strftime(slot.text, sizeof(slot.text), "%a %b %e %H:%M:%S %Y", &parts);
+            slot.seconds = seconds;
+            slot.valid = true;
+        }
+        out.append(slot.text, slot.length);
+    }
+};
+
+// A file's pending expiry, in its shard's timer wheel while armed (see
+// MemFS::expire_locked). `expires_at` is the deadline as logged and saved, in
+// nanoseconds since the epoch; the name and hash find the file once the timer fires.
+class FileTimer : public TimerLink {
+public:
+    string name;
+    size_t hash;
+    int64_t expires_at = 0;
+
+    FileTimer(const string &name, size_t hash) : name(name), hash(hash) {}
+};
+
+// A file's content and mtime live in an immutable FileVersion. Writers build a new
+// version and publish it with an atomic compare-and-swap, so readers only ever copy
+// a reference-counted pointer and keep their snapshot alive after dropping the lock.
+// `accessed` is the MemFS cold clock reading at the last read or write (see
+// MemFS::touch). `timer` is set while the file has an expiry; it is guarded by the
+// shard's timer_mutex, and a copy of the file does not get it.
 class File {
 public:
     system_clock::time_point created_at;
-    system_clock::time_point updated_at;
-    string content;
+    shared_ptr<const FileVersion> version;
+    atomic<uint32_t> accessed{0};
+    unique_ptr<FileTimer> timer;
+
+    File() : created_at(system_clock::now()), version(make_shared<const FileVersion>(created_at)) {}
+    File(system_clock::time_point created_at, shared_ptr<const FileVersion> version)
+        : created_at(created_at), version(move(version)) {}
+    File(const File &other) : created_at(other.created_at), version(other.snapshot()), accessed(other.accessed.load()) {}
+    // Only used while the table relocates slots under the exclusive shard lock.
+    File(File &&other)
+        : created_at(other.created_at), version(move(other.version)), accessed(other.accessed.load()),
+          timer(move(other.timer)) {}
+    File &operator=(const File &other) {
+        created_at = other.created_at;
+        atomic_store(&version, other.snapshot());
+        accessed = other.accessed.load();
+        return *this;
+    }
+
+    shared_ptr<const FileVersion> snapshot() const {
+        return atomic_load(&version);
+    }
+
+    bool publish(shared_ptr<const FileVersion> &expected, const shared_ptr<const FileVersion> &next) {
+        return atomic_compare_exchange_strong(&version, &expected, next);
+    }
+
+    size_t getSize() const {
+        return snapshot()->size;
+    }
+
+    static string format_time(system_clock::time_point point) {
+        string text;
+        TimeText::append(text, point);
+        return text;
+    }
+
+    string getCreatedTime() const {
+        return format_time(created_at);
+    }
+
+    string getUpdatedTime() const {
+        return format_time(snapshot()->updated_at);
+    }
+};
+
+enum class FileStatus {
+    OK,
+    ALREADY_EXISTS,
+    NOT_FOUND,
+    SIZE_LIMIT_EXCEEDED,
+    MEMORY_LIMIT_EXCEEDED,
+    NO_SUCH_DIRECTORY,
+    BAD_DESCRIPTOR,
+    // A transaction saw a file that has changed since (see MemFS::commit).
+    CONFLICT,
+    // The change was made in memory, but the write-ahead log has failed, so it will
+    // not survive a restart (see WriteAheadLog).
+    LOG_FAILED
+};
+
+class MemFSOptions {
+public:
+    size_t shard_count = 64;
+    // Largest content a single file may hold, in bytes.
+    size_t max_file_size = 2048;
+    // Ceiling on all bytes MemFS allocates for files (index, names, versions and
+    // blocks); 0 means unlimited.
+    size_t memory_limit = 0;
+    // Write-ahead log file; empty keeps MemFS purely in memory. See LogMode.
+    string log_path;
+    LogMode log_mode = LogMode::BATCHED;
+    // Keep operation, lock and pool metrics (see MemFSMetrics).
+    bool metrics = true;
+    // Seconds a file may go unread and unwritten before a background pass compresses
+    // its content (see MemFS::compact_cold); 0 turns the pass off.
+    size_t cold_after = 0;
+};
+
+// Orders `ls` can list files in. SIZE, MTIME and CTIME index Directory::orders.
+enum class ListOrder {
+    SIZE,
+    MTIME,
+    CTIME,
+    NAME
+};
+
+class ListOptions {
+public:
+    bool long_format = false;
+    ListOrder order = ListOrder::NAME;
+    bool reverse = false;
+    // Filters; they select files only, so a filtered listing shows no subdirectories.
+    size_t min_size = 0;
+    size_t max_size = SIZE_MAX;
+    // Only files modified / created within this many seconds; 0 means any time.
+    uint64_t mtime_within = 0;
+    uint64_t ctime_within = 0;
+
+    bool filtered() const {
+        return min_size > 0 || max_size != SIZE_MAX || mtime_within > 0 || ctime_within > 0;
+    }
+};
+
+enum class OpType {
+    CREATE,
+    WRITE,
+    DELETE
+};
+
+// Operation kinds MemFSMetrics breaks down by: the OpTypes plus reads, transaction
+// commits, copies and renames.
+enum class MetricOp {
+    CREATE,
+    WRITE,
+    READ,
+    DELETE,
+    COMMIT,
+    COPY,
+    RENAME
+};
+
+// Counters behind the `stats` command. Operation and lock-acquisition counts are
+// exact. Single-file operations are timed one in LatencySampler::SAMPLE_EVERY; a
+// batch chunk is timed as a whole, and each of its operations is recorded at its share
+// of the time the chunk held the shard lock. Lock wait is the time from asking for a
+// shard lock to getting it, hold is the time until it is released.
+class MemFSMetrics {
+public:
+    static const size_t OP_KINDS = 7;
+
+    bool enabled;
+    steady_clock::time_point started;
+    ShardedCounter operations[OP_KINDS];
+    ShardedCounter failures[OP_KINDS];
+    ShardedHistogram latency[OP_KINDS];
+    ShardedCounter lock_acquisitions;
+    ShardedCounter lock_contended;
+    ShardedHistogram lock_wait;
+    ShardedHistogram lock_hold;
+    PoolMetrics pool;
+
+    explicit MemFSMetrics(bool enabled) : enabled(enabled), started(steady_clock::now()) {}
+
+    static MetricOp kind_of(OpType op) {
+        switch (op) {
+        case OpType::CREATE:
+            return MetricOp::CREATE;
+        case OpType::WRITE:
+            return MetricOp::WRITE;
+        case OpType::DELETE:
+            break;
+        }
+        return MetricOp::DELETE;
+    }
+
+    static const char *name_of(MetricOp op) {
+        static const char *const NAMES[OP_KINDS] = {"create", "write", "read", "delete", "commit", "copy", "rename"};
+        return NAMES[static_cast<size_t>(op)];
+    }
+};
+
+// Locks a guard built with defer_lock; returns whether the lock was held by someone
+// else, i.e. whether taking it had to wait.
+template <typename Guard>
+bool lock_contended(Guard &guard) {
+    if (guard.try_lock()) {
+        return false;
+    }
+    guard.lock();
+    return true;
+}
+
+// Times one single-file operation for MemFSMetrics. Unsampled operations only count;
+// the clock is read only for sampled ones.
+class OpProbe {
+private:
+    MemFSMetrics &metrics;
+    size_t op;
+    bool sampled;
+    steady_clock::time_point start;
+    steady_clock::time_point locked;
+    steady_clock::time_point unlocked;
+
+public:
+    OpProbe(MemFSMetrics &metrics, MetricOp op)
+        : metrics(metrics), op(static_cast<size_t>(op)), sampled(metrics.enabled && LatencySampler::sample()) {
+        if (sampled) {
+            start = steady_clock::now();
+        }
+    }
+
+    // Takes the (deferred) shard lock, counting whether it had to wait for it.
+    template <typename Guard>
+    void acquire(Guard &guard) {
+        bool contended = lock_contended(guard);
+        if (metrics.enabled) {
+            metrics.lock_acquisitions.add(1);
+            if (contended) {
+                metrics.lock_contended.add(1);
+            }
+            if (sampled) {
+                locked = steady_clock::now();
+            }
+        }
+    }
+
+    void released() {
+        if (sampled) {
+            unlocked = steady_clock::now();
+        }
+    }
+
+    void finish(FileStatus status) {
+        if (!metrics.enabled) {
+            return;
+        }
+        metrics.operations[op].add(1);
+        if (status != FileStatus::OK) {
+            metrics.failures[op].add(1);
+        }
+        if (sampled) {
+            metrics.latency[op].record(nanoseconds_between(start, steady_clock::now()));
+            metrics.lock_wait.record(nanoseconds_between(start, locked));
+            metrics.lock_hold.record(nanoseconds_between(locked, unlocked));
+        }
+    }
+};
+
+// Point-in-time copy of the metrics, as returned by MemFS::metrics_snapshot(). Times
+// are in microseconds; worker_utilization is the share of worker time spent running
+// tasks since start-up, in percent.
+class MetricsSnapshot {
+public:
+    class Operation {
+    public:
+        const char *name;
+        int64_t count;
+        int64_t failed;
+        LatencySummary latency;
+    };
+
+    bool enabled = false;
+    double uptime_seconds = 0;
+    size_t files = 0;
+    int64_t bytes_stored = 0;
+    // Files whose content is compressed, their logical bytes and the compressed bytes.
+    int64_t cold_files = 0;
+    int64_t cold_bytes = 0;
+    int64_t cold_stored = 0;
+    int64_t shared_files = 0;
+    int64_t shared_bytes = 0;
+    // Files with an expiry, and files expired since start-up.
+    int64_t expiring_files = 0;
+    int64_t expired_files = 0;
+    size_t memory_used = 0;
+    size_t memory_limit = 0;
+    vector<Operation> operations;
+    int64_t lock_acquisitions = 0;
+    int64_t lock_contended = 0;
+    LatencySummary lock_wait;
+    LatencySummary lock_hold;
+    size_t workers = 0;
+    size_t queue_depth = 0;
+    size_t peak_queue_depth = 0;
+    int64_t tasks = 0;
+    LatencySummary task_wait;
+    LatencySummary task_run;
+    double worker_utilization = 0;
+};
+
+// One submitted batch. It owns the (moved-in) operations, names and contents; the
+// pool works on it in chunks of `order`, which lists input positions grouped by shard.
+// Operations may be mixed; those on the same name are applied in input order.
+class Batch {
+public:
+    vector<OpType> ops;
+    vector<string> filenames;
+    vector<string> contents;
+    vector<size_t> hashes;
+    vector<size_t> order;
+    BatchLatch<FileStatus> latch;
+
+    Batch(vector<OpType> &&ops, vector<string> &&filenames, vector<string> &&contents, size_t parts)
+        : ops(move(ops)), filenames(move(filenames)), contents(move(contents)), latch(this->filenames.size(), parts) {}
+};
+
+// A batch in flight: its per-file results arrive through `results`, and `batch` keeps
+// the inputs around so failures can be reported by name.
+class PendingBatch {
+public:
+    shared_ptr<const Batch> batch;
+    future<vector<FileStatus>> results;
+};
+
+// Operations applied together or not at all by MemFS::commit; those on the same name
+// apply in the order they were added. Files read through MemFS::read(Transaction &,
+// ...) are remembered with the version seen, and the commit checks them too.
+class Transaction {
+public:
+    vector<OpType> ops;
+    vector<string> filenames;
+    vector<string> contents;
+    // Files read through the transaction and the versions seen, null if the file did
+    // not exist.
+    vector<string> read_names;
+    vector<shared_ptr<const FileVersion>> read_versions;
+    // Expiry deadline, in nanoseconds since the epoch, for every file the transaction
+    // creates or writes; 0 leaves their expiry as it is.
+    int64_t expires_at = 0;
+
+    // Longer times to live are cut to this (a century), which keeps deadlines in range.
+    static const uint64_t MAX_TTL = 100ULL * 365 * 24 * 3600;
+
+    // Deadline `ttl` seconds from now, in nanoseconds since the epoch; 0 for a ttl of 0.
+    static int64_t deadline_after(uint64_t ttl) {
+        if (ttl == 0) {
+            return 0;
+        }
+        seconds length(static_cast<int64_t>(ttl < MAX_TTL ? ttl : MAX_TTL));
+        return duration_cast<nanoseconds>((system_clock::now() + length).time_since_epoch()).count();
+    }
+
+    // Makes the files created or written expire `ttl` seconds from now.
+    void expire_after(uint64_t ttl) {
+        expires_at = deadline_after(ttl);
+    }
+
+    void create(const string &filename) {
+        add(OpType::CREATE, filename, string());
+    }
+
+    void write(const string &filename, const string &content) {
+        add(OpType::WRITE, filename, content);
+    }
+
+    void remove(const string &filename) {
+        add(OpType::DELETE, filename, string());
+    }
+
+    void add(OpType op, const string &filename, const string &content) {
+        ops.push_back(op);
+        filenames.push_back(filename);
+        contents.push_back(content);
+    }
+};
+
+// Outcome of MemFS::commit. `status` is OK if the transaction was applied, CONFLICT
+// if a file it saw had changed, or else the first operation's failure. `statuses`
+// has one entry per operation (OK for those that did not fail), and `failed` names
+// every file that failed or conflicted once, in the order the transaction met them.
+class TransactionResult {
+public:
+    FileStatus status = FileStatus::OK;
+    vector<FileStatus> statuses;
+    vector<string> failed;
+};
+
+// A file MemFS::grep found the pattern in, with the offset of every occurrence.
+class GrepMatch {
+public:
+    string filename;
+    vector<size_t> offsets;
+};
+
+// create/delete change the shard's map and take files_lock exclusively; read and
+// write only look a file up, so they share it and never block one another. A mkdir
+// takes the lock of the shard its path hashes to exclusively, and an ls the same one
+// shared, so the directory tree is never swapped out under either (see DirectoryTree).
+class Shard {
+public:
+    FileIndex<File> files;
+    mutable RWLock files_lock;
+    // Bumped under the exclusive lock by every create, delete and load, i.e. whenever
+    // entries of `files` may have moved (see FileHandle).
+    uint64_t layout = 0;
+    // Expiry timers of the shard's files. Changing a file's timer takes files_lock
+    // (shared is enough) and then timer_mutex; the expiry thread advances the wheel
+    // under timer_mutex alone.
+    mutex timer_mutex;
+    TimerWheel<FileTimer> timers;
+    // Subscriptions (see MemFS::watch), copied into every shard. Changed only with all
+    // shard locks held exclusively, so an operation reads it under the lock it already
+    // holds.
+    vector<shared_ptr<Watcher>> watchers;
+};
+
+// An open file. The name, its hash and its shard are resolved once, at open. The
+// handle also keeps the File* it found last and the shard's layout at that time, and
+// uses the pointer directly while the layout is unchanged; after a create or delete
+// in the shard it probes again with the saved hash. created_at tells the opened file
+// apart from a later one of the same name, so a handle to a deleted file stays stale
+// (NOT_FOUND) rather than following the name.
+class FileHandle {
+public:
+    string filename;
+    size_t hash;
+    Shard *shard;
+    system_clock::time_point created_at;
+    // Guards the cached pointer; taken under the shard lock.
+    mutex cache_mutex;
+    File *file = nullptr;
+    uint64_t layout = 0;
+
+    // Caller holds shard->files_lock (shared is enough).
+    File *resolve() {
+        lock_guard<mutex> guard(cache_mutex);
+        if (layout != shard->layout) {
+            file = shard->files.find(filename, hash);
+            layout = shard->layout;
+        }
+        return file && file->created_at == created_at ? file : nullptr;
+    }
+};
+
+// Descriptor table. The lowest free descriptor is handed out first, as in POSIX.
+// Operations hold `lock` shared while they use a handle, so close, which takes it
+// exclusively, never frees one in use. Lock order: this lock, then a shard lock.
+class HandleTable {
+public:
+    RWLock lock;
+    vector<unique_ptr<FileHandle>> handles;
+    priority_queue<int, vector<int>, greater<int>> free_descriptors;
+
+    // Caller holds lock.
+    FileHandle *find(int fd) const {
+        return fd >= 0 && static_cast<size_t>(fd) < handles.size() ? handles[fd].get() : nullptr;
+    }
+};
+
+class MemFS {
+private:
+    static size_t hash_name(const string &filename) {
+        return hash<string>()(filename);
+    }
+
+    // The index inside a shard probes with the low bits of the hash, so pick the shard
+    // from the high bits to keep the two independent.
+    Shard &shard_for(size_t hash) {
+        return shards[(hash >> 32) % shards.size()];
+    }
+
+    // Files per pool task. A chunk touches one shard and takes its lock once.
+    static const size_t CHUNK_SIZE = 64;
+
+    // Bytes a file costs beyond its slot in the index: its spilled name plus its current version.
+    static size_t file_footprint(const string &filename, const FileVersion &version) {
+        return FileKey::footprint(filename.size()) + version.footprint();
+    }
+
+    // Offsets grep_files prints per file.
+    static const size_t GREP_PRINTED_OFFSETS = 16;
+
+    // Resolution of the expiry wheels: a file expires within one tick of its deadline.
+    static const int64_t EXPIRY_TICK_NS = 100 * 1000 * 1000;
+    // Expired files deleted per exclusive hold of a shard lock.
+    static const size_t EXPIRY_CHUNK = 256;
+
+    // Bytes an expiry timer costs.
+    static size_t timer_footprint(size_t name_size) {
+        return sizeof(FileTimer) + name_size;
+    }
+
+    // Lines of ls output formatted before they are written out in one go.
+    static const size_t LIST_PAGE_LINES = 1024;
+
+    // A file as a listing pinned it; version is null if it was deleted first.
+    class ListedFile {
+    public:
+        system_clock::time_point created_at;
+        shared_ptr<const FileVersion> version;
+    };
+
+    static bool listed(const ListedFile &file, const ListOptions &options, system_clock::time_point now) {
+        if (file.version->size < options.min_size || file.version->size > options.max_size) {
+            return false;
+        }
+        if (options.mtime_within > 0 && now - file.version->updated_at > seconds(options.mtime_within)) {
+            return false;
+        }
+        return options.ctime_within == 0 || now - file.created_at <= seconds(options.ctime_within);
+    }
+
+    // Order for `ls` sorted by size, mtime or ctime: a permutation of the directory's
+    // name-ordered view, ties kept in name order. This is a sort-on-demand cache, not
+    // an index maintained on write: each directory keeps the last permutation per key
+    // alongside the view, and a listing reuses it after one linear check that it is
+    // still sorted, sorting afresh otherwise. ctime never changes, so that order lasts
+    // until a file is added or removed; size and mtime orders are re-sorted once
+    // writes have reordered the files. Keeping them current on every write instead
+    // would put a directory lock on the write path.
+    shared_ptr<const vector<uint32_t>> listing_order(Directory &dir, const shared_ptr<const vector<DirectoryEntry>> &view,
+                                                     ListOrder order, const vector<ListedFile> &pinned) {
+        vector<int64_t> keys(pinned.size(), 0);
+        for (size_t i = 0; i < pinned.size(); ++i) {
+            const ListedFile &file = pinned[i];
+            if (!file.version) {
+                continue;
+            }
+            switch (order) {
+            case ListOrder::SIZE:
+                keys[i] = static_cast<int64_t>(file.version->size);
+                break;
+            case ListOrder::MTIME:
+                keys[i] = to_nanoseconds(file.version->updated_at);
+                break;
+            default:
+                keys[i] = to_nanoseconds(file.created_at);
+                break;
+            }
+        }
+        auto before = [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b] || (keys[a] == keys[b] && a < b); };
+        size_t k = static_cast<size_t>(order);
+        shared_ptr<const vector<uint32_t>> cached = dir.cached_order(k, view);
+        if (cached && cached->size() == keys.size() && is_sorted(cached->begin(), cached->end(), before)) {
+            return cached;
+        }
+        shared_ptr<vector<uint32_t>> sorted = make_shared<vector<uint32_t>>(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            (*sorted)[i] = static_cast<uint32_t>(i);
+        }
+        sort(sorted->begin(), sorted->end(), before);
+        dir.cache_order(k, view, sorted);
+        return sorted;
+    }
+
+    // Records an access to `file` for cold tracking. The clock only moves once per
+    // compaction pass, so on a hot file this is a load and a compare, with no store.
+    void touch(File &file) {
+        uint32_t now = cold_clock.load(memory_order_relaxed);
+        if (file.accessed.load(memory_order_relaxed) != now) {
+            file.accessed.store(now, memory_order_relaxed);
+        }
+    }
+
+    // Counts `version` in (sign 1) or out of (sign -1) the cold and shared counters,
+    // as it becomes or stops being a file's current version.
+    void count_version(const FileVersion &version, int64_t sign) {
+        if (version.packed) {
+            cold_files.add(sign);
+            cold_bytes.add(sign * static_cast<int64_t>(version.size));
+            cold_stored.add(sign * static_cast<int64_t>(version.packed_size));
+        }
+        if (version.origin) {
+            shared_files.add(sign);
+            shared_bytes.add(sign * static_cast<int64_t>(version.size));
+        }
+    }
+
+    // Compares two versions of the same size segment by segment, without copying.
+    static bool same_content(const FileVersion &a, const FileVersion &b) {
+        vector<pair<const char *, size_t>> segments;
+        a.for_each_segment([&](const char *data, size_t length) { segments.push_back(make_pair(data, length)); });
+        size_t i = 0;
+        size_t used = 0;
+        bool same = true;
+        b.for_each_segment([&](const char *data, size_t length) {
+            while (same && length > 0) {
+                size_t n = min(length, segments[i].second - used);
+                same = memcmp(data, segments[i].first + used, n) == 0;
+                data += n;
+                length -= n;
+                used += n;
+                if (used == segments[i].second) {
+                    ++i;
+                    used = 0;
+                }
+            }
+        });
+        return same;
+    }
+
+    // Bigger contents are only hashed for deduplication as they are appended to, from
+    // the hash state kept on the version (see FileVersion::hashing); other writes to
+    // them leave them out of the index.
+    static const size_t REHASH_LIMIT = 512;
+
+    // The version to publish for `next`, built from `base` (by appending to it, if
+    // `appended`). If the index knows a version with the same content, that is an alias
+    // of it, with next's mtime, and next is dropped; otherwise next itself, entered in
+    // the index. Without a match, a write pays for the hash and one index update.
+    shared_ptr<const FileVersion> deduplicated(const shared_ptr<const FileVersion> &next, const FileVersion &base,
+                                               bool appended) {
+        if (next->size == 0) {
+            return next;
+        }
+        const FileVersion &prior = base.body();
+        ContentHash hash;
+        auto feed = [&hash](const char *data, size_t length) { hash.update(data, length); };
+        if (appended && prior.hashing) {
+            size_t resumed = base.size / ContentHash::STRIPE * ContentHash::STRIPE;
+            hash = ContentHash::resume(prior.hashing.get(), resumed);
+            next->for_each_segment_in(resumed, next->size - resumed, feed);
+        } else if (base.size <= REHASH_LIMIT) {
+            next->for_each_segment(feed);
+        } else {
+            return next;
+        }
+        // All set before the index makes next visible to other writers.
+        if (next->size > REHASH_LIMIT) {
+            next->hashing.reset(new uint64_t[ContentHash::LANES]);
+            hash.save(next->hashing.get());
+        }
+        next->content_hash = hash.digest();
+        next->index = blobs;
+        shared_ptr<const FileVersion> found = blobs->find_or_insert(next->content_hash, next);
+        if (found) {
+            // Another version holds the hash: share it if the content really is the
+            // same, and leave next out of the index either way.
+            next->index.reset();
+            if (found->size == next->size && same_content(*found, *next)) {
+                return FileVersion::alias(found, next->updated_at);
+            }
+        }
+        return next;
+    }
+
+    // The file's current version for a reader, unpacked if its content was compressed.
+    // Caller holds the shard lock (shared is enough). Reading a file warms it up again:
+    // the unpacked version replaces the packed one, content and mtime unchanged, and is
+    // not logged. If the memory budget cannot take it, the reader gets it as a
+    // private copy instead and the file stays packed.
+    shared_ptr<const FileVersion> readable(File &file) {
+        touch(file);
+        shared_ptr<const FileVersion> current = file.snapshot();
+        while (current->body().packed) {
+            shared_ptr<const FileVersion> next = FileVersion::unpacked(*current);
+            size_t growth = next->footprint() - min(next->footprint(), current->footprint());
+            if (!budget.reserve(growth)) {
+                return next;
+            }
+            if (file.publish(current, next)) {
+                count_version(*current, -1);
+                count_version(*next, 1);
+                return next;
+            }
+            budget.release(growth);
+        }
+        return current;
+    }
+
+    // Background compaction: a pass every quarter of options.cold_after (at least a
+    // second), until the destructor stops it.
+    void run_compactor() {
+        seconds period(max<size_t>(1, options.cold_after / 4));
+        unique_lock<mutex> lock(compactor_mutex);
+        while (!compactor_wake.wait_for(lock, period, [this]() { return compactor_stopping; })) {
+            lock.unlock();
+            compact_cold(options.cold_after);
+            lock.lock();
+        }
+    }
+
+    // Wheel tick at which a deadline (nanoseconds since the epoch) is due, rounded up so
+    // no file expires early. Wall time is mapped onto the steady clock once, at start-up,
+    // so later changes to the system clock do not move deadlines already set.
+    uint64_t expiry_tick(int64_t expires_at) const {
+        int64_t after = expires_at - expiry_wall_start;
+        return after > 0 ? static_cast<uint64_t>((after + EXPIRY_TICK_NS - 1) / EXPIRY_TICK_NS) : 0;
+    }
+
+    uint64_t current_tick() const {
+        return nanoseconds_between(expiry_start, steady_clock::now()) / EXPIRY_TICK_NS;
+    }
+
+    // Sets the timer of `file` to `expires_at`, creating it if the file had none (the
+    // caller has reserved its footprint then), and arms it. Caller holds
+    // shard.timer_mutex.
+    void arm_timer(Shard &shard, File &file, const string &filename, size_t hash, int64_t expires_at) {
+        if (!file.timer) {
+            file.timer.reset(new FileTimer(filename, hash));
+            expiring_files.add(1);
+        } else if (file.timer->linked()) {
+            shard.timers.cancel(file.timer.get());
+        }
+        file.timer->expires_at = expires_at;
+        file.timer->deadline = expiry_tick(expires_at);
+        shard.timers.insert(file.timer.get());
+    }
+
+    // Removes the file's expiry, if it has one. Caller holds shard.timer_mutex.
+    void drop_timer(Shard &shard, File &file) {
+        if (!file.timer) {
+            return;
+        }
+        if (file.timer->linked()) {
+            shard.timers.cancel(file.timer.get());
+        }
+        budget.release(timer_footprint(file.timer->name.size()));
+        file.timer.reset();
+        expiring_files.add(-1);
+    }
+
+    // Same, for a caller holding shard.files_lock exclusively, which keeps everyone else
+    // from changing file.timer.
+    void drop_expiry(Shard &shard, File &file) {
+        if (file.timer) {
+            lock_guard<mutex> guard(shard.timer_mutex);
+            drop_timer(shard, file);
+        }
+    }
+
+    // Key under which changes to `file` are ordered in the log (WriteAheadLog::append_if).
+    // The entry stays put while the shard lock is held, shared or not, which is when
+    // changes to one file can race.
+    static size_t log_key(const File &file) {
+        return reinterpret_cast<uintptr_t>(&file);
+    }
+
+    // Gives the file an expiry at `expires_at` (nanoseconds since the epoch), or none if
+    // 0, and logs the change. Caller holds shard.files_lock (shared is enough). With the
+    // log on, the timer changes inside the file's log ordering (see log_key), so
+    // concurrent changes to one file are logged in the order they took effect. With
+    // `reserved`, the caller has reserved the timer's footprint already, and this cannot
+    // fail.
+    FileStatus expire_locked(Shard &shard, File &file, const string &filename, size_t hash, int64_t expires_at,
+                             uint64_t &logged, bool reserved = false) {
+        size_t cost = expires_at != 0 ? timer_footprint(filename.size()) : 0;
+        if (cost > 0 && !reserved && !budget.reserve(cost)) {
+            return FileStatus::MEMORY_LIMIT_EXCEEDED;
+        }
+        auto apply = [&]() {
+            lock_guard<mutex> guard(shard.timer_mutex);
+            if (expires_at == 0) {
+                drop_timer(shard, file);
+                return true;
+            }
+            if (file.timer) {
+                budget.release(cost);
+            }
+            arm_timer(shard, file, filename, hash, expires_at);
+            return true;
+        };
+        if (wal) {
+            string record(reinterpret_cast<const char *>(&expires_at), sizeof(expires_at));
+            logged = max(logged, wal->append_if(log_key(file), LogOp::EXPIRE, filename, record, apply));
+        } else {
+            apply();
+        }
+        if (expires_at != 0) {
+            start_expirer();
+        }
+        return FileStatus::OK;
+    }
+
+    // Starts the expiry thread, once some file has an expiry. With a log configured it
+    // waits for open_log, so nothing expires while the log is still being replayed.
+    void start_expirer() {
+        if (!options.log_path.empty() && !wal) {
+            return;
+        }
+        lock_guard<mutex> lock(expirer_mutex);
+        if (!expirer.joinable() && !expirer_stopping) {
+            expirer = thread(&MemFS::run_expirer, this);
+        }
+    }
+
+    // Expires files every tick until the destructor stops it.
+    void run_expirer() {
+        nanoseconds period(static_cast<int64_t>(EXPIRY_TICK_NS));
+        unique_lock<mutex> lock(expirer_mutex);
+        while (!expirer_wake.wait_for(lock, period, [this]() { return expirer_stopping; })) {
+            lock.unlock();
+            expire_due();
+            lock.lock();
+        }
+    }
+
+    // Deletes the files whose deadline has passed and returns how many. Per shard, the
+    // wheel is advanced under timer_mutex, which only touches the timers that fire,
+    // then the files are deleted EXPIRY_CHUNK at a time under the exclusive shard lock,
+    // released between chunks so other operations on the shard wait for one chunk at
+    // most. The deletes are logged like any other.
+    size_t expire_due() {
+        uint64_t tick = current_tick();
+        size_t expired = 0;
+        vector<pair<string, size_t>> due;
+        for (auto &shard : shards) {
+            due.clear();
+            {
+                lock_guard<mutex> guard(shard.timer_mutex);
+                shard.timers.advance(tick, [&due](FileTimer *timer) { due.emplace_back(timer->name, timer->hash); });
+            }
+            for (size_t begin = 0; begin < due.size(); begin += EXPIRY_CHUNK) {
+                size_t end = min(due.size(), begin + EXPIRY_CHUNK);
+                uint64_t logged = 0;
+                {
+                    unique_lock<RWLock> lock(shard.files_lock);
+                    for (size_t i = begin; i < end; ++i) {
+                        // Since its timer fired the file may have been given a new
+                        // expiry, lost it, or been replaced by another of that name.
+                        File *file = shard.files.find(due[i].first, due[i].second);
+                        bool fired;
+                        {
+                            lock_guard<mutex> guard(shard.timer_mutex);
+                            fired = file && file->timer && !file->timer->linked() && file->timer->deadline <= tick;
+                        }
+                        if (fired && delete_locked(shard, due[i].first, due[i].second, logged) == FileStatus::OK) {
+                            ++expired;
+                        }
+                    }
+                }
+                await_log(logged, FileStatus::OK);
+            }
+        }
+        expired_files.add(static_cast<int64_t>(expired));
+        return expired;
+    }
+
+    // Enters file `filename` (whose leaf name starts at `leaf`, and whose full name
+    // hashes to `hash`) in its parent directory, under the directory's lock; false if
+    // the parent has a subdirectory of that name.
+    bool link_file(Directory &parent, const string &filename, size_t leaf, size_t hash) {
+        string scratch;
+        const string &name = DirectoryTree::leaf_name(filename, leaf, scratch);
+        size_t name_hash = leaf == 0 ? hash : hash_name(name);
+        lock_guard<RWLock> lock(parent.lock);
+        if (!parent.directories.empty() && parent.directories.count(name) != 0) {
+            return false;
+        }
+        size_t index_before = parent.files.memory_bytes();
+        parent.files.emplace(name, name_hash, hash);
+        ++parent.generation;
+        budget.charge(parent.files.memory_bytes() - index_before);
+        return true;
+    }
+
+    void unlink_file(Directory &parent, const string &filename, size_t leaf, size_t hash) {
+        string scratch;
+        const string &name = DirectoryTree::leaf_name(filename, leaf, scratch);
+        size_t name_hash = leaf == 0 ? hash : hash_name(name);
+        lock_guard<RWLock> lock(parent.lock);
+        parent.files.erase(name, name_hash);
+        ++parent.generation;
+    }
+
+    // Offers a change to the shard's watchers that cover the file. Caller holds
+    // shard.files_lock (shared is enough); with nobody watching this is one comparison.
+    void notify(const Shard &shard, ChangeKind kind, const string &filename, uint64_t size) {
+        for (const auto &watcher : shard.watchers) {
+            if (watcher->matches(filename)) {
+                watcher->offer(kind, filename, size);
+            }
+        }
+    }
+
+    // The *_locked helpers expect the caller to hold shard.files_lock: exclusively for
+    // create/delete/mkdir/copy/rename, shared for write. With the log on, a successful
+    // operation is logged before the lock is released and `logged` is raised to its log
+    // position. A file is entered in its directory after the table, under the
+    // directory's lock, which is where a clash with a subdirectory of the same name is
+    // caught.
+    FileStatus create_locked(Shard &shard, const string &filename, size_t hash, uint64_t &logged) {
+        FileStatus status = add_locked(shard, filename, hash);
+        if (status != FileStatus::OK) {
+            return status;
+        }
+        if (wal) {
+            logged = max(logged, wal->append(LogOp::CREATE, filename, string()));
+        }
+        notify(shard, ChangeKind::CREATE, filename, 0);
+        return FileStatus::OK;
+    }
+
+    // The part of create_locked that enters the empty file, without logging or notifying.
+    FileStatus add_locked(Shard &shard, const string &filename, size_t hash) {
+        size_t leaf = DirectoryTree::leaf_start(filename);
+        Directory *parent = tree.parent_of(filename, leaf);
+        if (!parent) {
+            return FileStatus::NO_SUCH_DIRECTORY;
+        }
+        size_t cost = FileKey::footprint(filename.size()) + FileVersion::footprint(0) +
+                      FileKey::footprint(filename.size() - leaf);
+        if (!budget.reserve(cost)) {
+            return shard.files.find(filename, hash) ? FileStatus::ALREADY_EXISTS : FileStatus::MEMORY_LIMIT_EXCEEDED;
+        }
+        // Whatever the table grew by is charged, whether or not the name was new.
+        size_t table_before = shard.files.memory_bytes();
+        bool created = shard.files.emplace(filename, hash).second;
+        budget.charge(shard.files.memory_bytes() - table_before);
+        if (!created) {
+            budget.release(cost);
+            return FileStatus::ALREADY_EXISTS;
+        }
+        ++shard.layout;
+        if (!link_file(*parent, filename, leaf, hash)) {
+            shard.files.erase(filename, hash);
+            budget.release(cost);
+            return FileStatus::ALREADY_EXISTS;
+        }
+        ++file_count;
+        return FileStatus::OK;
+    }
+
+    FileStatus write_locked(Shard &shard, const string &filename, size_t hash, const string &content,
+                            uint64_t &logged) {
+        File *file = shard.files.find(filename, hash);
+        if (!file) {
+            return FileStatus::NOT_FOUND;
+        }
+        shared_ptr<const FileVersion> current = file->snapshot();
+        shared_ptr<const FileVersion> next;
+        while (true) {
+            size_t new_size = current->size + content.length();
+            if (new_size > options.max_file_size) {
+                return FileStatus::SIZE_LIMIT_EXCEEDED;
+            }
+            // Reserved up front from the size alone; settled below once deduplication
+            // has decided what next really costs.
+            size_t before = current->footprint();
+            size_t estimate = FileVersion::footprint(FileVersion::blocks_for(new_size - current->mapped_size));
+            size_t reserved = estimate - min(estimate, before);
+            if (!budget.reserve(reserved)) {
+                return FileStatus::MEMORY_LIMIT_EXCEEDED;
+            }
+            next = deduplicated(FileVersion::append(*current, content, system_clock::now()), *current, true);
+            size_t after = next->footprint();
+            size_t growth = after - min(after, before);
+            if (growth > reserved) {
+                if (!budget.reserve(growth - reserved)) {
+                    budget.release(reserved);
+                    return FileStatus::MEMORY_LIMIT_EXCEEDED;
+                }
+                reserved = growth;
+            }
+            bool published;
+            if (wal) {
+                uint64_t position = wal->append_if(log_key(*file), LogOp::WRITE, filename, content,
+                                                   [&]() { return file->publish(current, next); });
+                published = position != 0;
+                logged = max(logged, position);
+            } else {
+                published = file->publish(current, next);
+            }
+            if (published) {
+                budget.release(reserved - growth + (before - min(before, after)));
+                count_version(*current, -1);
+                count_version(*next, 1);
+                touch(*file);
+                content_bytes.add(static_cast<int64_t>(content.size()));
+                notify(shard, ChangeKind::WRITE, filename, next->size);
+                return FileStatus::OK;
+            }
+            budget.release(reserved);
+        }
+    }
+
+    // Replaces the file's content with build(current version), retrying if another
+    // writer publishes first; shared by pwrite and truncate. With the log on, the
+    // change is logged as `op` with `record` as its content.
+    template <typename Build>
+    FileStatus update_locked(Shard &shard, File &file, const string &filename, LogOp op, const string &record,
+                             Build build, uint64_t &logged) {
+        shared_ptr<const FileVersion> current = file.snapshot();
+        while (true) {
+            shared_ptr<const FileVersion> next = build(*current);
+            if (next->size > options.max_file_size) {
+                return FileStatus::SIZE_LIMIT_EXCEEDED;
+            }
+            next = deduplicated(next, *current, false);
+            size_t before = current->footprint();
+            size_t after = next->footprint();
+            if (after > before && !budget.reserve(after - before)) {
+                return FileStatus::MEMORY_LIMIT_EXCEEDED;
+            }
+            bool published;
+            if (wal) {
+                uint64_t position = wal->append_if(log_key(file), op, filename, record,
+                                                   [&]() { return file.publish(current, next); });
+                published = position != 0;
+                logged = max(logged, position);
+            } else {
+                published = file.publish(current, next);
+            }
+            if (published) {
+                if (after < before) {
+                    budget.release(before - after);
+                }
+                count_version(*current, -1);
+                count_version(*next, 1);
+                touch(file);
+                content_bytes.add(static_cast<int64_t>(next->size) - static_cast<int64_t>(current->size));
+                notify(shard, ChangeKind::WRITE, filename, next->size);
+                return FileStatus::OK;
+            }
+            if (after > before) {
+                budget.release(after - before);
+            }
+        }
+    }
+
+    static string pwrite_record(size_t offset, const string &data) {
+        string record;
+        record.reserve(sizeof(uint64_t) + data.size());
+        uint64_t position = offset;
+        record.append(reinterpret_cast<const char *>(&position), sizeof(position));
+        record.append(data);
+        return record;
+    }
+
+    FileStatus pwrite_locked(Shard &shard, File &file, const string &filename, size_t offset, const string &data,
+                             uint64_t &logged) {
+        return update_locked(shard, file, filename, LogOp::PWRITE, wal ? pwrite_record(offset, data) : string(),
+                             [&](const FileVersion &current) {
+                                 return FileVersion::splice(current, offset, data, system_clock::now());
+                             },
+                             logged);
+    }
+
+    FileStatus truncate_locked(Shard &shard, File &file, const string &filename, size_t size, uint64_t &logged) {
+        if (size > options.max_file_size) {
+            return FileStatus::SIZE_LIMIT_EXCEEDED;
+        }
+        return update_locked(shard, file, filename, LogOp::TRUNCATE, wal ? pwrite_record(size, string()) : string(),
+                             [&](const FileVersion &current) {
+                                 return FileVersion::resize(current, size, system_clock::now());
+                             },
+                             logged);
+    }
+
+    // Runs f(shard, file, name, logged) for the file behind descriptor fd under the
+    // shared shard lock, probed as `kind`; BAD_DESCRIPTOR if fd is not open, NOT_FOUND
+    // if its file is gone.
+    template <typename F>
+    FileStatus with_handle(int fd, MetricOp kind, F f) {
+        SharedLock table_lock(handles.lock);
+        FileHandle *handle = handles.find(fd);
+        if (!handle) {
+            return FileStatus::BAD_DESCRIPTOR;
+        }
+        uint64_t logged = 0;
+        FileStatus status = FileStatus::NOT_FOUND;
+        OpProbe probe(metrics, kind);
+        {
+            SharedLock lock(handle->shard->files_lock, defer_lock);
+            probe.acquire(lock);
+            File *file = handle->resolve();
+            if (file) {
+                status = f(*handle->shard, *file, handle->filename, logged);
+            }
+        }
+        probe.released();
+        table_lock.unlock();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
+    }
+
+    // Same for a file named directly; used by log replay.
+    template <typename F>
+    FileStatus with_file(const string &filename, MetricOp kind, F f) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status = FileStatus::NOT_FOUND;
+        OpProbe probe(metrics, kind);
+        {
+            SharedLock lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            File *file = shard.files.find(filename, hash);
+            if (file) {
+                status = f(shard, *file, filename, logged);
+            }
+        }
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
+    }
+
+    // Caller holds the target's shard exclusively and the source's shared (just the one,
+    // exclusively, if they are the same). The source is pinned under its log ordering
+    // for writes, so the COPY record lands after exactly the writes to the source the
+    // copy has, and replaying it copies the same content.
+    FileStatus copy_locked(Shard &from, const string &source, size_t source_hash, Shard &shard,
+                           const string &target, size_t hash, uint64_t &logged) {
+        File *source_file = from.files.find(source, source_hash);
+        if (!source_file) {
+            return FileStatus::NOT_FOUND;
+        }
+        FileStatus status = FileStatus::OK;
+        size_t size = 0;
+        auto apply = [&]() {
+            // Pinned first: entering the target may move the source's slot.
+            shared_ptr<const FileVersion> pinned = source_file->snapshot();
+            size = pinned->size;
+            if (size == 0) {
+                status = add_locked(shard, target, hash);
+                return status == FileStatus::OK;
+            }
+            shared_ptr<const FileVersion> copy = FileVersion::alias(pinned, system_clock::now());
+            size_t growth = copy->footprint() - FileVersion::footprint(0);
+            if (!budget.reserve(growth)) {
+                status = shard.files.find(target, hash) ? FileStatus::ALREADY_EXISTS
+                                                        : FileStatus::MEMORY_LIMIT_EXCEEDED;
+                return false;
+            }
+            status = add_locked(shard, target, hash);
+            if (status != FileStatus::OK) {
+                budget.release(growth);
+                return false;
+            }
+            File *file = shard.files.find(target, hash);
+            atomic_store(&file->version, copy);
+            count_version(*copy, 1);
+            touch(*file);
+            content_bytes.add(static_cast<int64_t>(copy->size));
+            return true;
+        };
+        if (wal) {
+            logged = max(logged, wal->append_if(log_key(*source_file), LogOp::COPY, source, target, apply));
+        } else {
+            apply();
+        }
+        if (status == FileStatus::OK) {
+            notify(shard, ChangeKind::CREATE, target, size);
+        }
+        return status;
+    }
+
+    // Hands the expiry of a file being renamed to its new entry, rearmed in the target
+    // shard's wheel (it may have fired already; it then fires again on the next tick).
+    // Caller holds both shards' files_lock exclusively.
+    void move_timer(Shard &from, File &source, Shard &to, File &target, const string &target_name,
+                    size_t target_hash) {
+        unique_ptr<FileTimer> timer;
+        {
+            lock_guard<mutex> guard(from.timer_mutex);
+            if (source.timer->linked()) {
+                from.timers.cancel(source.timer.get());
+            }
+            timer = move(source.timer);
+        }
+        budget.release(timer_footprint(timer->name.size()));
+        budget.charge(timer_footprint(target_name.size()));
+        timer->name = target_name;
+        timer->hash = target_hash;
+        lock_guard<mutex> guard(to.timer_mutex);
+        target.timer = move(timer);
+        to.timers.insert(target.timer.get());
+    }
+
+    // Caller holds both shards' files_lock exclusively (one lock if they are the same).
+    // The file is entered under its new name, table then directory, before the old
+    // entries go, so a clash leaves it where it was.
+    FileStatus rename_locked(Shard &from, const string &source, size_t source_hash, Shard &to, const string &target,
+                             size_t target_hash, uint64_t &logged) {
+        File *file = from.files.find(source, source_hash);
+        if (!file) {
+            return FileStatus::NOT_FOUND;
+        }
+        if (source == target) {
+            return FileStatus::OK;
+        }
+        size_t leaf = DirectoryTree::leaf_start(target);
+        Directory *parent = tree.parent_of(target, leaf);
+        if (!parent) {
+            return FileStatus::NO_SUCH_DIRECTORY;
+        }
+        size_t cost = FileKey::footprint(target.size()) + FileKey::footprint(target.size() - leaf);
+        if (!budget.reserve(cost)) {
+            return to.files.find(target, target_hash) ? FileStatus::ALREADY_EXISTS
+                                                       : FileStatus::MEMORY_LIMIT_EXCEEDED;
+        }
+        // Copied out first: the emplace may move the source's slot.
+        File moved(*file);
+        size_t table_before = to.files.memory_bytes();
+        pair<File *, bool> placed = to.files.emplace(target, target_hash, moved.created_at, moved.snapshot());
+        budget.charge(to.files.memory_bytes() - table_before);
+        if (!placed.second) {
+            budget.release(cost);
+            return FileStatus::ALREADY_EXISTS;
+        }
+        placed.first->accessed = moved.accessed.load();
+        if (!link_file(*parent, target, leaf, target_hash)) {
+            to.files.erase(target, target_hash);
+            budget.release(cost);
+            return FileStatus::ALREADY_EXISTS;
+        }
+        File *source_file = from.files.find(source, source_hash);
+        if (source_file->timer) {
+            move_timer(from, *source_file, to, *placed.first, target, target_hash);
+        }
+        size_t source_leaf = DirectoryTree::leaf_start(source);
+        from.files.erase(source, source_hash);
+        unlink_file(*tree.parent_of(source, source_leaf), source, source_leaf, source_hash);
+        budget.release(FileKey::footprint(source.size()) + FileKey::footprint(source.size() - source_leaf));
+        ++from.layout;
+        ++to.layout;
+        if (wal) {
+            logged = max(logged, wal->append(LogOp::RENAME, source, target));
+        }
+        notify(from, ChangeKind::DELETE, source, 0);
+        notify(to, ChangeKind::CREATE, target, moved.version->size);
+        return FileStatus::OK;
+    }
+
+    FileStatus delete_locked(Shard &shard, const string &filename, size_t hash, uint64_t &logged) {
+        File *file = shard.files.find(filename, hash);
+        if (!file) {
+            return FileStatus::NOT_FOUND;
+        }
+        size_t leaf = DirectoryTree::leaf_start(filename);
+        budget.release(file_footprint(filename, *file->version) + FileKey::footprint(filename.size() - leaf));
+        content_bytes.add(-static_cast<int64_t>(file->version->size));
+        count_version(*file->version, -1);
+        drop_expiry(shard, *file);
+        shard.files.erase(filename, hash);
+        ++shard.layout;
+        unlink_file(*tree.parent_of(filename, leaf), filename, leaf, hash);
+        --file_count;
+        if (wal) {
+            logged = max(logged, wal->append(LogOp::DELETE, filename, string()));
+        }
+        notify(shard, ChangeKind::DELETE, filename, 0);
+        return FileStatus::OK;
+    }
+
+    FileStatus mkdir_locked(const string &path, uint64_t &logged) {
+        size_t leaf = DirectoryTree::leaf_start(path);
+        Directory *parent = tree.parent_of(path, leaf);
+        if (!parent) {
+            return FileStatus::NO_SUCH_DIRECTORY;
+        }
+        shared_ptr<Directory> dir = make_shared<Directory>();
+        size_t cost = Directory::directory_footprint(path.size() - leaf) + dir->files.memory_bytes();
+        if (!budget.reserve(cost)) {
+            return FileStatus::MEMORY_LIMIT_EXCEEDED;
+        }
+        string scratch;
+        const string &name = DirectoryTree::leaf_name(path, leaf, scratch);
+        size_t name_hash = hash_name(name);
+        bool clash;
+        {
+            lock_guard<RWLock> lock(parent->lock);
+            clash = parent->has_child(name, name_hash);
+            if (!clash) {
+                parent->directories.emplace(name, move(dir));
+            }
+        }
+        if (clash) {
+            budget.release(cost);
+            return FileStatus::ALREADY_EXISTS;
+        }
+        if (wal) {
+            logged = max(logged, wal->append(LogOp::MKDIR, path, string()));
+        }
+        return FileStatus::OK;
+    }
+
+    // Single-file operations wait for their log record (outside the shard lock) unless
+    // the log is asynchronous. Returns `status`, or LOG_FAILED for a change the log
+    // failed to keep.
+    FileStatus await_log(uint64_t logged, FileStatus status) {
+        if (!wal || logged == 0 || status != FileStatus::OK) {
+            return status;
+        }
+        bool durable = wal->durability() == LogMode::ASYNC ? !wal->broken() : wal->wait(logged);
+        return durable ? status : FileStatus::LOG_FAILED;
+    }
+
+    FileStatus apply_locked(Shard &shard, Batch &batch, size_t i, uint64_t &logged) {
+        switch (batch.ops[i]) {
+        case OpType::CREATE:
+            return create_locked(shard, batch.filenames[i], batch.hashes[i], logged);
+        case OpType::WRITE:
+            return write_locked(shard, batch.filenames[i], batch.hashes[i], batch.contents[i], logged);
+        case OpType::DELETE:
+            break;
+        }
+        return delete_locked(shard, batch.filenames[i], batch.hashes[i], logged);
+    }
+
+    // Applies order[begin, end) under the shard lock, taken and released through the
+    // deferred `guard`, and records the chunk in the metrics. Like single operations,
+    // only one chunk in LatencySampler::SAMPLE_EVERY is timed.
+    template <typename Guard>
+    void apply_chunk(Guard &guard, Shard &shard, Batch &batch, size_t begin, size_t end, uint64_t &logged) {
+        bool timed = metrics.enabled && LatencySampler::sample();
+        steady_clock::time_point start;
+        if (timed) {
+            start = steady_clock::now();
+        }
+        bool contended = lock_contended(guard);
+        steady_clock::time_point locked;
+        if (timed) {
+            locked = steady_clock::now();
+        }
+        for (size_t k = begin; k < end; ++k) {
+            batch.latch[batch.order[k]] = apply_locked(shard, batch, batch.order[k], logged);
+        }
+        guard.unlock();
+        if (!metrics.enabled) {
+            return;
+        }
+        uint64_t hold = 0;
+        if (timed) {
+            hold = nanoseconds_between(locked, steady_clock::now());
+            metrics.lock_wait.record(nanoseconds_between(start, locked));
+            metrics.lock_hold.record(hold);
+        }
+        metrics.lock_acquisitions.add(1);
+        if (contended) {
+            metrics.lock_contended.add(1);
+        }
+
+        int64_t counts[MemFSMetrics::OP_KINDS] = {};
+        int64_t failed[MemFSMetrics::OP_KINDS] = {};
+        for (size_t k = begin; k < end; ++k) {
+            size_t i = batch.order[k];
+            size_t kind = static_cast<size_t>(MemFSMetrics::kind_of(batch.ops[i]));
+            ++counts[kind];
+            if (batch.latch[i] != FileStatus::OK) {
+                ++failed[kind];
+            }
+        }
+        uint64_t share = hold / (end - begin);
+        for (size_t kind = 0; kind < MemFSMetrics::OP_KINDS; ++kind) {
+            if (counts[kind] > 0) {
+                metrics.operations[kind].add(counts[kind]);
+                if (failed[kind] > 0) {
+                    metrics.failures[kind].add(failed[kind]);
+                }
+                if (timed) {
+                    metrics.latency[kind].record(share, static_cast<uint64_t>(counts[kind]));
+                }
+            }
+        }
+    }
+
+    void run_chunk(const shared_ptr<Batch> &batch, size_t begin, size_t end) {
+        Shard &shard = shard_for(batch->hashes[batch->order[begin]]);
+        bool writes_only = true;
+        for (size_t k = begin; k < end && writes_only; ++k) {
+            writes_only = batch->ops[batch->order[k]] == OpType::WRITE;
+        }
+        uint64_t logged = 0;
+        if (writes_only) {
+            SharedLock lock(shard.files_lock, defer_lock);
+            apply_chunk(lock, shard, *batch, begin, end, logged);
+        } else {
+            unique_lock<RWLock> lock(shard.files_lock, defer_lock);
+            apply_chunk(lock, shard, *batch, begin, end, logged);
+        }
+        if (wal && logged != 0) {
+            if (wal->durability() == LogMode::BATCHED) {
+                wal->when_durable(logged, [batch, begin, end](bool durable) {
+                    if (!durable) {
+                        fail_unlogged(*batch, begin, end);
+                    }
+                    batch->latch.arrive();
+                });
+                return;
+            }
+            if (wal->durability() == LogMode::SYNC ? !wal->wait(logged) : wal->broken()) {
+                fail_unlogged(*batch, begin, end);
+            }
+        }
+        batch->latch.arrive();
+    }
+
+    // Turns the chunk's successes into LOG_FAILED, for a log that failed to keep them.
+    static void fail_unlogged(Batch &batch, size_t begin, size_t end) {
+        for (size_t k = begin; k < end; ++k) {
+            FileStatus &status = batch.latch[batch.order[k]];
+            if (status == FileStatus::OK) {
+                status = FileStatus::LOG_FAILED;
+            }
+        }
+    }
+
+    PendingBatch submit_batch_ops(OpType op, vector<string> &&filenames, vector<string> &&contents) {
+        vector<OpType> ops(filenames.size(), op);
+        return submit_ops(move(ops), move(filenames), move(contents));
+    }
+
+    future<vector<FileStatus>> submit_batch(OpType op, vector<string> &&filenames, vector<string> &&contents) {
+        return move(submit_batch_ops(op, move(filenames), move(contents)).results);
+    }
+
+    // grep's share of one shard: the files under `prefix` are pinned under the shared
+    // lock and scanned once it is released.
+    vector<GrepMatch> grep_shard(Shard &shard, const SubstringSearch &search, const string &prefix) {
+        vector<string> names;
+        vector<shared_ptr<const FileVersion>> versions;
+        {
+            SharedLock lock(shard.files_lock);
+            shard.files.for_each([&](const FileKey &key, File &file) {
+                if (key.size() < prefix.size() || memcmp(key.data(), prefix.data(), prefix.size()) != 0) {
+                    return;
+                }
+                shared_ptr<const FileVersion> version = file.snapshot();
+                if (version->size >= search.size()) {
+                    names.push_back(key.str());
+                    versions.push_back(move(version));
+                }
+            });
+        }
+        vector<GrepMatch> matches;
+        SegmentSearch scanner(search);
+        for (size_t i = 0; i < versions.size(); ++i) {
+            GrepMatch match;
+            auto found = [&match](size_t offset) { match.offsets.push_back(offset); };
+            scanner.reset();
+            versions[i]->for_each_segment([&](const char *data, size_t length) { scanner.feed(data, length, found); });
+            versions[i].reset();
+            if (!match.offsets.empty()) {
+                match.filename = move(names[i]);
+                matches.push_back(move(match));
+            }
+        }
+        return matches;
+    }
+
+    // A file a transaction touches or has read: the version it saw (null if the file
+    // did not exist) and the version it leaves, null if the file ends up deleted.
+    // `final` was built by appending to `base`, which deduplication resumes from.
+    // `recreated` marks a file deleted and created again, which gets a new ctime, and
+    // `pinned` a file read through the transaction, whose content must not change.
+    class TxFile {
+    public:
+        const string *name;
+        size_t hash;
+        size_t shard;
+        size_t leaf;
+        bool pinned = false;
+        bool recreated = false;
+        shared_ptr<const FileVersion> seen;
+        shared_ptr<const FileVersion> base;
+        shared_ptr<const FileVersion> final;
+    };
+
+    // What a transaction file is charged in `version`, as create_locked charges it.
+    static int64_t transaction_cost(const TxFile &file, const shared_ptr<const FileVersion> &version) {
+        if (!version) {
+            return 0;
+        }
+        return static_cast<int64_t>(file_footprint(*file.name, *version) +
+                                    FileKey::footprint(file.name->size() - file.leaf));
+    }
+
+    // Names every file in `flagged` in result.failed, in transaction order.
+    static void list_failed(TransactionResult &result, const vector<TxFile> &files, const vector<bool> &flagged) {
+        for (size_t k = 0; k < files.size(); ++k) {
+            if (flagged[k]) {
+                result.failed.push_back(*files[k].name);
+            }
+        }
+    }
+
+    // Fails the transaction with `status` on every operation on a flagged file.
+    static void fail_files(TransactionResult &result, const vector<TxFile> &files, const vector<size_t> &file_of,
+                           const vector<bool> &flagged, FileStatus status) {
+        for (size_t i = 0; i < file_of.size(); ++i) {
+            if (flagged[file_of[i]]) {
+                result.statuses[i] = status;
+            }
+        }
+        result.status = status;
+        list_failed(result, files, flagged);
+    }
+
+    static LogOp log_op(OpType op) {
+        switch (op) {
+        case OpType::CREATE:
+            return LogOp::CREATE;
+        case OpType::WRITE:
+            return LogOp::WRITE;
+        case OpType::DELETE:
+            break;
+        }
+        return LogOp::DELETE;
+    }
+
+    static void put_u32(string &out, size_t value) {
+        uint32_t field = static_cast<uint32_t>(value);
+        out.append(reinterpret_cast<const char *>(&field), sizeof(field));
+    }
+
+    // The content of a LogOp::TRANSACTION record for tx.
+    static string transaction_record(const Transaction &tx) {
+        string record;
+        for (size_t i = 0; i < tx.ops.size(); ++i) {
+            const string &content = tx.ops[i] == OpType::WRITE ? tx.contents[i] : string();
+            record.push_back(static_cast<char>(log_op(tx.ops[i])));
+            put_u32(record, tx.filenames[i].size());
+            record.append(tx.filenames[i]);
+            put_u32(record, content.size());
+            record.append(content);
+        }
+        if (tx.expires_at != 0) {
+            record.push_back(static_cast<char>(LogOp::EXPIRE));
+            put_u32(record, 0);
+            put_u32(record, sizeof(tx.expires_at));
+            record.append(reinterpret_cast<const char *>(&tx.expires_at), sizeof(tx.expires_at));
+        }
+        return record;
+    }
+
+    // Decodes a LogOp::TRANSACTION record into tx; false if it is malformed.
+    static bool read_transaction_record(const string &record, Transaction &tx) {
+        size_t at = 0;
+        auto field = [&record, &at](string &out) {
+            uint32_t size;
+            if (record.size() - at < sizeof(size)) {
+                return false;
+            }
+            memcpy(&size, record.data() + at, sizeof(size));
+            at += sizeof(size);
+            if (record.size() - at < size) {
+                return false;
+            }
+            out.assign(record, at, size);
+            at += size;
+            return true;
+        };
+        while (at < record.size()) {
+            LogOp op = static_cast<LogOp>(record[at++]);
+            string name;
+            string content;
+            if (!field(name) || !field(content)) {
+                return false;
+            }
+            if (op == LogOp::CREATE) {
+                tx.create(name);
+            } else if (op == LogOp::WRITE) {
+                tx.write(name, content);
+            } else if (op == LogOp::DELETE) {
+                tx.remove(name);
+            } else if (op == LogOp::EXPIRE && content.size() == sizeof(tx.expires_at)) {
+                memcpy(&tx.expires_at, content.data(), sizeof(tx.expires_at));
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Plays the operations of tx on the files picked by `picked`, from the version each
+    // was seen at, leaving the result in `final`. Failures go to result.statuses and
+    // the first one to result.status.
+    void play(const Transaction &tx, vector<TxFile> &files, const vector<size_t> &file_of, const vector<bool> &picked,
+              system_clock::time_point now, TransactionResult &result) {
+        for (size_t k = 0; k < files.size(); ++k) {
+            if (picked[k]) {
+                files[k].base = files[k].final = files[k].seen;
+                files[k].recreated = false;
+            }
+        }
+        for (size_t i = 0; i < tx.ops.size(); ++i) {
+            if (!picked[file_of[i]]) {
+                continue;
+            }
+            TxFile &file = files[file_of[i]];
+            FileStatus status = FileStatus::OK;
+            switch (tx.ops[i]) {
+            case OpType::CREATE:
+                if (file.final) {
+                    status = FileStatus::ALREADY_EXISTS;
+                } else {
+                    file.final = file.base = make_shared<const FileVersion>(now);
+                    file.recreated = file.seen != nullptr;
+                }
+                break;
+            case OpType::WRITE:
+                if (!file.final) {
+                    status = FileStatus::NOT_FOUND;
+                } else if (file.final->size + tx.contents[i].size() > options.max_file_size) {
+                    status = FileStatus::SIZE_LIMIT_EXCEEDED;
+                } else {
+                    file.final = FileVersion::append(*file.final, tx.contents[i], now);
+                }
+                break;
+            case OpType::DELETE:
+                if (!file.final) {
+                    status = FileStatus::NOT_FOUND;
+                } else {
+                    file.final = file.base = nullptr;
+                    file.recreated = false;
+                }
+                break;
+            }
+            if (status != FileStatus::OK) {
+                result.statuses[i] = status;
+                if (result.status == FileStatus::OK) {
+                    result.status = status;
+                }
+            }
+        }
+        if (result.status != FileStatus::OK) {
+            return;
+        }
+        for (size_t k = 0; k < files.size(); ++k) {
+            TxFile &file = files[k];
+            if (picked[k] && file.final && file.final != file.base) {
+                file.final = deduplicated(file.final, *file.base, true);
+            }
+        }
+    }
+
+    // Whether a file read at version `seen` still has that content in `current`.
+    static bool same_content(const shared_ptr<const FileVersion> &seen, const shared_ptr<const FileVersion> &current) {
+        return seen == current || (seen && current && seen->sequence == current->sequence);
+    }
+
+    // Second half of commit: checks the versions seen, rebases the files that were
+    // changed by others, and puts the final versions in place. Caller holds the shard
+    // lock of every file exclusively.
+    void commit_locked(const Transaction &tx, vector<TxFile> &files, const vector<size_t> &file_of,
+                       system_clock::time_point now, TransactionResult &result, uint64_t &logged) {
+        vector<bool> flagged(files.size(), false);
+        vector<bool> rebased(files.size(), false);
+        bool failed = false;
+        bool stale = false;
+        for (size_t k = 0; k < files.size(); ++k) {
+            File *file = shards[files[k].shard].files.find(*files[k].name, files[k].hash);
+            shared_ptr<const FileVersion> current = file ? file->snapshot() : nullptr;
+            if (current == files[k].seen) {
+                continue;
+            }
+            if (files[k].pinned && !same_content(files[k].seen, current)) {
+                flagged[k] = failed = true;
+                continue;
+            }
+            // Only written, or read but merely repacked since: nothing the transaction
+            // built on has changed, so its operations are played again on the current
+            // version.
+            files[k].seen = current;
+            rebased[k] = stale = true;
+        }
+        if (failed) {
+            fail_files(result, files, file_of, flagged, FileStatus::CONFLICT);
+            return;
+        }
+        if (stale) {
+            play(tx, files, file_of, rebased, now, result);
+            if (result.status != FileStatus::OK) {
+                for (size_t i = 0; i < file_of.size(); ++i) {
+                    flagged[file_of[i]] = flagged[file_of[i]] || result.statuses[i] != FileStatus::OK;
+                }
+                list_failed(result, files, flagged);
+                return;
+            }
+        }
+        // Files given an expiry that had none are charged a timer.
+        vector<bool> timed(files.size(), false);
+        for (size_t k = 0; k < files.size(); ++k) {
+            File *file = shards[files[k].shard].files.find(*files[k].name, files[k].hash);
+            timed[k] = tx.expires_at != 0 && files[k].final && files[k].final != files[k].seen &&
+                       !(file && file->timer);
+        }
+        vector<Directory *> parents(files.size(), nullptr);
+        for (size_t k = 0; k < files.size(); ++k) {
+            if (!files[k].seen && files[k].final) {
+                parents[k] = tree.parent_of(*files[k].name, files[k].leaf);
+                flagged[k] = !parents[k];
+                failed = failed || flagged[k];
+            }
+        }
+        if (failed) {
+            fail_files(result, files, file_of, flagged, FileStatus::NO_SUCH_DIRECTORY);
+            return;
+        }
+        auto growth_of = [&files, &timed](size_t k) {
+            int64_t timer = timed[k] ? static_cast<int64_t>(timer_footprint(files[k].name->size())) : 0;
+            return transaction_cost(files[k], files[k].final) - transaction_cost(files[k], files[k].seen) + timer;
+        };
+        int64_t growth = 0;
+        for (size_t k = 0; k < files.size(); ++k) {
+            growth += growth_of(k);
+        }
+        if (growth > 0 && !budget.reserve(static_cast<size_t>(growth))) {
+            for (size_t k = 0; k < files.size(); ++k) {
+                flagged[k] = growth_of(k) > 0;
+            }
+            fail_files(result, files, file_of, flagged, FileStatus::MEMORY_LIMIT_EXCEEDED);
+            return;
+        }
+        // New files go into their directories first: a subdirectory created under the
+        // same name since the check shows up here, while all of it can still be undone.
+        for (size_t k = 0; k < files.size(); ++k) {
+            if (parents[k] && !link_file(*parents[k], *files[k].name, files[k].leaf, files[k].hash)) {
+                for (size_t j = 0; j < k; ++j) {
+                    if (parents[j]) {
+                        unlink_file(*parents[j], *files[j].name, files[j].leaf, files[j].hash);
+                    }
+                }
+                if (growth > 0) {
+                    budget.release(static_cast<size_t>(growth));
+                }
+                flagged[k] = true;
+                fail_files(result, files, file_of, flagged, FileStatus::ALREADY_EXISTS);
+                return;
+            }
+        }
+        int64_t content_change = 0;
+        for (auto &file : files) {
+            if (file.final == file.seen) {
+                continue;
+            }
+            Shard &shard = shards[file.shard];
+            File *changed = nullptr;
+            if (!file.seen) {
+                size_t table_before = shard.files.memory_bytes();
+                changed = shard.files.emplace(*file.name, file.hash, now, file.final).first;
+                ++shard.layout;
+                budget.charge(shard.files.memory_bytes() - table_before);
+                touch(*changed);
+                ++file_count;
+                notify(shard, ChangeKind::CREATE, *file.name, file.final->size);
+            } else if (!file.final) {
+                drop_expiry(shard, *shard.files.find(*file.name, file.hash));
+                shard.files.erase(*file.name, file.hash);
+                ++shard.layout;
+                unlink_file(*tree.parent_of(*file.name, file.leaf), *file.name, file.leaf, file.hash);
+                --file_count;
+                notify(shard, ChangeKind::DELETE, *file.name, 0);
+            } else {
+                changed = shard.files.find(*file.name, file.hash);
+                if (file.recreated) {
+                    changed->created_at = now;
+                    if (tx.expires_at == 0) {
+                        drop_expiry(shard, *changed);
+                    }
+                    notify(shard, ChangeKind::DELETE, *file.name, 0);
+                    notify(shard, ChangeKind::CREATE, *file.name, file.final->size);
+                } else {
+                    notify(shard, ChangeKind::WRITE, *file.name, file.final->size);
+                }
+                atomic_store(&changed->version, file.final);
+                touch(*changed);
+            }
+            if (changed && tx.expires_at != 0) {
+                lock_guard<mutex> guard(shard.timer_mutex);
+                arm_timer(shard, *changed, *file.name, file.hash, tx.expires_at);
+            }
+            if (file.seen) {
+                count_version(*file.seen, -1);
+                content_change -= static_cast<int64_t>(file.seen->size);
+            }
+            if (file.final) {
+                count_version(*file.final, 1);
+                content_change += static_cast<int64_t>(file.final->size);
+            }
+        }
+        if (growth < 0) {
+            budget.release(static_cast<size_t>(-growth));
+        }
+        content_bytes.add(content_change);
+        if (wal && !tx.ops.empty()) {
+            logged = max(logged, wal->append(LogOp::TRANSACTION, string(), transaction_record(tx)));
+        }
+        if (tx.expires_at != 0) {
+            start_expirer();
+        }
+    }
+
+    // A snapshot save writes out once this many iovecs are queued; segments of at
+    // least SNAPSHOT_DIRECT_BYTES get their own iovec, smaller ones are copied into
+    // SNAPSHOT_STAGING_BYTES buffers.
+    static const size_t SNAPSHOT_FLUSH_PIECES = 64;
+    static const size_t SNAPSHOT_DIRECT_BYTES = 4096;
+    static const size_t SNAPSHOT_STAGING_BYTES = 256 * 1024;
+
+    static int64_t to_nanoseconds(system_clock::time_point time) {
+        return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    static system_clock::time_point from_nanoseconds(int64_t count) {
+        return system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(count)));
+    }
+
+    // Bytes charged for every table, file and timer and for the directory tree, with the
+    // content bytes and timed files added to `bytes` and `timed`. Caller holds every
+    // shard lock.
+    size_t footprint_locked(size_t &bytes, int64_t &timed) {
+        size_t cost = tree.memory_bytes();
+        for (auto &shard : shards) {
+            cost += shard.files.memory_bytes();
+            shard.files.for_each([&cost, &bytes, &timed](const FileKey &key, File &file) {
+                cost += FileKey::footprint(key.size()) + file.version->footprint();
+                bytes += file.version->size;
+                if (file.timer) {
+                    cost += timer_footprint(key.size());
+                    ++timed;
+                }
+            });
+        }
+        return cost;
+    }
+
+    // Builds one shard's table from its share of a snapshot image, and enters its files
+    // in their `parents` in the tree being loaded. Touches no live shard, so it needs
+    // no shard lock. Returns the bytes the table will be charged, and adds the content
+    // bytes it restored to `bytes`. The timers of files with an expiry are left in
+    // `timers`, to be armed once the table is in place.
+    size_t restore_shard(const shared_ptr<const MappedImage> &image, const vector<size_t> &entries,
+                         const vector<size_t> &hashes, const vector<Directory *> &parents,
+                         FileIndex<File> &table, size_t &bytes, vector<FileTimer *> &timers) {
+        table.reserve(entries.size());
+        size_t cost = 0;
+        string name;
+        string scratch;
+        for (size_t i : entries) {
+            SnapshotEntry entry = image->entry(i);
+            name.assign(image->at(entry.name_offset), entry.name_size);
+            shared_ptr<const FileVersion> version = make_shared<const FileVersion>(
+                from_nanoseconds(entry.updated_at), entry.content_size > 0 ? image : nullptr,
+                image->at(entry.content_offset), entry.content_size);
+            size_t footprint = file_footprint(name, *version);
+            size_t leaf = DirectoryTree::leaf_start(name);
+            const string &leaf_name = DirectoryTree::leaf_name(name, leaf, scratch);
+            Directory &parent = *parents[i];
+            {
+                lock_guard<RWLock> lock(parent.lock);
+                if ((!parent.directories.empty() && parent.directories.count(leaf_name) != 0) ||
+                    !parent.files.emplace(leaf_name, leaf == 0 ? hashes[i] : hash_name(leaf_name), hashes[i]).second) {
+                    continue;
+                }
+                ++parent.generation;
+            }
+            File *file = table.emplace(name, hashes[i], from_nanoseconds(entry.created_at), move(version)).first;
+            cost += footprint;
+            bytes += entry.content_size;
+            if (entry.expires_at != 0) {
+                file->timer.reset(new FileTimer(name, hashes[i]));
+                file->timer->expires_at = entry.expires_at;
+                timers.push_back(file->timer.get());
+                cost += timer_footprint(name.size());
+            }
+        }
+        return cost + table.memory_bytes();
+    }
+
+public:
+    static const size_t DEFAULT_SHARD_COUNT = 64;
+    // Events a watcher can fall behind by before it loses any.
+    static const size_t DEFAULT_WATCH_CAPACITY = 4096;
+
+    MemFSOptions options;
+    MemoryBudget budget;
+    atomic<size_t> file_count{0};
+    vector<Shard> shards;
+    DirectoryTree tree;
+    size_t thread_count;
+    // Log position covered by the snapshot loaded last; replay starts there.
+    uint64_t loaded_log_position = 0;
+    HandleTable handles;
+    // Set by open_log(); outlives the pool so chunks still running can log.
+    unique_ptr<WriteAheadLog> wal;
+    MemFSMetrics metrics;
+    // Sum of all file sizes.
+    ShardedCounter content_bytes;
+    // Packed files (see count_cold) and the clock their accesses are stamped with:
+    // seconds since start-up as of the latest compaction pass.
+    ShardedCounter cold_files;
+    ShardedCounter cold_bytes;
+    ShardedCounter cold_stored;
+    atomic<uint32_t> cold_clock{0};
+    // Content-addressed index of versions for deduplication, and the files whose
+    // version is an alias (see count_version) with their total size.
+    shared_ptr<BlobIndex> blobs = make_shared<BlobIndex>();
+    ShardedCounter shared_files;
+    ShardedCounter shared_bytes;
+    // Files with an expiry, and files expired so far; the clocks expiry ticks count from.
+    ShardedCounter expiring_files;
+    ShardedCounter expired_files;
+    steady_clock::time_point expiry_start = steady_clock::now();
+    int64_t expiry_wall_start = to_nanoseconds(system_clock::now());
+    // Declared after the shards so it is destroyed, and its workers joined, first.
+    ThreadPool pool;
+    // Runs compact_cold when options.cold_after is set; stopped by the destructor.
+    mutex compactor_mutex;
+    condition_variable compactor_wake;
+    bool compactor_stopping = false;
+    thread compactor;
+    // Runs expire_due once a file has an expiry (see start_expirer); stopped by the
+    // destructor.
+    mutex expirer_mutex;
+    condition_variable expirer_wake;
+    bool expirer_stopping = false;
+    thread expirer;
+
+    MemFS(size_t thread_count, size_t shard_count = DEFAULT_SHARD_COUNT)
+        : MemFS(thread_count, options_with_shards(shard_count)) {}
+
+    MemFS(size_t thread_count, const MemFSOptions &options)
+        : options(options), budget(options.memory_limit), shards(options.shard_count == 0 ? 1 : options.shard_count),
+          thread_count(thread_count), metrics(options.metrics),
+          pool(thread_count, options.metrics ? &metrics.pool : nullptr) {
+        size_t table_bytes = tree.memory_bytes();
+        for (auto &shard : shards) {
+            table_bytes += shard.files.memory_bytes();
+        }
+        budget.charge(table_bytes);
+        if (options.cold_after > 0) {
+            compactor = thread(&MemFS::run_compactor, this);
+        }
+    }
+
+    ~MemFS() {
+        if (compactor.joinable()) {
+            {
+                lock_guard<mutex> lock(compactor_mutex);
+                compactor_stopping = true;
+            }
+            compactor_wake.notify_one();
+            compactor.join();
+        }
+        {
+            lock_guard<mutex> lock(expirer_mutex);
+            expirer_stopping = true;
+        }
+        expirer_wake.notify_one();
+        if (expirer.joinable()) {
+            expirer.join();
+        }
+    }
 
-    File() : created_at(system_clock::now()), updated_at(created_at) {}
+    static MemFSOptions options_with_shards(size_t shard_count) {
+        MemFSOptions options;
+        options.shard_count = shard_count;
+        return options;
+    }
 
-    size_t getSize() const {
-        return sizeof(File) + content.size() * sizeof(char);
+    size_t memory_used() const {
+        return budget.bytes_used();
     }
 
-    string getCreatedTime() const {
-        auto time = system_clock::to_time_t(created_at);
-        string time_str = ctime(&time);
-        if (!time_str.empty() && time_str[time_str.length() - 1] == '\n') {
-            time_str.erase(time_str.length() - 1);
+    // What the budget should hold, recomputed from the tables and the directory tree:
+    // every index, name, version and timer. Takes every shard lock shared; for
+    // consistency checks, since it walks every file.
+    size_t recount_memory() {
+        vector<SharedLock> locks;
+        locks.reserve(shards.size());
+        for (auto &shard : shards) {
+            locks.emplace_back(shard.files_lock);
         }
-        return time_str;
+        size_t bytes = 0;
+        int64_t timed = 0;
+        return footprint_locked(bytes, timed);
     }
 
-    string getUpdatedTime() const {
-        auto time = system_clock::to_time_t(updated_at);
-        string time_str = ctime(&time);
-        if (!time_str.empty() && time_str[time_str.length() - 1] == '\n') {
-            time_str.erase(time_str.length() - 1);
+    // Reads every metric. Counters are read one by one without stopping the world, so
+    // under load they may be a few operations apart.
+    MetricsSnapshot metrics_snapshot() const {
+        MetricsSnapshot snapshot;
+        snapshot.enabled = metrics.enabled;
+        uint64_t uptime_ns = nanoseconds_between(metrics.started, steady_clock::now());
+        snapshot.uptime_seconds = uptime_ns / 1e9;
+        snapshot.files = file_count.load();
+        snapshot.bytes_stored = content_bytes.value();
+        snapshot.cold_files = cold_files.value();
+        snapshot.cold_bytes = cold_bytes.value();
+        snapshot.cold_stored = cold_stored.value();
+        snapshot.shared_files = shared_files.value();
+        snapshot.shared_bytes = shared_bytes.value();
+        snapshot.expiring_files = expiring_files.value();
+        snapshot.expired_files = expired_files.value();
+        snapshot.memory_used = budget.bytes_used();
+        snapshot.memory_limit = budget.bytes_limit();
+        for (size_t kind = 0; kind < MemFSMetrics::OP_KINDS; ++kind) {
+            MetricsSnapshot::Operation op;
+            op.name = MemFSMetrics::name_of(static_cast<MetricOp>(kind));
+            op.count = metrics.operations[kind].value();
+            op.failed = metrics.failures[kind].value();
+            op.latency = metrics.latency[kind].summary();
+            snapshot.operations.push_back(op);
         }
-        return time_str;
+        snapshot.lock_acquisitions = metrics.lock_acquisitions.value();
+        snapshot.lock_contended = metrics.lock_contended.value();
+        snapshot.lock_wait = metrics.lock_wait.summary();
+        snapshot.lock_hold = metrics.lock_hold.summary();
+        snapshot.workers = pool.size();
+        snapshot.queue_depth = pool.depth();
+        snapshot.peak_queue_depth = metrics.pool.peak_depth.load();
+        snapshot.tasks = metrics.pool.tasks.value();
+        snapshot.task_wait = metrics.pool.queue_wait.summary();
+        snapshot.task_run = metrics.pool.run_time.summary();
+        if (uptime_ns > 0 && snapshot.workers > 0) {
+            snapshot.worker_utilization =
+                100.0 * metrics.pool.busy_ns.value() / (static_cast<double>(uptime_ns) * snapshot.workers);
+        }
+        return snapshot;
     }
-};
 
-class Task {
-public:
-    string filename;
-    string content;
-    string type;
-    Task() = default;
-    Task(string filename, string content, string type) : filename(filename), content(content), type(type) {}
-};
+    // Submits any mix of operations as one batch. It is grouped by shard (stable, and
+    // keeping operations on the same name together and in input order), cut into
+    // chunks of about CHUNK_SIZE and handed to the pool. `contents` is only read for
+    // writes and may be shorter than `filenames`.
+    PendingBatch submit_ops(vector<OpType> ops, vector<string> filenames, vector<string> contents) {
+        size_t n = filenames.size();
+        contents.resize(n);
+        vector<size_t> hashes(n);
+        vector<size_t> order(n);
+        for (size_t i = 0; i < n; ++i) {
+            hashes[i] = hash_name(filenames[i]);
+            order[i] = i;
+        }
+        size_t shard_count = shards.size();
+        stable_sort(order.begin(), order.end(), [&hashes, shard_count](size_t a, size_t b) {
+            size_t shard_a = (hashes[a] >> 32) % shard_count;
+            size_t shard_b = (hashes[b] >> 32) % shard_count;
+            return shard_a != shard_b ? shard_a < shard_b : hashes[a] < hashes[b];
+        });
 
-class MemFS {
-private:
-    void worker_function() {
-        while (true) {
-            Task task{};
-            {
-                unique_lock<mutex> lock(task_queue_mutex);
-                task_queue_cv.wait(lock, [this]() { return !task_queue.empty() || shutdown; });
+        vector<pair<size_t, size_t>> chunks;
+        for (size_t begin = 0; begin < n;) {
+            size_t shard = (hashes[order[begin]] >> 32) % shard_count;
+            size_t end = begin + 1;
+            while (end < n && (hashes[order[end]] >> 32) % shard_count == shard &&
+                   (end - begin < CHUNK_SIZE || hashes[order[end]] == hashes[order[end - 1]])) {
+                ++end;
+            }
+            chunks.push_back(make_pair(begin, end));
+            begin = end;
+        }
 
-                if (shutdown && task_queue.empty()) {
-                    break;
-                }
+        shared_ptr<Batch> batch = make_shared<Batch>(move(ops), move(filenames), move(contents), chunks.size());
+        batch->hashes = move(hashes);
+        batch->order = move(order);
+        PendingBatch pending;
+        pending.batch = batch;
+        pending.results = batch->latch.get_future();
+
+        vector<function<void()>> jobs;
+        jobs.reserve(chunks.size());
+        for (auto &chunk : chunks) {
+            size_t begin = chunk.first;
+            size_t end = chunk.second;
+            jobs.push_back([this, batch, begin, end]() { run_chunk(batch, begin, end); });
+        }
+        pool.submit_batch(move(jobs));
+        return pending;
+    }
 
-                task = task_queue.front();
-                task_queue.pop();
+    void report(OpType op, const string &filename, FileStatus status) const {
+        switch (status) {
+        case FileStatus::OK:
+            break;
+        case FileStatus::ALREADY_EXISTS:
+            cout << "error: another file with same name exists" << endl;
+            break;
+        case FileStatus::NOT_FOUND:
+            if (op == OpType::DELETE) {
+                cout << "File " << filename << " doesn't exist." << endl;
+            } else {
+                cout << "Error: " << filename << " does not exist" << endl;
             }
-            if (task.type == "create") {
-                create_file(task.filename);
-            } else if (task.type == "write") {
-                write_file(task.filename, task.content);
-            } else if (task.type == "delete") {
-                delete_file(task.filename);
+            break;
+        case FileStatus::SIZE_LIMIT_EXCEEDED:
+            cout << "Error: " << filename << " has reached the maximum size of " << options.max_file_size << " bytes" << endl;
+            break;
+        case FileStatus::MEMORY_LIMIT_EXCEEDED:
+            cout << "Error: memory limit of " << budget.bytes_limit() << " bytes reached, cannot "
+                 << (op == OpType::CREATE ? "create " : "write to ") << filename << endl;
+            break;
+        case FileStatus::NO_SUCH_DIRECTORY:
+            cout << "Error: directory " << filename.substr(0, DirectoryTree::leaf_start(filename) - 1)
+                 << " does not exist" << endl;
+            break;
+        case FileStatus::BAD_DESCRIPTOR:
+            cout << "Error: bad file descriptor " << filename << endl;
+            break;
+        case FileStatus::CONFLICT:
+            cout << "Error: " << filename << " was changed by another operation" << endl;
+            break;
+        case FileStatus::LOG_FAILED:
+            cout << "Error: " << filename << " was changed, but the write-ahead log has failed; the change will be lost"
+                 << " on restart" << endl;
+            break;
+        }
+    }
+
+    // Waits for a submitted batch and reports its failures in input order. Returns the
+    // number of files that failed.
+    size_t finish(PendingBatch &pending) {
+        vector<FileStatus> statuses = pending.results.get();
+        size_t failed = 0;
+        for (size_t i = 0; i < statuses.size(); ++i) {
+            if (statuses[i] != FileStatus::OK) {
+                report(pending.batch->ops[i], pending.batch->filenames[i], statuses[i]);
+                ++failed;
             }
+        }
+        return failed;
+    }
 
-            {
-                lock_guard<mutex> lock(task_queue_mutex);
-                --outstanding_tasks;
-                if (outstanding_tasks == 0) {
-                    task_completion_cv.notify_all();
+    // Asynchronous batch API: each call gets its own completion latch, and the future
+    // yields one FileStatus per input file, in input order.
+    future<vector<FileStatus>> submit_creates(vector<string> filenames) {
+        return submit_batch(OpType::CREATE, move(filenames), vector<string>());
+    }
+
+    future<vector<FileStatus>> submit_writes(vector<string> filenames, vector<string> contents) {
+        contents.resize(filenames.size());
+        return submit_batch(OpType::WRITE, move(filenames), move(contents));
+    }
+
+    future<vector<FileStatus>> submit_deletes(vector<string> filenames) {
+        return submit_batch(OpType::DELETE, move(filenames), vector<string>());
+    }
+
+    // Programmatic single-file API: one shard lock, no output. Also used by log replay.
+    // With a `ttl`, the file is deleted that many seconds after it is created (see
+    // expire_file).
+    FileStatus create_file(const string &filename, uint64_t ttl = 0) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status;
+        OpProbe probe(metrics, MetricOp::CREATE);
+        {
+            unique_lock<RWLock> lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            // The timer is reserved before the file is created, so a create that is
+            // logged and announced never has to be taken back for want of one.
+            size_t timer_cost = ttl > 0 ? timer_footprint(filename.size()) : 0;
+            if (timer_cost > 0 && !budget.reserve(timer_cost)) {
+                status = shard.files.find(filename, hash) ? FileStatus::ALREADY_EXISTS
+                                                          : FileStatus::MEMORY_LIMIT_EXCEEDED;
+            } else {
+                status = create_locked(shard, filename, hash, logged);
+                if (status != FileStatus::OK) {
+                    budget.release(timer_cost);
+                } else if (ttl > 0) {
+                    File *file = shard.files.find(filename, hash);
+                    expire_locked(shard, *file, filename, hash, Transaction::deadline_after(ttl), logged, true);
                 }
             }
         }
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
     }
-    bool create_file(const string &filename) {
-        lock_guard<mutex> lock(files_mutex);
-        if (files.find(filename) != files.end()) {
-            cout << "error: another file with same name exists" << endl;
-            return false;
+
+    // With a `ttl`, the file's expiry is reset to that many seconds from now; without,
+    // it is left as it was. If no timer fits, the content is not written either.
+    FileStatus write_file(const string &filename, const string &content, uint64_t ttl = 0) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status;
+        OpProbe probe(metrics, MetricOp::WRITE);
+        {
+            SharedLock lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            // As for create_file, the timer is reserved first; expire_locked hands the
+            // reservation back if the file has one already.
+            size_t timer_cost = ttl > 0 ? timer_footprint(filename.size()) : 0;
+            if (timer_cost > 0 && !budget.reserve(timer_cost)) {
+                status = shard.files.find(filename, hash) ? FileStatus::MEMORY_LIMIT_EXCEEDED : FileStatus::NOT_FOUND;
+            } else {
+                status = write_locked(shard, filename, hash, content, logged);
+                if (status != FileStatus::OK) {
+                    budget.release(timer_cost);
+                } else if (ttl > 0) {
+                    File *file = shard.files.find(filename, hash);
+                    expire_locked(shard, *file, filename, hash, Transaction::deadline_after(ttl), logged, true);
+                }
+            }
         }
-        files[filename] = File();
-        return true;
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
     }
 
-    bool write_file(const string &filename, const string &content) {
-        lock_guard<mutex> lock(files_mutex);
-        if (files.find(filename) == files.end()) {
-            cout << "Error: " << filename << " does not exist" << endl;
-            return false;
-        }
-        if (files[filename].getSize() + content.length() > 2048) {
-            cout << "Error: " << filename << " has reached the maximum size of 2048 bytes" << endl;
-            return false;
+    // Deletes the file `ttl` seconds from now, replacing any expiry it had; a ttl of 0
+    // takes its expiry away. A background thread deletes expired files within a tick
+    // (EXPIRY_TICK_NS) of their deadline, logging each delete. A rename keeps the
+    // expiry, a copy does not get one, and a file deleted and created again starts
+    // without one.
+    FileStatus expire_file(const string &filename, uint64_t ttl) {
+        return set_expiry(filename, Transaction::deadline_after(ttl));
+    }
+
+    // Same with the deadline in nanoseconds since the epoch, 0 for none; used by log
+    // replay.
+    FileStatus set_expiry(const string &filename, int64_t expires_at) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status = FileStatus::NOT_FOUND;
+        {
+            SharedLock lock(shard.files_lock);
+            File *file = shard.files.find(filename, hash);
+            if (file) {
+                status = expire_locked(shard, *file, filename, hash, expires_at, logged);
+            }
         }
-        files[filename].content += content;
-        files[filename].updated_at = system_clock::now();
-        return true;
+        return await_log(logged, status);
     }
 
-    bool delete_file(const string &filename) {
-        lock_guard<mutex> lock(files_mutex);
-        if (files.find(filename) == files.end()) {
-            cout << "File " << filename << " doesn't exist.";
-            return false;
+    // Deadline of the file's expiry in nanoseconds since the epoch, 0 if it has none.
+    FileStatus expiry(const string &filename, int64_t &expires_at) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        SharedLock lock(shard.files_lock);
+        File *file = shard.files.find(filename, hash);
+        if (!file) {
+            return FileStatus::NOT_FOUND;
         }
-        files.erase(filename);
-        return true;
+        lock_guard<mutex> guard(shard.timer_mutex);
+        expires_at = file->timer ? file->timer->expires_at : 0;
+        return FileStatus::OK;
     }
 
-public:
-    map<string, File> files;
-    mutable mutex files_mutex;
-    size_t thread_count;
-    queue<Task> task_queue;
-    mutex task_queue_mutex;
-    condition_variable task_queue_cv;
+    FileStatus delete_file(const string &filename) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status;
+        OpProbe probe(metrics, MetricOp::DELETE);
+        {
+            unique_lock<RWLock> lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            status = delete_locked(shard, filename, hash, logged);
+        }
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
+    }
 
-    size_t outstanding_tasks = 0;
-    condition_variable task_completion_cv;
-    atomic<bool> shutdown{false};
-    vector<thread> workers;
+    // Subscribes to the changes of files whose names start with `prefix` ("" for all).
+    // From the return on, every create, write, pwrite, truncate and delete of such a
+    // file is queued to the watcher, as are those made by copies, transactions and
+    // expiry; a rename is a delete of the old name and a create of the new one, a copy a
+    // create and a write. The changes of one file arrive in the order they were made,
+    // those of different files in any order, and each is queued as soon as it is
+    // visible, which may be before it is logged. A watcher that falls `capacity` events
+    // behind loses the newer ones and is told how many (see Watcher::poll). A change
+    // with nobody watching costs one comparison; each watcher adds a prefix compare,
+    // and a few atomic operations and a name copy if the prefix matches. `wake_fd`, if
+    // given, is an eventfd to signal instead of waking Watcher::wait. A loaded snapshot
+    // replaces every file, and is reported as one RESET event.
+    shared_ptr<Watcher> watch(const string &prefix, size_t capacity = DEFAULT_WATCH_CAPACITY, int wake_fd = -1) {
+        shared_ptr<Watcher> watcher = make_shared<Watcher>(prefix, capacity, wake_fd);
+        vector<unique_lock<RWLock>> locks;
+        locks.reserve(shards.size());
+        for (auto &shard : shards) {
+            locks.emplace_back(shard.files_lock);
+        }
+        for (auto &shard : shards) {
+            shard.watchers.push_back(watcher);
+        }
+        return watcher;
+    }
 
-    MemFS(size_t thread_count) : thread_count(thread_count) {
-        for (size_t i = 0; i < thread_count; ++i) {
-            workers.emplace_back(&MemFS::worker_function, this);
+    // Ends a subscription; no event is queued to the watcher once this returns.
+    void unwatch(const shared_ptr<Watcher> &watcher) {
+        vector<unique_lock<RWLock>> locks;
+        locks.reserve(shards.size());
+        for (auto &shard : shards) {
+            locks.emplace_back(shard.files_lock);
+        }
+        for (auto &shard : shards) {
+            shard.watchers.erase(remove(shard.watchers.begin(), shard.watchers.end(), watcher), shard.watchers.end());
         }
     }
 
-    ~MemFS() {
+    // Creates the directory at `path`; its parent must already exist.
+    FileStatus make_directory(const string &path) {
+        Shard &shard = shard_for(hash_name(path));
+        uint64_t logged = 0;
+        FileStatus status;
         {
-            lock_guard<mutex> lock(task_queue_mutex);
-            shutdown = true;
+            lock_guard<RWLock> lock(shard.files_lock);
+            status = mkdir_locked(path, logged);
         }
-        task_queue_cv.notify_all();
-        for (thread &worker : workers) {
-            if (worker.joinable()) {
-                worker.join();
-            }
+        return await_log(logged, status);
+    }
+
+    void create_directory(const string &path) {
+        FileStatus status = make_directory(path);
+        switch (status) {
+        case FileStatus::OK:
+            cout << "directory created successfully" << endl;
+            break;
+        case FileStatus::ALREADY_EXISTS:
+            cout << "error: another file or directory with same name exists" << endl;
+            break;
+        default:
+            report(OpType::CREATE, path, status);
+            break;
         }
     }
 
-    void create_files(int number_of_files, const vector<string> &filenames) {
+    // Commands on several files apply to all of them or, if any fails, to none (see
+    // apply_transaction).
+    void create_files(int number_of_files, vector<string> filenames, uint64_t ttl = 0) {
         if (number_of_files == 1) {
-            bool flag = create_file(filenames[0]);
-            if (flag) {
+            FileStatus status = create_file(filenames[0], ttl);
+            report(OpType::CREATE, filenames[0], status);
+            if (status == FileStatus::OK) {
                 cout << "file created successfully" << endl;
             }
             return;
         }
-        set<string> unique_files;
+        filenames.resize(number_of_files);
+        Transaction tx;
+        for (int i = 0; i < number_of_files; ++i) {
+            tx.create(filenames[i]);
+        }
+        if (ttl > 0) {
+            tx.expire_after(ttl);
+        }
+        apply_transaction(tx, "files created successfully", "no files were created");
+    }
+
+    void write_files(int number_of_files, vector<string> filenames, vector<string> contents, uint64_t ttl = 0) {
+        if (number_of_files == 1) {
+            FileStatus status = write_file(filenames[0], contents[0], ttl);
+            report(OpType::WRITE, filenames[0], status);
+            if (status == FileStatus::OK) {
+                cout << "successfully written to " << filenames[0] << endl;
+            }
+            return;
+        }
+        filenames.resize(number_of_files);
+        contents.resize(number_of_files);
+        Transaction tx;
+        for (int i = 0; i < number_of_files; ++i) {
+            tx.write(filenames[i], contents[i]);
+        }
+        if (ttl > 0) {
+            tx.expire_after(ttl);
+        }
+        apply_transaction(tx, "successfully written to the given files", "no files were written");
+    }
+
+    // Programmatic read: one probe under the shared shard lock to pin the current
+    // version; the caller reads the bytes through the view with no lock held.
+    FileStatus read(const string &filename, FileView &view) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        FileStatus status = FileStatus::NOT_FOUND;
+        OpProbe probe(metrics, MetricOp::READ);
         {
-            lock_guard<mutex> lock(task_queue_mutex);
-            for (const auto &filename : filenames) {
-                if (unique_files.find(filename) != unique_files.end()) {
-                    cout << "error: another file with same name exists" << endl;
-                    continue;
-                }
-                task_queue.push(Task(filename, "", "create"));
-                ++outstanding_tasks;
-                unique_files.insert(filename);
+            SharedLock lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            File *file = shard.files.find(filename, hash);
+            if (file) {
+                view = FileView(readable(*file));
+                status = FileStatus::OK;
             }
-            task_queue_cv.notify_all();
         }
+        probe.released();
+        probe.finish(status);
+        return status;
+    }
 
-        unique_lock<mutex> lock(task_queue_mutex);
-        task_completion_cv.wait(lock, [this]() { return outstanding_tasks == 0; });
+    void read_file(const string &filename) {
+        read_files(1, vector<string>(1, filename));
+    }
 
-        cout << "files created successfully" << endl;
+    // Pins every requested file first, then emits all of them with a few writev calls.
+    void read_files(int number_of_files, vector<string> filenames) {
+        filenames.resize(number_of_files);
+        vector<FileView> views(filenames.size());
+        cout.flush();
+        ScatterWriter writer(STDOUT_FILENO);
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            if (read(filenames[i], views[i]) != FileStatus::OK) {
+                writer.add_text("Error: " + filenames[i] + " does not exist\n");
+                continue;
+            }
+            views[i].write_to(writer);
+            writer.newline();
+        }
+        writer.flush();
     }
 
-    void write_files(int number_of_files, const vector<string> &filenames, const vector<string> &contents) {
-        if (number_of_files == 1) {
-            bool flag = write_file(filenames[0], contents[0]);
-            if (flag) {
-                cout << "successfully written to " << filenames[0] << endl;
+    // Every file whose name starts with `prefix` and whose content contains `pattern`,
+    // in name order, with the offsets of all occurrences (they may overlap). Each
+    // shard is one pool task: it pins the current versions of its files under the
+    // shared lock, then scans them with no lock held (see SegmentSearch), so writes
+    // never wait for a grep and creates and deletes only while a shard is pinned.
+    // Each file is matched as it was when its shard was pinned. Compressed files are
+    // decoded into a temporary for the scan and stay compressed.
+    vector<GrepMatch> grep(const string &pattern, const string &prefix = string()) {
+        vector<GrepMatch> matches;
+        if (pattern.empty()) {
+            return matches;
+        }
+        SubstringSearch search(pattern);
+        size_t parts = shards.size();
+        shared_ptr<BatchLatch<vector<GrepMatch>>> latch = make_shared<BatchLatch<vector<GrepMatch>>>(parts, parts);
+        future<vector<vector<GrepMatch>>> done = latch->get_future();
+        vector<function<void()>> jobs;
+        jobs.reserve(parts);
+        for (size_t part = 0; part < parts; ++part) {
+            jobs.push_back([this, latch, &search, &prefix, part]() {
+                (*latch)[part] = grep_shard(shards[part], search, prefix);
+                latch->arrive();
+            });
+        }
+        pool.submit_batch(move(jobs));
+        for (auto &found : done.get()) {
+            for (auto &match : found) {
+                matches.push_back(move(match));
             }
-            return;
         }
+        sort(matches.begin(), matches.end(),
+             [](const GrepMatch &a, const GrepMatch &b) { return a.filename < b.filename; });
+        return matches;
+    }
+
+    // Prints one line per matching file: its name, then the offsets of the first
+    // GREP_PRINTED_OFFSETS occurrences.
+    void grep_files(const string &pattern, const string &prefix) {
+        vector<GrepMatch> matches = grep(pattern, prefix);
+        ostringstream out;
+        for (auto &match : matches) {
+            out << match.filename << ":";
+            size_t shown = match.offsets.size() < GREP_PRINTED_OFFSETS ? match.offsets.size() : GREP_PRINTED_OFFSETS;
+            for (size_t i = 0; i < shown; ++i) {
+                out << " " << match.offsets[i];
+            }
+            if (shown < match.offsets.size()) {
+                out << " ... (" << match.offsets.size() << " in all)";
+            }
+            out << "\n";
+        }
+        if (matches.empty()) {
+            out << "no files contain " << pattern << "\n";
+        }
+        cout << out.str();
+    }
 
+    // File handle API. open_file resolves the name once; pread, pwrite and truncate
+    // then reach the file through its descriptor without hashing or comparing the name
+    // (see FileHandle). They copy only the blocks the byte range touches (see
+    // FileVersion::splice), and pread pins just that range. Reading past the end
+    // yields nothing; writing past it fills the gap with zeros.
+    FileStatus open_file(const string &filename, int &fd) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        unique_ptr<FileHandle> handle(new FileHandle());
         {
-            lock_guard<mutex> lock(task_queue_mutex);
-            for (int i = 0; i < number_of_files; ++i) {
-                task_queue.push(Task(filenames[i], contents[i], "write"));
-                ++outstanding_tasks;
+            SharedLock lock(shard.files_lock);
+            File *file = shard.files.find(filename, hash);
+            if (!file) {
+                return FileStatus::NOT_FOUND;
             }
-            task_queue_cv.notify_all();
+            handle->created_at = file->created_at;
+            handle->file = file;
+            handle->layout = shard.layout;
+        }
+        handle->filename = filename;
+        handle->hash = hash;
+        handle->shard = &shard;
+        lock_guard<RWLock> lock(handles.lock);
+        if (handles.free_descriptors.empty()) {
+            fd = static_cast<int>(handles.handles.size());
+            handles.handles.push_back(move(handle));
+        } else {
+            fd = handles.free_descriptors.top();
+            handles.free_descriptors.pop();
+            handles.handles[fd] = move(handle);
+        }
+        return FileStatus::OK;
+    }
+
+    FileStatus close_file(int fd) {
+        lock_guard<RWLock> lock(handles.lock);
+        if (!handles.find(fd)) {
+            return FileStatus::BAD_DESCRIPTOR;
         }
+        handles.handles[fd].reset();
+        handles.free_descriptors.push(fd);
+        return FileStatus::OK;
+    }
 
-        unique_lock<mutex> lock(task_queue_mutex);
-        task_completion_cv.wait(lock, [this]() { return outstanding_tasks == 0; });
-        cout << "successfully written to the given files" << endl;
+    FileStatus pread(int fd, size_t offset, size_t length, FileView &view) {
+        return with_handle(fd, MetricOp::READ, [&](Shard &, File &file, const string &, uint64_t &) {
+            view = FileView(readable(file), offset, length);
+            return FileStatus::OK;
+        });
     }
 
-    void read_file(const string &filename) {
-        lock_guard<mutex> lock(files_mutex);
-        if (files.find(filename) == files.end()) {
-            cout << "Error: " << filename << " does not exist" << endl;
-            return;
+    FileStatus pwrite(int fd, size_t offset, const string &data) {
+        return with_handle(fd, MetricOp::WRITE,
+                           [&](Shard &shard, File &file, const string &filename, uint64_t &logged) {
+                               return pwrite_locked(shard, file, filename, offset, data, logged);
+                           });
+    }
+
+    FileStatus truncate(int fd, size_t size) {
+        return with_handle(fd, MetricOp::WRITE,
+                           [&](Shard &shard, File &file, const string &filename, uint64_t &logged) {
+                               return truncate_locked(shard, file, filename, size, logged);
+                           });
+    }
+
+    // By name, for callers without a handle (and for log replay).
+    FileStatus pwrite_file(const string &filename, size_t offset, const string &data) {
+        return with_file(filename, MetricOp::WRITE,
+                         [&](Shard &shard, File &file, const string &name, uint64_t &logged) {
+                             return pwrite_locked(shard, file, name, offset, data, logged);
+                         });
+    }
+
+    FileStatus truncate_file(const string &filename, size_t size) {
+        return with_file(filename, MetricOp::WRITE,
+                         [&](Shard &shard, File &file, const string &name, uint64_t &logged) {
+                             return truncate_locked(shard, file, name, size, logged);
+                         });
+    }
+
+    // Creates `target` as a copy of `source` that shares its content: the copy's version
+    // is an alias of the source's (see FileVersion::alias), so nothing is copied now and
+    // each file gets content of its own only when it is next written to. ALREADY_EXISTS
+    // if target exists. The copy is charged to the memory budget in full, and logged as
+    // one COPY record naming both files.
+    FileStatus copy_file(const string &source, const string &target) {
+        size_t source_hash = hash_name(source);
+        size_t hash = hash_name(target);
+        Shard &from = shard_for(source_hash);
+        Shard &shard = shard_for(hash);
+        uint64_t logged = 0;
+        FileStatus status;
+        OpProbe probe(metrics, MetricOp::COPY);
+        {
+            // The lower shard first, as rename_file does; the source's shared unless it
+            // is the target's.
+            unique_lock<RWLock> target_lock(shard.files_lock, defer_lock);
+            SharedLock source_lock(from.files_lock, defer_lock);
+            if (&from == &shard) {
+                probe.acquire(target_lock);
+            } else if (&from < &shard) {
+                probe.acquire(source_lock);
+                target_lock.lock();
+            } else {
+                probe.acquire(target_lock);
+                source_lock.lock();
+            }
+            status = copy_locked(from, source, source_hash, shard, target, hash, logged);
+        }
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
+    }
+
+    // Renames file `source` to `target`, keeping its content and times. ALREADY_EXISTS
+    // if target exists. Descriptors open on the file go stale, as after a delete.
+    FileStatus rename_file(const string &source, const string &target) {
+        size_t source_hash = hash_name(source);
+        size_t target_hash = hash_name(target);
+        Shard &from = shard_for(source_hash);
+        Shard &to = shard_for(target_hash);
+        uint64_t logged = 0;
+        FileStatus status;
+        OpProbe probe(metrics, MetricOp::RENAME);
+        {
+            // Both shards exclusively, the lower one first, as load_snapshot does.
+            unique_lock<RWLock> first((&from < &to ? from : to).files_lock, defer_lock);
+            probe.acquire(first);
+            unique_lock<RWLock> second;
+            if (&from != &to) {
+                second = unique_lock<RWLock>((&from < &to ? to : from).files_lock);
+            }
+            status = rename_locked(from, source, source_hash, to, target, target_hash, logged);
+        }
+        probe.released();
+        status = await_log(logged, status);
+        probe.finish(status);
+        return status;
+    }
+
+    // Applies every operation of `tx` or none of them (see Transaction). Optimistic:
+    // each file is pinned under a brief shared lock of its shard and the operations
+    // are played out on the pinned versions with no lock held, building every file's
+    // final version. Only then are the shards of the files locked, exclusively and in
+    // index order, to check that each file is still on the version the transaction
+    // saw (or still absent); the final versions are swapped in and the transaction
+    // logged as one record before the locks are released. There is no lock over all
+    // of MemFS, so transactions on files of different shards commit in parallel, and
+    // other writers to the locked shards wait only for the check and the swap. A file
+    // the transaction did not read but that another writer changed meanwhile is
+    // rebased: its operations are played again on its current version, under the
+    // locks, as if the transaction had come after that writer.
+    //
+    // Nothing changes if an operation fails as it would on its own (a create of a
+    // file that exists or in a missing directory, a write or delete of a missing
+    // file, a write past the size limit), if the memory budget cannot take the
+    // result, or if the content of a file read through the transaction has changed
+    // since, which is CONFLICT. Reads and compaction repack content without changing
+    // it (the version keeps its sequence number), so they cause no conflict; a
+    // transaction without reads never conflicts.
+    TransactionResult commit(Transaction &tx) {
+        size_t n = tx.ops.size();
+        tx.contents.resize(n);
+        TransactionResult result;
+        result.statuses.assign(n, FileStatus::OK);
+        vector<TxFile> files;
+        unordered_map<string, size_t> positions;
+        auto file_for = [&](const string &filename) {
+            auto found = positions.emplace(filename, files.size());
+            if (found.second) {
+                TxFile file;
+                file.name = &found.first->first;
+                file.hash = hash_name(filename);
+                file.shard = (file.hash >> 32) % shards.size();
+                file.leaf = DirectoryTree::leaf_start(filename);
+                files.push_back(move(file));
+            }
+            return found.first->second;
+        };
+        for (size_t i = 0; i < tx.read_names.size(); ++i) {
+            TxFile &file = files[file_for(tx.read_names[i])];
+            if (!file.pinned) {
+                file.pinned = true;
+                file.seen = tx.read_versions[i];
+            }
+        }
+        vector<size_t> file_of(n);
+        for (size_t i = 0; i < n; ++i) {
+            file_of[i] = file_for(tx.filenames[i]);
+        }
+        if (files.empty()) {
+            return result;
+        }
+        for (auto &file : files) {
+            if (!file.pinned) {
+                Shard &shard = shards[file.shard];
+                SharedLock lock(shard.files_lock);
+                File *found = shard.files.find(*file.name, file.hash);
+                if (found) {
+                    file.seen = found->snapshot();
+                }
+            }
+        }
+
+        system_clock::time_point now = system_clock::now();
+        play(tx, files, file_of, vector<bool>(files.size(), true), now, result);
+        if (result.status != FileStatus::OK) {
+            vector<bool> flagged(files.size(), false);
+            for (size_t i = 0; i < n; ++i) {
+                if (result.statuses[i] != FileStatus::OK) {
+                    flagged[file_of[i]] = true;
+                }
+            }
+            list_failed(result, files, flagged);
+            if (metrics.enabled) {
+                metrics.operations[static_cast<size_t>(MetricOp::COMMIT)].add(1);
+                metrics.failures[static_cast<size_t>(MetricOp::COMMIT)].add(1);
+            }
+            return result;
+        }
+
+        vector<size_t> locked;
+        for (auto &file : files) {
+            locked.push_back(file.shard);
+        }
+        sort(locked.begin(), locked.end());
+        locked.erase(unique(locked.begin(), locked.end()), locked.end());
+        uint64_t logged = 0;
+        OpProbe probe(metrics, MetricOp::COMMIT);
+        {
+            vector<unique_lock<RWLock>> locks;
+            locks.reserve(locked.size());
+            for (size_t shard : locked) {
+                locks.emplace_back(shards[shard].files_lock, defer_lock);
+                if (locks.size() == 1) {
+                    probe.acquire(locks.back());
+                } else {
+                    locks.back().lock();
+                }
+            }
+            commit_locked(tx, files, file_of, now, result, logged);
+        }
+        probe.released();
+        result.status = await_log(logged, result.status);
+        probe.finish(result.status);
+        return result;
+    }
+
+    // Reads `filename` as part of `tx`, as read() does; tx then only commits if the
+    // file is still on the version read. A missing file is remembered as missing.
+    FileStatus read(Transaction &tx, const string &filename, FileView &view) {
+        size_t hash = hash_name(filename);
+        Shard &shard = shard_for(hash);
+        shared_ptr<const FileVersion> version;
+        OpProbe probe(metrics, MetricOp::READ);
+        {
+            SharedLock lock(shard.files_lock, defer_lock);
+            probe.acquire(lock);
+            File *file = shard.files.find(filename, hash);
+            if (file) {
+                version = readable(*file);
+            }
+        }
+        probe.released();
+        tx.read_names.push_back(filename);
+        tx.read_versions.push_back(version);
+        FileStatus status = version ? FileStatus::OK : FileStatus::NOT_FOUND;
+        view = FileView(move(version));
+        probe.finish(status);
+        return status;
+    }
+
+    // Commits tx for a command. Prints `done` if it went through (unless null), and
+    // otherwise every failure, then `undone` with the files that failed.
+    bool apply_transaction(Transaction &tx, const char *done, const char *undone) {
+        TransactionResult result = commit(tx);
+        if (result.status == FileStatus::OK) {
+            if (done) {
+                cout << done << endl;
+            }
+            return true;
+        }
+        if (result.status == FileStatus::CONFLICT) {
+            for (auto &filename : result.failed) {
+                report(OpType::WRITE, filename, FileStatus::CONFLICT);
+            }
+        } else {
+            for (size_t i = 0; i < result.statuses.size(); ++i) {
+                report(tx.ops[i], tx.filenames[i], result.statuses[i]);
+            }
+        }
+        cout << "Error: " << undone << " (failed: ";
+        for (size_t k = 0; k < result.failed.size(); ++k) {
+            cout << (k > 0 ? ", " : "") << result.failed[k];
         }
-        cout << files[filename].content << endl;
+        cout << ")" << endl;
+        return false;
     }
 
-    void delete_files(int number_of_files, const vector<string> &filenames) {
+    void delete_files(int number_of_files, vector<string> filenames) {
         if (number_of_files == 1) {
-            bool flag = delete_file(filenames[0]);
-            if (flag) {
+            FileStatus status = delete_file(filenames[0]);
+            report(OpType::DELETE, filenames[0], status);
+            if (status == FileStatus::OK) {
                 cout << "file deleted successfully" << endl;
             }
             return;
         }
+        filenames.resize(number_of_files);
+        Transaction tx;
+        for (int i = 0; i < number_of_files; ++i) {
+            tx.remove(filenames[i]);
+        }
+        apply_transaction(tx, "files deleted successfully", "no files were deleted");
+    }
+
+    // Writes every file to an image at `path`, through a temporary file that is renamed
+    // over it, so an existing image is replaced atomically. The shards are held (shared)
+    // only while the current versions are pinned; the image itself is written with no
+    // lock held, so writes never wait on a save and creates/deletes only briefly.
+    SnapshotStatus save_snapshot(const string &path) {
+        SnapshotStatus status;
+        vector<string> names;
+        vector<system_clock::time_point> created;
+        vector<shared_ptr<const FileVersion>> versions;
+        vector<int64_t> expiries;
+        size_t directories = 0;
+        uint64_t log_position = 0;
+        {
+            vector<SharedLock> locks;
+            locks.reserve(shards.size());
+            size_t total = 0;
+            for (auto &shard : shards) {
+                locks.emplace_back(shard.files_lock);
+                total += shard.files.size();
+            }
+            names.reserve(total);
+            created.reserve(total);
+            versions.reserve(total);
+            expiries.reserve(total);
+            auto pin = [&]() {
+                tree.for_each_directory([&](const string &dir_path, const Directory &dir) {
+                    names.push_back(dir_path);
+                    created.push_back(dir.created_at);
+                    versions.push_back(nullptr);
+                    expiries.push_back(0);
+                    ++directories;
+                });
+                for (auto &shard : shards) {
+                    lock_guard<mutex> guard(shard.timer_mutex);
+                    shard.files.for_each([&](const FileKey &key, File &file) {
+                        names.push_back(key.str());
+                        created.push_back(file.created_at);
+                        versions.push_back(file.snapshot());
+                        expiries.push_back(file.timer ? file.timer->expires_at : 0);
+                    });
+                }
+            };
+            // Creates, deletes and mkdirs are held off by the shard locks, and writes and
+            // expiry changes by the log, so what is pinned is exactly the log up to
+            // log_position.
+            if (wal) {
+                log_position = wal->cut(pin);
+            } else {
+                pin();
+            }
+        }
+
+        size_t n = names.size();
+        vector<SnapshotEntry> entries(n);
+        uint64_t offset = sizeof(SnapshotHeader) + n * sizeof(SnapshotEntry);
+        for (size_t i = 0; i < n; ++i) {
+            entries[i].name_offset = offset;
+            entries[i].name_size = static_cast<uint32_t>(names[i].size());
+            offset += names[i].size();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            entries[i].content_offset = offset;
+            entries[i].created_at = to_nanoseconds(created[i]);
+            entries[i].expires_at = expiries[i];
+            if (i < directories) {
+                entries[i].content_size = 0;
+                entries[i].updated_at = entries[i].created_at;
+                entries[i].flags = SnapshotEntry::DIRECTORY;
+                continue;
+            }
+            entries[i].content_size = versions[i]->size;
+            entries[i].updated_at = to_nanoseconds(versions[i]->updated_at);
+            entries[i].flags = 0;
+            offset += versions[i]->size;
+        }
+        SnapshotHeader header;
+        memcpy(header.magic, SnapshotHeader::expected_magic(), sizeof(header.magic));
+        header.format = SnapshotHeader::FORMAT;
+        header.byte_order = SnapshotHeader::BYTE_ORDER_MARK;
+        header.file_count = n;
+        header.image_size = offset;
+        header.log_position = log_position;
+
+        string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            status.error = "cannot create " + temp + ": " + strerror(errno);
+            return status;
+        }
+        bool ok;
         {
-            lock_guard<mutex> lock(task_queue_mutex);
-            for (const auto &filename : filenames) {
-                task_queue.push(Task(filename, "", "delete"));
-                ++outstanding_tasks;
+            // Names and small segments are gathered into staging buffers, since one
+            // iovec per few-byte fragment costs more than the copy; large segments
+            // go out straight from their blocks or mapping.
+            ScatterWriter writer(fd);
+            string staging;
+            auto emit = [&writer, &staging](const char *data, size_t len) {
+                if (len >= SNAPSHOT_DIRECT_BYTES) {
+                    writer.add_text(move(staging));
+                    staging.clear();
+                    writer.add(data, len);
+                } else {
+                    staging.append(data, len);
+                    if (staging.size() >= SNAPSHOT_STAGING_BYTES) {
+                        writer.add_text(move(staging));
+                        staging.clear();
+                    }
+                }
+            };
+            writer.add(reinterpret_cast<const char *>(&header), sizeof(header));
+            writer.add(reinterpret_cast<const char *>(entries.data()), n * sizeof(SnapshotEntry));
+            ok = writer.flush();
+            for (size_t i = 0; i < n && ok; ++i) {
+                emit(names[i].data(), names[i].size());
+                if (writer.pending() >= SNAPSHOT_FLUSH_PIECES) {
+                    ok = writer.flush();
+                }
             }
-            task_queue_cv.notify_all();
+            for (size_t i = directories; i < n && ok; ++i) {
+                // A packed file (or an alias of one) is decoded into a buffer the writer
+                // owns, and stays packed.
+                if (versions[i]->body().packed) {
+                    writer.add_text(move(staging));
+                    staging.clear();
+                    writer.add_text(versions[i]->str());
+                } else {
+                    versions[i]->for_each_segment(emit);
+                }
+                if (writer.pending() >= SNAPSHOT_FLUSH_PIECES) {
+                    ok = writer.flush();
+                }
+            }
+            writer.add_text(move(staging));
+            ok = ok && writer.flush();
+        }
+        ok = ok && fsync(fd) == 0;
+        int error = errno;
+        ok = close(fd) == 0 && ok;
+        if (ok && rename(temp.c_str(), path.c_str()) != 0) {
+            ok = false;
+            error = errno;
+        }
+        if (!ok) {
+            unlink(temp.c_str());
+            status.error = "cannot write " + path + ": " + strerror(error);
+            return status;
+        }
+        status.ok = true;
+        status.files = n - directories;
+        status.log_position = log_position;
+        return status;
+    }
+
+    // Replaces every file with the contents of the image at `path`. The new tables are
+    // built off to the side by the pool, one task per shard, then swapped in under all
+    // shard locks. File contents are not copied: they are read from the mapping until
+    // a write appends to them.
+    SnapshotStatus load_snapshot(const string &path) {
+        SnapshotStatus status;
+        if (wal) {
+            // The log only records operations, so it could not reproduce the swap.
+            status.error = "cannot load a snapshot while the write-ahead log is on; restart with it instead";
+            return status;
+        }
+        shared_ptr<const MappedImage> image = MappedImage::open(path, status.error);
+        if (!image) {
+            return status;
+        }
+        // Directories come first in the image, so the new tree is complete before any
+        // file is placed in it; each file's parent is resolved here, once.
+        size_t n = image->header().file_count;
+        size_t shard_count = shards.size();
+        DirectoryTree loaded;
+        vector<size_t> hashes(n);
+        vector<Directory *> parents(n);
+        vector<vector<size_t>> buckets(shard_count);
+        string name;
+        for (size_t i = 0; i < n; ++i) {
+            SnapshotEntry entry = image->entry(i);
+            name.assign(image->at(entry.name_offset), entry.name_size);
+            size_t leaf = DirectoryTree::leaf_start(name);
+            Directory *parent = loaded.parent_of(name, leaf);
+            if (!parent) {
+                status.error = path + ": no directory holds " + name;
+                return status;
+            }
+            if (entry.flags & SnapshotEntry::DIRECTORY) {
+                shared_ptr<Directory> dir = make_shared<Directory>(from_nanoseconds(entry.created_at));
+                parent->directories.emplace(name.substr(leaf), move(dir));
+                continue;
+            }
+            parents[i] = parent;
+            hashes[i] = hash_name(name);
+            buckets[(hashes[i] >> 32) % shard_count].push_back(i);
         }
 
-        unique_lock<mutex> lock(task_queue_mutex);
-        task_completion_cv.wait(lock, [this]() { return outstanding_tasks == 0; });
+        vector<unique_ptr<FileIndex<File>>> tables(shard_count);
+        vector<size_t> shard_bytes(shard_count, 0);
+        vector<vector<FileTimer *>> timers(shard_count);
+        BatchLatch<size_t> latch(shard_count, shard_count);
+        future<vector<size_t>> built = latch.get_future();
+        vector<function<void()>> jobs;
+        jobs.reserve(shard_count);
+        for (size_t s = 0; s < shard_count; ++s) {
+            tables[s].reset(new FileIndex<File>());
+            jobs.push_back([this, s, &image, &buckets, &hashes, &parents, &tables, &shard_bytes, &timers, &latch]() {
+                latch[s] = restore_shard(image, buckets[s], hashes, parents, *tables[s], shard_bytes[s], timers[s]);
+                latch.arrive();
+            });
+        }
+        pool.submit_batch(move(jobs));
+        vector<size_t> costs = built.get();
+
+        size_t new_cost = loaded.memory_bytes();
+        size_t new_count = 0;
+        size_t new_bytes = 0;
+        int64_t new_timed = 0;
+        for (size_t s = 0; s < shard_count; ++s) {
+            new_cost += costs[s];
+            new_count += tables[s]->size();
+            new_bytes += shard_bytes[s];
+            new_timed += static_cast<int64_t>(timers[s].size());
+        }
+        {
+            vector<unique_lock<RWLock>> locks;
+            locks.reserve(shard_count);
+            for (auto &shard : shards) {
+                locks.emplace_back(shard.files_lock);
+            }
+            size_t old_bytes = 0;
+            int64_t old_timed = 0;
+            size_t old_cost = footprint_locked(old_bytes, old_timed);
+            if (!budget.try_release(old_cost)) {
+                status.error = "memory accounting is off: " + to_string(budget.bytes_used()) +
+                               " bytes charged but the files take " + to_string(old_cost) + ", cannot load " + path;
+                return status;
+            }
+            if (!budget.reserve(new_cost)) {
+                budget.charge(old_cost);
+                status.error = "memory limit of " + to_string(budget.bytes_limit()) + " bytes reached, cannot load " + path;
+                return status;
+            }
+            for (size_t s = 0; s < shard_count; ++s) {
+                shards[s].files.swap(*tables[s]);
+                ++shards[s].layout;
+                lock_guard<mutex> guard(shards[s].timer_mutex);
+                shards[s].timers.clear();
+                for (FileTimer *timer : timers[s]) {
+                    timer->deadline = expiry_tick(timer->expires_at);
+                    shards[s].timers.insert(timer);
+                }
+            }
+            tree.swap(loaded);
+            file_count = new_count;
+            for (const auto &watcher : shards[0].watchers) {
+                watcher->offer(ChangeKind::RESET, string(), 0);
+            }
+            content_bytes.add(static_cast<int64_t>(new_bytes) - static_cast<int64_t>(old_bytes));
+            expiring_files.add(new_timed - old_timed);
+        }
+        if (new_timed > 0) {
+            start_expirer();
+        }
+        // The previous tables and tree are now in `tables` and `loaded` and are freed
+        // on return, after unlocking.
+        for (auto &table : tables) {
+            table->for_each([this](const FileKey &, File &file) { count_version(*file.version, -1); });
+        }
+        loaded_log_position = image->header().log_position;
+        status.ok = true;
+        status.files = new_count;
+        status.log_position = loaded_log_position;
+        return status;
+    }
 
-        cout << "files deleted successfully" << endl;
+    // Replays options.log_path on top of the current state (normally empty or a freshly
+    // loaded snapshot) and starts logging every change from then on.
+    LogStatus open_log() {
+        LogStatus status;
+        if (options.log_path.empty()) {
+            status.ok = true;
+            return status;
+        }
+        auto apply = [this](LogOp op, const string &filename, const string &content) {
+            switch (op) {
+            case LogOp::MKDIR:
+                make_directory(filename);
+                break;
+            case LogOp::CREATE:
+                create_file(filename);
+                break;
+            case LogOp::WRITE:
+                write_file(filename, content);
+                break;
+            case LogOp::DELETE:
+                delete_file(filename);
+                break;
+            case LogOp::RENAME:
+                rename_file(filename, content);
+                break;
+            case LogOp::COPY:
+                copy_file(filename, content);
+                break;
+            case LogOp::EXPIRE:
+                if (content.size() == sizeof(int64_t)) {
+                    int64_t expires_at;
+                    memcpy(&expires_at, content.data(), sizeof(expires_at));
+                    set_expiry(filename, expires_at);
+                }
+                break;
+            case LogOp::TRANSACTION: {
+                Transaction tx;
+                if (read_transaction_record(content, tx)) {
+                    commit(tx);
+                }
+                break;
+            }
+            case LogOp::PWRITE:
+            case LogOp::TRUNCATE:
+                if (content.size() >= sizeof(uint64_t)) {
+                    uint64_t position;
+                    memcpy(&position, content.data(), sizeof(position));
+                    if (op == LogOp::PWRITE) {
+                        pwrite_file(filename, position, content.substr(sizeof(position)));
+                    } else {
+                        truncate_file(filename, position);
+                    }
+                }
+                break;
+            }
+        };
+        wal = WriteAheadLog::open(options.log_path, options.log_mode, loaded_log_position, apply, status);
+        if (wal && expiring_files.value() > 0) {
+            start_expirer();
+        }
+        return status;
     }
 
-    void ls(bool lflag) {
-        if (!lflag) {
-            lock_guard<mutex> lock(files_mutex);
-            for (auto &file : files) {
-                cout << file.first << endl;
+    // Compresses the content of every file that has not been read or written for
+    // `idle` seconds and returns how many it packed. Runs in the background when
+    // options.cold_after is set. Accesses are stamped with the clock as of the last
+    // pass, so a file counts as idle from that pass on and may be packed up to one
+    // pass period early. Files with nothing in blocks (empty, or entirely in a mapped
+    // image), files sharing their content and files that would not shrink are left
+    // alone.
+    //
+    // Per shard, the candidates' versions are pinned under the shared lock,
+    // compressed with no lock held, then published under the shared lock again, each
+    // only if the file is still on the pinned version and still idle. Writers and
+    // readers are never held up by the compression itself; a later read or write
+    // unpacks the file (see readable and FileVersion::append).
+    size_t compact_cold(size_t idle) {
+        uint32_t now = static_cast<uint32_t>(duration_cast<seconds>(steady_clock::now() - metrics.started).count());
+        uint32_t clock = cold_clock.load();
+        while (clock < now && !cold_clock.compare_exchange_weak(clock, now)) {
+        }
+        now = max(now, clock);
+        auto is_idle = [now, idle](const File &file) {
+            uint32_t accessed = file.accessed.load(memory_order_relaxed);
+            return accessed <= now && now - accessed >= idle;
+        };
+        size_t packed = 0;
+        vector<string> names;
+        vector<shared_ptr<const FileVersion>> versions;
+        for (auto &shard : shards) {
+            names.clear();
+            versions.clear();
+            {
+                SharedLock lock(shard.files_lock);
+                shard.files.for_each([&](const FileKey &key, File &file) {
+                    if (!is_idle(file)) {
+                        return;
+                    }
+                    shared_ptr<const FileVersion> version = file.snapshot();
+                    // Held by more than this file and the pin: its content is shared with
+                    // other files, and packing this file's copy would free nothing.
+                    if (version.use_count() > 2) {
+                        return;
+                    }
+                    if (version->size > 0 && !version->packed && !version->blocks.empty()) {
+                        names.push_back(key.str());
+                        versions.push_back(move(version));
+                    }
+                });
+            }
+            vector<shared_ptr<const FileVersion>> packs(versions.size());
+            for (size_t i = 0; i < versions.size(); ++i) {
+                packs[i] = FileVersion::pack(*versions[i]);
+            }
+            SharedLock lock(shard.files_lock);
+            for (size_t i = 0; i < versions.size(); ++i) {
+                if (!packs[i]) {
+                    continue;
+                }
+                File *file = shard.files.find(names[i], hash_name(names[i]));
+                if (file && is_idle(*file) && file->publish(versions[i], packs[i])) {
+                    budget.release(versions[i]->footprint() - packs[i]->footprint());
+                    count_version(*packs[i], 1);
+                    ++packed;
+                }
             }
+        }
+        return packed;
+    }
+
+    void stats() const {
+        MetricsSnapshot snapshot = metrics_snapshot();
+        ostringstream out;
+        out << fixed << setprecision(1);
+        out << "files: " << snapshot.files << ", bytes stored: " << snapshot.bytes_stored
+            << ", memory used: " << snapshot.memory_used;
+        if (snapshot.memory_limit > 0) {
+            out << " of " << snapshot.memory_limit;
+        }
+        if (snapshot.cold_files > 0) {
+            out << "\ncold:   " << snapshot.cold_files << " files compressed, " << snapshot.cold_bytes << " bytes in "
+                << snapshot.cold_stored;
+        }
+        if (snapshot.shared_files > 0) {
+            out << "\nshared: " << snapshot.shared_files << " files share content with another, "
+                << snapshot.shared_bytes << " bytes";
+        }
+        if (snapshot.expiring_files > 0 || snapshot.expired_files > 0) {
+            out << "\nexpiry: " << snapshot.expiring_files << " files set to expire, " << snapshot.expired_files
+                << " expired";
+        }
+        out << "\nuptime: " << snapshot.uptime_seconds << " s\n";
+        if (!snapshot.enabled) {
+            out << "metrics are off\n";
+            cout << out.str();
             return;
         }
-        lock_guard<mutex> lock(files_mutex);
-        const int MY_SIZE_WIDTH = 10;
-        const int TIME_WIDTH = 30;
-        const int NAME_WIDTH = 20;
+        auto latency = [&out](const LatencySummary &summary) {
+            out << "mean " << summary.mean_us << " us, p50 " << summary.p50_us << ", p99 " << summary.p99_us
+                << ", p99.9 " << summary.p999_us << ", max " << summary.max_us;
+        };
+        for (auto &op : snapshot.operations) {
+            out << left << setw(8) << op.name << right << op.count << " ops, " << op.failed << " failed";
+            if (op.latency.samples > 0) {
+                out << "; ";
+                latency(op.latency);
+            }
+            out << "\n";
+        }
+        out << "locks:  " << snapshot.lock_acquisitions << " acquired, " << snapshot.lock_contended << " contended\n";
+        out << "  wait: ";
+        latency(snapshot.lock_wait);
+        out << "\n  hold: ";
+        latency(snapshot.lock_hold);
+        out << "\npool:   " << snapshot.workers << " workers, " << snapshot.worker_utilization << "% busy, "
+            << snapshot.tasks << " tasks, queue depth " << snapshot.queue_depth << " (peak "
+            << snapshot.peak_queue_depth << ")\n";
+        out << "  wait: ";
+        latency(snapshot.task_wait);
+        out << "\n  run:  ";
+        latency(snapshot.task_run);
+        out << "\n";
+        cout << out.str();
+    }
+
+    // Lists the directory at `path` ("" for the root). By default files and
+    // subdirectories are merged in name order, subdirectories marked with a trailing
+    // '/'; sorted by another key, subdirectories come first. See listing_order for
+    // how the secondary orders are kept.
+    //
+    // No lock is held while the listing is formatted and printed. The directory lends
+    // its cached name-ordered view of its files, which stays valid however the
+    // directory changes afterwards; each file's current version is then pinned under
+    // a brief shared lock of its shard (a file deleted before that is skipped), and
+    // the output is written a page at a time from those pins. Writers never wait on a
+    // listing: they share the shard lock, and a version, once pinned, is immutable.
+    //
+    // The pins are taken one shard at a time, so a listing is not one atomic snapshot:
+    // each file is shown as it was at some moment during the listing, and a
+    // transaction committed meanwhile may show in some of its files and not others.
+    // The names are consistent, though. If a file was added to or removed from the
+    // directory while the pins were taken (a delete and re-create included), the
+    // directory's generation has moved, and the view is rebuilt and the files pinned
+    // again, up to LIST_ATTEMPTS times; under churn that outlasts them, the last
+    // attempt is listed as it stands.
+    FileStatus ls(const string &path, const ListOptions &options) {
+        const int LIST_ATTEMPTS = 4;
+        shared_ptr<Directory> dir;
+        shared_ptr<const vector<DirectoryEntry>> view;
+        vector<pair<string, system_clock::time_point>> subdirectories;
+        bool pin = options.long_format || options.order != ListOrder::NAME || options.filtered();
+        vector<ListedFile> pinned;
+        for (int attempt = 1;; ++attempt) {
+            vector<DirectoryEntry> unsorted;
+            uint64_t generation = 0;
+            subdirectories.clear();
+            {
+                SharedLock shard_lock(shard_for(hash_name(path)).files_lock);
+                Directory *found = tree.find(path);
+                if (!found) {
+                    cout << "Error: directory " << path << " does not exist" << endl;
+                    return FileStatus::NO_SUCH_DIRECTORY;
+                }
+                dir = found->shared_from_this();
+                SharedLock lock(dir->lock);
+                generation = dir->generation;
+                view = dir->cached_files();
+                if (!view) {
+                    unsorted = dir->file_entries();
+                }
+                if (!options.filtered()) {
+                    for (auto &sub : dir->directories) {
+                        subdirectories.emplace_back(sub.first, sub.second->created_at);
+                    }
+                }
+            }
+            if (!view) {
+                sort(unsorted.begin(), unsorted.end(),
+                     [](const DirectoryEntry &a, const DirectoryEntry &b) { return a.name < b.name; });
+                view = make_shared<const vector<DirectoryEntry>>(move(unsorted));
+                dir->cache_files(view, generation);
+            }
+            if (!pin) {
+                break;
+            }
+            const vector<DirectoryEntry> &files = *view;
+            pinned.assign(files.size(), ListedFile());
+            string filename = path.empty() ? string() : path + "/";
+            size_t prefix = filename.size();
+            for (size_t i = 0; i < files.size(); ++i) {
+                filename.resize(prefix);
+                filename += files[i].name;
+                Shard &shard = shard_for(files[i].hash);
+                SharedLock lock(shard.files_lock);
+                File *file = shard.files.find(filename, files[i].hash);
+                if (file) {
+                    pinned[i].created_at = file->created_at;
+                    pinned[i].version = file->snapshot();
+                }
+            }
+            if (attempt == LIST_ATTEMPTS) {
+                break;
+            }
+            SharedLock lock(dir->lock);
+            if (dir->generation == generation) {
+                break;
+            }
+        }
+        const vector<DirectoryEntry> &files = *view;
 
-        cout << left
-             << setw(MY_SIZE_WIDTH) << "size"
-             << setw(TIME_WIDTH) << "created"
-             << setw(TIME_WIDTH) << "last modified"
-             << setw(NAME_WIDTH) << "filename"
-             << endl;
+        // Items to print: indices into files, then subdirectories past files.size().
+        size_t file_count = files.size();
+        vector<uint32_t> items;
+        items.reserve(file_count + subdirectories.size());
+        if (options.order == ListOrder::NAME) {
+            size_t f = 0;
+            size_t d = 0;
+            while (f < file_count || d < subdirectories.size()) {
+                if (d == subdirectories.size() || (f < file_count && files[f].name < subdirectories[d].first)) {
+                    items.push_back(static_cast<uint32_t>(f++));
+                } else {
+                    items.push_back(static_cast<uint32_t>(file_count + d++));
+                }
+            }
+        } else {
+            for (size_t d = 0; d < subdirectories.size(); ++d) {
+                items.push_back(static_cast<uint32_t>(file_count + d));
+            }
+            shared_ptr<const vector<uint32_t>> order = listing_order(*dir, view, options.order, pinned);
+            items.insert(items.end(), order->begin(), order->end());
+        }
+        if (options.reverse) {
+            reverse(items.begin(), items.end());
+        }
 
-        cout << string(MY_SIZE_WIDTH + TIME_WIDTH * 2 + NAME_WIDTH, '-') << endl;
+        const size_t MY_SIZE_WIDTH = 10;
+        const size_t TIME_WIDTH = 30;
+        const size_t NAME_WIDTH = 20;
+        auto pad = [](string &out, size_t start, size_t width) {
+            if (out.size() - start < width) {
+                out.append(width - (out.size() - start), ' ');
+            }
+        };
+        auto line = [&](string &out, const string &size, const string &stored, system_clock::time_point created,
+                        system_clock::time_point modified, const string &name, bool directory) {
+            size_t start = out.size();
+            out += size;
+            pad(out, start, MY_SIZE_WIDTH);
+            start = out.size();
+            out += stored;
+            pad(out, start, MY_SIZE_WIDTH);
+            start = out.size();
+            TimeText::append(out, created);
+            pad(out, start, TIME_WIDTH);
+            start = out.size();
+            TimeText::append(out, modified);
+            pad(out, start, TIME_WIDTH);
+            start = out.size();
+            out += name;
+            if (directory) {
+                out += '/';
+            }
+            pad(out, start, NAME_WIDTH);
+            out += '\n';
+        };
 
-        for (auto &file : files) {
-            cout << left
-                 << setw(MY_SIZE_WIDTH) << file.second.getSize()
-                 << setw(TIME_WIDTH) << file.second.getCreatedTime()
-                 << setw(TIME_WIDTH) << file.second.getUpdatedTime()
-                 << setw(NAME_WIDTH) << file.first
-                 << endl;
+        system_clock::time_point now = system_clock::now();
+        string page;
+        if (options.long_format) {
+            page = "size      stored    created                       last modified                 filename            \n";
+            page.append(MY_SIZE_WIDTH * 2 + TIME_WIDTH * 2 + NAME_WIDTH, '-');
+            page += '\n';
+        }
+        size_t lines = 0;
+        for (uint32_t item : items) {
+            if (item >= file_count) {
+                const pair<string, system_clock::time_point> &sub = subdirectories[item - file_count];
+                if (options.long_format) {
+                    line(page, "-", "-", sub.second, sub.second, sub.first, true);
+                } else {
+                    page += sub.first;
+                    page += "/\n";
+                }
+            } else if (!pin) {
+                page += files[item].name;
+                page += '\n';
+            } else {
+                const ListedFile &file = pinned[item];
+                if (!file.version || !listed(file, options, now)) {
+                    continue;
+                }
+                if (options.long_format) {
+                    line(page, to_string(file.version->size), to_string(file.version->stored_bytes()), file.created_at,
+                         file.version->updated_at, files[item].name, false);
+                } else {
+                    page += files[item].name;
+                    page += '\n';
+                }
+            }
+            if (++lines == LIST_PAGE_LINES) {
+                cout.write(page.data(), page.size());
+                page.clear();
+                lines = 0;
+            }
         }
+        cout.write(page.data(), page.size());
+        cout.flush();
+        return FileStatus::OK;
+    }
+
+    void ls(const string &path, bool lflag) {
+        ListOptions options;
+        options.long_format = lflag;
+        ls(path, options);
     }
 };
-#endif
+#endif
\ No newline at end of file
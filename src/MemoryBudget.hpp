@@ -0,0 +1,64 @@
+#ifndef MEMORYBUDGET_HPP
+#define MEMORYBUDGET_HPP
+
+#include <atomic>
+#include <cstddef>
+
+using namespace std;
+
+// Filesystem-wide byte counter with an optional ceiling (limit 0 = unlimited).
+// Operations reserve their allocation before making it, so a request that would
+// cross the limit is rejected up front instead of after the memory is spent.
+class MemoryBudget {
+private:
+    atomic<size_t> used{0};
+    size_t limit;
+
+public:
+    explicit MemoryBudget(size_t limit) : limit(limit) {}
+
+    bool reserve(size_t bytes) {
+        if (limit == 0) {
+            used += bytes;
+            return true;
+        }
+        size_t current = used.load();
+        do {
+            if (current + bytes > limit) {
+                return false;
+            }
+        } while (!used.compare_exchange_weak(current, current + bytes));
+        return true;
+    }
+
+    // For bookkeeping that cannot be refused, e.g. an index resize already under way.
+    void charge(size_t bytes) {
+        used += bytes;
+    }
+
+    void release(size_t bytes) {
+        used -= bytes;
+    }
+
+    // Releases `bytes` unless fewer than that are in use, which means the accounting
+    // has drifted; then it releases nothing and returns false instead of wrapping.
+    bool try_release(size_t bytes) {
+        size_t current = used.load();
+        do {
+            if (current < bytes) {
+                return false;
+            }
+        } while (!used.compare_exchange_weak(current, current - bytes));
+        return true;
+    }
+
+    size_t bytes_used() const {
+        return used.load();
+    }
+
+    size_t bytes_limit() const {
+        return limit;
+    }
+};
+
+#endif
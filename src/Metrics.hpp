@@ -0,0 +1,182 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// Metrics are sharded over METRIC_SHARDS slots, each thread updating its own slot, so
+// counting never bounces one cache line between cores. Readers sum the slots.
+static const size_t METRIC_SHARDS = 16;
+
+inline size_t metrics_slot() {
+    static atomic<size_t> next{0};
+    static thread_local size_t slot = next++ % METRIC_SHARDS;
+    return slot;
+}
+
+inline uint64_t nanoseconds_between(steady_clock::time_point from, steady_clock::time_point to) {
+    return static_cast<uint64_t>(duration_cast<nanoseconds>(to - from).count());
+}
+
+class ShardedCounter {
+private:
+    // Padded to a cache line so neighbouring slots do not share one.
+    class Cell {
+    public:
+        atomic<int64_t> value{0};
+        char padding[64 - sizeof(atomic<int64_t>)];
+    };
+
+    Cell cells[METRIC_SHARDS];
+
+public:
+    void add(int64_t n) {
+        cells[metrics_slot()].value.fetch_add(n, memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        int64_t total = 0;
+        for (const Cell &cell : cells) {
+            total += cell.value.load(memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+// Log-linear latency buckets in nanoseconds (the HdrHistogram scheme): every power of
+// two is split into SUB_BUCKETS linear buckets, so a percentile read back from them is
+// within 1/SUB_BUCKETS of the true value. Values past 2^MAX_MAGNITUDE ns (about 18
+// minutes) land in the last bucket.
+class LatencyBuckets {
+public:
+    static const size_t SUB_BITS = 4;
+    static const size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+    static const size_t MAX_MAGNITUDE = 40;
+    static const size_t COUNT = (MAX_MAGNITUDE - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return static_cast<size_t>(ns);
+        }
+        size_t magnitude = 63 - __builtin_clzll(ns);
+        if (magnitude >= MAX_MAGNITUDE) {
+            return COUNT - 1;
+        }
+        size_t shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((ns >> shift) - SUB_BUCKETS);
+    }
+
+    // Largest value that falls into bucket b.
+    static uint64_t bucket_top(size_t b) {
+        if (b < SUB_BUCKETS) {
+            return b;
+        }
+        size_t shift = b / SUB_BUCKETS - 1;
+        uint64_t base = static_cast<uint64_t>(SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+};
+
+class LatencySummary {
+public:
+    uint64_t samples = 0;
+    double mean_us = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double max_us = 0;
+};
+
+// Concurrent latency histogram: one bucket array per metrics slot, updated with
+// relaxed atomic adds.
+class ShardedHistogram {
+private:
+    unique_ptr<atomic<uint64_t>[]> counts;
+    ShardedCounter sum_ns;
+    atomic<uint64_t> max_ns{0};
+
+public:
+    ShardedHistogram() : counts(new atomic<uint64_t>[METRIC_SHARDS * LatencyBuckets::COUNT]()) {}
+
+    // Records `weight` samples of ns each.
+    void record(uint64_t ns, uint64_t weight = 1) {
+        counts[metrics_slot() * LatencyBuckets::COUNT + LatencyBuckets::bucket_of(ns)].fetch_add(weight, memory_order_relaxed);
+        sum_ns.add(static_cast<int64_t>(ns * weight));
+        uint64_t seen = max_ns.load(memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, memory_order_relaxed)) {
+        }
+    }
+
+    LatencySummary summary() const {
+        vector<uint64_t> merged(LatencyBuckets::COUNT, 0);
+        LatencySummary result;
+        for (size_t slot = 0; slot < METRIC_SHARDS; ++slot) {
+            for (size_t b = 0; b < LatencyBuckets::COUNT; ++b) {
+                uint64_t n = counts[slot * LatencyBuckets::COUNT + b].load(memory_order_relaxed);
+                merged[b] += n;
+                result.samples += n;
+            }
+        }
+        if (result.samples == 0) {
+            return result;
+        }
+        uint64_t max_seen = max_ns.load(memory_order_relaxed);
+        auto percentile = [&](double q) {
+            uint64_t rank = max<uint64_t>(static_cast<uint64_t>(ceil(q * result.samples)), 1);
+            uint64_t seen = 0;
+            for (size_t b = 0; b < merged.size(); ++b) {
+                seen += merged[b];
+                if (seen >= rank) {
+                    return min(LatencyBuckets::bucket_top(b), max_seen) / 1000.0;
+                }
+            }
+            return max_seen / 1000.0;
+        };
+        result.mean_us = sum_ns.value() / 1000.0 / result.samples;
+        result.p50_us = percentile(0.5);
+        result.p99_us = percentile(0.99);
+        result.p999_us = percentile(0.999);
+        result.max_us = max_seen / 1000.0;
+        return result;
+    }
+};
+
+// Decides which operations get timed: every SAMPLE_EVERY-th on each thread, so the
+// untimed majority pays one thread-local increment instead of reading the clock.
+class LatencySampler {
+public:
+    static const unsigned SAMPLE_EVERY = 16;
+
+    static bool sample() {
+        static thread_local unsigned counter = 0;
+        return ++counter % SAMPLE_EVERY == 0;
+    }
+};
+
+// Counters for the worker pool (see ThreadPool): how long tasks sat in a queue, how
+// long they ran, and the deepest the queues have been.
+class PoolMetrics {
+public:
+    ShardedCounter tasks;
+    ShardedCounter busy_ns;
+    ShardedHistogram queue_wait;
+    ShardedHistogram run_time;
+    atomic<size_t> peak_depth{0};
+
+    void observe_depth(size_t depth) {
+        size_t seen = peak_depth.load(memory_order_relaxed);
+        while (depth > seen && !peak_depth.compare_exchange_weak(seen, depth, memory_order_relaxed)) {
+        }
+    }
+};
+
+#endif
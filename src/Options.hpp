@@ -0,0 +1,80 @@
+#ifndef OPTIONS_HPP
+#define OPTIONS_HPP
+
+#include "MemFS.hpp"
+#include <cstddef>
+#include <exception>
+#include <string>
+
+using namespace std;
+
+// Usage text for the flags parse_options knows, for the programs' usage lines.
+inline const char *options_usage() {
+    return "[--shards <n>] [--max-file-size <bytes>] [--memory-limit <bytes>] [--load <image>] [--wal <file>]"
+           " [--wal-mode sync|batched|async] [--metrics on|off] [--cold-after <seconds>]";
+}
+
+// Reads a flag's value as a count; false if it is not a number.
+inline bool parse_count(const string &text, size_t &value) {
+    try {
+        value = stoull(text);
+    } catch (const exception &) {
+        return false;
+    }
+    return true;
+}
+
+// Parses the flags shared by the programs built on MemFS into `options`, and the
+// image named by --load into `image`. Every flag takes a value. A flag it does not
+// know is handed to extra(flag, value), which returns false if it does not know it
+// either. False on a flag without a value, an unknown flag or a bad value.
+template <typename Extra>
+bool parse_options(int argc, char *argv[], MemFSOptions &options, string &image, Extra extra) {
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        string value = argv[++i];
+        size_t count = 0;
+        if (flag == "--load") {
+            image = value;
+        } else if (flag == "--wal") {
+            options.log_path = value;
+        } else if (flag == "--wal-mode") {
+            if (value == "sync") {
+                options.log_mode = LogMode::SYNC;
+            } else if (value == "batched") {
+                options.log_mode = LogMode::BATCHED;
+            } else if (value == "async") {
+                options.log_mode = LogMode::ASYNC;
+            } else {
+                return false;
+            }
+        } else if (flag == "--metrics") {
+            if (value != "on" && value != "off") {
+                return false;
+            }
+            options.metrics = value == "on";
+        } else if (flag == "--shards" || flag == "--max-file-size" || flag == "--memory-limit" ||
+                   flag == "--cold-after") {
+            if (!parse_count(value, count)) {
+                return false;
+            }
+            if (flag == "--shards") {
+                options.shard_count = count;
+            } else if (flag == "--max-file-size") {
+                options.max_file_size = count;
+            } else if (flag == "--memory-limit") {
+                options.memory_limit = count;
+            } else {
+                options.cold_after = count;
+            }
+        } else if (!extra(flag, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
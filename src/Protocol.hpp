@@ -0,0 +1,139 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include "ChangeFeed.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+// Binary framing spoken over the server's Unix domain socket (see MemFSServer and
+// MemFSClient). Both ends run on the same machine, so integers are in native byte
+// order. A client may pipeline any number of requests; responses come back in the
+// order the requests were sent on that connection.
+//
+//   request:  u32 body size | u8 op | u8 0 | u16 name size | name | content
+//   response: u32 body size | u8 status | 3 x u8 0 | content (reads only)
+//
+// The body size counts what follows the 8-byte header. Content is only sent with a
+// write request, where it is the data, and with a copy or rename, where it is the
+// target name; it is only returned for a read that succeeded. A file too large for a
+// response body (MAX_RESPONSE) is not read but answered with TOO_LARGE.
+//
+// A watch request's name is a prefix, possibly empty, rather than a path. After its
+// OK response the connection carries only the changes of files under the prefix (see
+// MemFS::watch), each as a response with status OK and the content
+//
+//   event:    u64 sequence | u64 size | u64 dropped | u8 kind | name
+//
+// where `dropped` counts the events lost since the previous one because the client
+// fell behind. The client sends nothing more; closing the connection ends the watch.
+enum class RequestOp : uint8_t {
+    CREATE = 1,
+    WRITE = 2,
+    READ = 3,
+    DELETE = 4,
+    MKDIR = 5,
+    COPY = 6,
+    RENAME = 7,
+    WATCH = 8
+};
+
+// The FileStatus values, in order, then the protocol's own failures.
+enum class ResponseStatus : uint8_t {
+    OK = 0,
+    ALREADY_EXISTS = 1,
+    NOT_FOUND = 2,
+    SIZE_LIMIT_EXCEEDED = 3,
+    MEMORY_LIMIT_EXCEEDED = 4,
+    NO_SUCH_DIRECTORY = 5,
+    BAD_DESCRIPTOR = 6,
+    CONFLICT = 7,
+    LOG_FAILED = 8,
+    // A read of a file larger than a response may carry; the connection stays usable.
+    TOO_LARGE = 253,
+    // Unknown op or malformed name; the connection stays usable.
+    BAD_REQUEST = 254,
+    // Never sent: MemFSClient's result when the connection is lost.
+    DISCONNECTED = 255
+};
+
+class Protocol {
+public:
+    static const size_t HEADER_BYTES = 8;
+    // Frames with a larger body are a protocol error and close the connection.
+    static const size_t MAX_BODY = 1 << 20;
+    // Largest response body, what the header's size field holds.
+    static const size_t MAX_RESPONSE = UINT32_MAX;
+
+    template <typename T>
+    static void put(string &out, T value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static T get(const char *in) {
+        T value;
+        memcpy(&value, in, sizeof(value));
+        return value;
+    }
+
+    static void append_request(string &out, RequestOp op, const string &name, const string &content) {
+        put<uint32_t>(out, static_cast<uint32_t>(name.size() + content.size()));
+        out.push_back(static_cast<char>(op));
+        out.push_back(0);
+        put<uint16_t>(out, static_cast<uint16_t>(name.size()));
+        out.append(name);
+        out.append(content);
+    }
+
+    // `content_size` is at most MAX_RESPONSE.
+    static void append_response_header(string &out, ResponseStatus status, size_t content_size) {
+        put<uint32_t>(out, static_cast<uint32_t>(content_size));
+        out.push_back(static_cast<char>(status));
+        out.append(3, '\0');
+    }
+
+    static const size_t EVENT_BYTES = 3 * sizeof(uint64_t) + 1;
+
+    static void append_event(string &out, const ChangeEvent &event, uint64_t dropped) {
+        append_response_header(out, ResponseStatus::OK, EVENT_BYTES + event.filename.size());
+        put<uint64_t>(out, event.sequence);
+        put<uint64_t>(out, event.size);
+        put<uint64_t>(out, dropped);
+        out.push_back(static_cast<char>(event.kind));
+        out.append(event.filename);
+    }
+
+    // False if `content` is too short to be an event.
+    static bool parse_event(const string &content, ChangeEvent &event, uint64_t &dropped) {
+        if (content.size() < EVENT_BYTES) {
+            return false;
+        }
+        event.sequence = get<uint64_t>(content.data());
+        event.size = get<uint64_t>(content.data() + 8);
+        dropped = get<uint64_t>(content.data() + 16);
+        event.kind = static_cast<ChangeKind>(content[24]);
+        event.filename.assign(content, EVENT_BYTES, string::npos);
+        return true;
+    }
+
+    // Names the server accepts: non-empty components separated by single slashes.
+    // The command line is stricter (see CommandInterpreter); this only keeps the
+    // directory tree well formed.
+    static bool valid_path(const char *name, size_t size) {
+        if (size == 0 || name[0] == '/' || name[size - 1] == '/') {
+            return false;
+        }
+        for (size_t i = 1; i < size; ++i) {
+            if (name[i] == '/' && name[i - 1] == '/') {
+                return false;
+            }
+        }
+        return memchr(name, '\0', size) == nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef RWLOCK_HPP
+#define RWLOCK_HPP
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <linux/futex.h>
+#include <mutex>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// Writer-preferring reader/writer lock. Most sections guarded by it are a handful of
+// pointer operations, so a waiter spins, then yields. Some hold it far longer: a chunk
+// of expiries, saving or loading a snapshot, a transaction commit, a watch change. So
+// a waiter still blocked after PARK_LIMIT rounds sets PARKED and sleeps on the state
+// word (a futex), and an unlock that finds PARKED set wakes the sleepers.
+class RWLock {
+private:
+    static const uint32_t WRITER = 1u << 31;
+    static const uint32_t WRITER_WAITING = 1u << 30;
+    static const uint32_t PARKED = 1u << 29;
+    static const uint32_t READERS = PARKED - 1;
+    static const unsigned SPIN_LIMIT = 64;
+    static const unsigned PARK_LIMIT = SPIN_LIMIT + 64;
+
+    atomic<uint32_t> state{0};
+
+    // Waits a little for a lock that was busy in state `s`.
+    void backoff(unsigned spins, uint32_t s) {
+        if (spins < SPIN_LIMIT) {
+            return;
+        }
+        if (spins < PARK_LIMIT) {
+            this_thread::yield();
+            return;
+        }
+        // If the lock changed since s was read, the caller just looks again.
+        if (!(s & PARKED) && !state.compare_exchange_weak(s, s | PARKED, memory_order_relaxed)) {
+            return;
+        }
+        // Returns at once if the state is no longer s | PARKED.
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAIT_PRIVATE, s | PARKED, nullptr, nullptr,
+                0);
+    }
+
+    void wake() {
+        state.fetch_and(~PARKED, memory_order_relaxed);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+public:
+    RWLock() = default;
+    RWLock(const RWLock &) = delete;
+    RWLock &operator=(const RWLock &) = delete;
+
+    void lock_shared() {
+        for (unsigned spins = 0;; ++spins) {
+            uint32_t s = state.load(memory_order_relaxed);
+            if (!(s & (WRITER | WRITER_WAITING))) {
+                if (state.compare_exchange_weak(s, s + 1, memory_order_acquire, memory_order_relaxed)) {
+                    return;
+                }
+                continue;
+            }
+            backoff(spins, s);
+        }
+    }
+
+    bool try_lock_shared() {
+        uint32_t s = state.load(memory_order_relaxed);
+        return !(s & (WRITER | WRITER_WAITING)) &&
+               state.compare_exchange_strong(s, s + 1, memory_order_acquire, memory_order_relaxed);
+    }
+
+    // Only a writer can be waiting for the last reader to leave.
+    void unlock_shared() {
+        uint32_t s = state.fetch_sub(1, memory_order_release);
+        if ((s & PARKED) && ((s - 1) & READERS) == 0) {
+            wake();
+        }
+    }
+
+    void lock() {
+        for (unsigned spins = 0;; ++spins) {
+            uint32_t s = state.load(memory_order_relaxed);
+            if ((s & (WRITER | READERS)) == 0) {
+                if (state.compare_exchange_weak(s, WRITER | (s & PARKED), memory_order_acquire,
+                                                memory_order_relaxed)) {
+                    return;
+                }
+                continue;
+            }
+            if (!(s & WRITER_WAITING)) {
+                s = state.fetch_or(WRITER_WAITING, memory_order_relaxed) | WRITER_WAITING;
+            }
+            backoff(spins, s);
+        }
+    }
+
+    bool try_lock() {
+        uint32_t s = state.load(memory_order_relaxed);
+        return (s & (WRITER | READERS)) == 0 &&
+               state.compare_exchange_strong(s, WRITER | (s & PARKED), memory_order_acquire, memory_order_relaxed);
+    }
+
+    void unlock() {
+        if (state.fetch_and(~WRITER, memory_order_release) & PARKED) {
+            wake();
+        }
+    }
+};
+
+// Movable RAII guard for the shared side of an RWLock (C++11 has no shared_lock).
+// Like unique_lock, it can be constructed with defer_lock and locked later.
+class SharedLock {
+private:
+    RWLock *rwlock;
+    bool owns;
+
+public:
+    explicit SharedLock(RWLock &rwlock) : rwlock(&rwlock), owns(true) {
+        rwlock.lock_shared();
+    }
+    SharedLock(RWLock &rwlock, defer_lock_t) : rwlock(&rwlock), owns(false) {}
+    SharedLock(SharedLock &&other) : rwlock(other.rwlock), owns(other.owns) {
+        other.rwlock = nullptr;
+        other.owns = false;
+    }
+    SharedLock(const SharedLock &) = delete;
+    SharedLock &operator=(const SharedLock &) = delete;
+
+    ~SharedLock() {
+        if (owns) {
+            rwlock->unlock_shared();
+        }
+    }
+
+    void lock() {
+        rwlock->lock_shared();
+        owns = true;
+    }
+
+    bool try_lock() {
+        owns = rwlock->try_lock_shared();
+        return owns;
+    }
+
+    void unlock() {
+        rwlock->unlock_shared();
+        owns = false;
+    }
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef SCATTERWRITER_HPP
+#define SCATTERWRITER_HPP
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Gathers many output fragments as iovecs and emits them with writev, so a burst of
+// reads goes out in a few syscalls straight from the file blocks, with no copying into
+// an intermediate buffer. Fragments must stay alive until flush(): text added with
+// add_text is owned by the writer, everything else is the caller's to pin.
+class ScatterWriter {
+private:
+    int fd;
+    vector<iovec> pieces;
+    deque<string> owned;
+
+public:
+    explicit ScatterWriter(int fd) : fd(fd) {}
+
+    ScatterWriter(const ScatterWriter &) = delete;
+    ScatterWriter &operator=(const ScatterWriter &) = delete;
+
+    ~ScatterWriter() {
+        flush();
+    }
+
+    void add(const char *data, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        iovec piece;
+        piece.iov_base = const_cast<char *>(data);
+        piece.iov_len = len;
+        pieces.push_back(piece);
+    }
+
+    void add_text(string text) {
+        owned.push_back(move(text));
+        add(owned.back().data(), owned.back().size());
+    }
+
+    void newline() {
+        static const char NEWLINE = '\n';
+        add(&NEWLINE, 1);
+    }
+
+    // Fragments queued since the last flush.
+    size_t pending() const {
+        return pieces.size();
+    }
+
+    // Returns false if the descriptor reported an error; whatever was queued is dropped.
+    bool flush() {
+        bool ok = true;
+        size_t next = 0;
+        while (next < pieces.size()) {
+            int count = static_cast<int>(min(pieces.size() - next, static_cast<size_t>(IOV_MAX)));
+            ssize_t written = ::writev(fd, &pieces[next], count);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = false;
+                break;
+            }
+            size_t left = static_cast<size_t>(written);
+            while (next < pieces.size() && left >= pieces[next].iov_len) {
+                left -= pieces[next].iov_len;
+                ++next;
+            }
+            if (left > 0) {
+                pieces[next].iov_base = static_cast<char *>(pieces[next].iov_base) + left;
+                pieces[next].iov_len -= left;
+            }
+        }
+        pieces.clear();
+        owned.clear();
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef SEARCH_HPP
+#define SEARCH_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SEARCH_HAVE_AVX2 1
+#endif
+
+using namespace std;
+
+// Vector widths the substring kernel can run at. AVX2 is picked at run time, when the
+// CPU has it; SSE2 whenever the build targets it (always on x86-64).
+enum class SearchKernel {
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+// Finds every occurrence of a fixed pattern in a buffer. The vector kernels compare a
+// whole register of candidate start positions at once against the pattern's first
+// byte, and the same positions shifted by the pattern length against its last byte;
+// only positions where both match are checked in full. On text the two bytes rarely
+// match together, so the scan runs close to the speed of loading the data. A
+// one-byte pattern goes through memchr, which libc vectorizes already.
+class SubstringSearch {
+private:
+    typedef size_t (*Finder)(const char *data, size_t size, const char *pattern, size_t length, size_t from);
+
+    string pattern;
+    SearchKernel kernel_used;
+    Finder finder;
+
+    // First occurrence starting at or after `from`, or size if none; the pattern is at
+    // least two bytes.
+    static size_t find_scalar(const char *data, size_t size, const char *pattern, size_t length, size_t from) {
+        while (from + length <= size) {
+            const void *hit = memchr(data + from, pattern[0], size - length + 1 - from);
+            if (!hit) {
+                break;
+            }
+            size_t at = static_cast<const char *>(hit) - data;
+            if (data[at + length - 1] == pattern[length - 1] && memcmp(data + at + 1, pattern + 1, length - 2) == 0) {
+                return at;
+            }
+            from = at + 1;
+        }
+        return size;
+    }
+
+#ifdef __SSE2__
+    static size_t find_sse2(const char *data, size_t size, const char *pattern, size_t length, size_t from) {
+        const __m128i first = _mm_set1_epi8(pattern[0]);
+        const __m128i last = _mm_set1_epi8(pattern[length - 1]);
+        for (; from + length - 1 + 16 <= size; from += 16) {
+            __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + from));
+            __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + from + length - 1));
+            unsigned mask = static_cast<unsigned>(
+                _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+            while (mask != 0) {
+                size_t at = from + __builtin_ctz(mask);
+                if (memcmp(data + at + 1, pattern + 1, length - 2) == 0) {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+        }
+        // The starts left over are covered by one more register ending at the last
+        // start, its positions before `from` masked off, rather than byte by byte.
+        if (from + length - 1 < size && size >= length - 1 + 16) {
+            size_t last_from = size - length + 1 - 16;
+            __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + last_from));
+            __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + last_from + length - 1));
+            unsigned mask = static_cast<unsigned>(
+                _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+            mask &= ~0u << (from - last_from);
+            while (mask != 0) {
+                size_t at = last_from + __builtin_ctz(mask);
+                if (memcmp(data + at + 1, pattern + 1, length - 2) == 0) {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+            return size;
+        }
+        return find_scalar(data, size, pattern, length, from);
+    }
+#endif
+
+#ifdef SEARCH_HAVE_AVX2
+    __attribute__((target("avx2"))) static size_t find_avx2(const char *data, size_t size, const char *pattern,
+                                                            size_t length, size_t from) {
+        const __m256i first = _mm256_set1_epi8(pattern[0]);
+        const __m256i last = _mm256_set1_epi8(pattern[length - 1]);
+        for (; from + length - 1 + 32 <= size; from += 32) {
+            __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + from));
+            __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + from + length - 1));
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last))));
+            while (mask != 0) {
+                size_t at = from + __builtin_ctz(mask);
+                if (memcmp(data + at + 1, pattern + 1, length - 2) == 0) {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+        }
+        if (from + length - 1 < size && size >= length - 1 + 32) {
+            size_t last_from = size - length + 1 - 32;
+            __m256i head = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + last_from));
+            __m256i tail = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + last_from + length - 1));
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last))));
+            mask &= ~0u << (from - last_from);
+            while (mask != 0) {
+                size_t at = last_from + __builtin_ctz(mask);
+                if (memcmp(data + at + 1, pattern + 1, length - 2) == 0) {
+                    return at;
+                }
+                mask &= mask - 1;
+            }
+            return size;
+        }
+        return find_scalar(data, size, pattern, length, from);
+    }
+#endif
+
+    static size_t find_byte(const char *data, size_t size, const char *pattern, size_t, size_t from) {
+        const void *hit = from < size ? memchr(data + from, pattern[0], size - from) : nullptr;
+        return hit ? static_cast<size_t>(static_cast<const char *>(hit) - data) : size;
+    }
+
+public:
+    // The fastest kernel this CPU runs.
+    static SearchKernel best_kernel() {
+#ifdef SEARCH_HAVE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return SearchKernel::AVX2;
+        }
+#endif
+#ifdef __SSE2__
+        return SearchKernel::SSE2;
+#else
+        return SearchKernel::SCALAR;
+#endif
+    }
+
+    static const char *kernel_name(SearchKernel kernel) {
+        static const char *const NAMES[] = {"scalar", "sse2", "avx2"};
+        return NAMES[static_cast<size_t>(kernel)];
+    }
+
+    // `kernel` is lowered to the best one available if this CPU or build lacks it.
+    explicit SubstringSearch(const string &pattern, SearchKernel kernel = best_kernel())
+        : pattern(pattern), kernel_used(SearchKernel::SCALAR), finder(find_scalar) {
+        if (kernel > best_kernel()) {
+            kernel = best_kernel();
+        }
+#ifdef __SSE2__
+        if (kernel == SearchKernel::SSE2) {
+            kernel_used = kernel;
+            finder = find_sse2;
+        }
+#endif
+#ifdef SEARCH_HAVE_AVX2
+        if (kernel == SearchKernel::AVX2) {
+            kernel_used = kernel;
+            finder = find_avx2;
+        }
+#endif
+        if (pattern.size() == 1) {
+            finder = find_byte;
+        }
+    }
+
+    size_t size() const {
+        return pattern.size();
+    }
+
+    SearchKernel kernel() const {
+        return kernel_used;
+    }
+
+    // Whether the pattern occurs where `head` (its first head_size bytes, fewer than
+    // size()) is followed by `rest`, which must hold the remaining bytes.
+    bool occurs_across(const char *head, size_t head_size, const char *rest) const {
+        return head[0] == pattern[0] && memcmp(head, pattern.data(), head_size) == 0 &&
+               memcmp(rest, pattern.data() + head_size, pattern.size() - head_size) == 0;
+    }
+
+    // Calls f(offset) for every occurrence inside data[0, size), in order; occurrences
+    // may overlap. An empty pattern matches nothing.
+    template <typename F>
+    void scan(const char *data, size_t size, F f) const {
+        size_t length = pattern.size();
+        if (length == 0) {
+            return;
+        }
+        for (size_t at = 0; at + length <= size; ++at) {
+            at = finder(data, size, pattern.data(), length, at);
+            if (at == size) {
+                break;
+            }
+            f(at);
+        }
+    }
+};
+
+// Runs a SubstringSearch over content that arrives in segments, such as a file's
+// blocks, reporting offsets from the start of the content and the occurrences that
+// span segments too. Every segment is scanned where it is; only its last
+// pattern-length - 1 bytes are copied aside, to check the starts among them against
+// the segment that follows.
+class SegmentSearch {
+private:
+    const SubstringSearch &search;
+    // The last overlap() bytes fed, or all of them while fewer have been: an
+    // occurrence starting in them needs bytes from the segments still to come.
+    vector<char> carry;
+    size_t carried = 0;
+    size_t fed = 0;
+
+    // Bytes past a position an occurrence starting there may need.
+    size_t overlap() const {
+        return search.size() > 0 ? search.size() - 1 : 0;
+    }
+
+public:
+    explicit SegmentSearch(const SubstringSearch &search) : search(search), carry(overlap()) {}
+
+    // Starts over on new content.
+    void reset() {
+        carried = 0;
+        fed = 0;
+    }
+
+    // Calls f(offset) for every occurrence that this segment completes, in order.
+    template <typename F>
+    void feed(const char *data, size_t size, F f) {
+        size_t keep = carry.size();
+        // Occurrences starting in the carry and ending in this segment. There are
+        // fewer such starts than the pattern has bytes, so each is checked directly;
+        // one that needs more than this segment stays in the carry.
+        for (size_t at = 0; at < carried && carried - at + size >= search.size(); ++at) {
+            if (search.occurs_across(&carry[at], carried - at, data)) {
+                f(fed - carried + at);
+            }
+        }
+        size_t base = fed;
+        search.scan(data, size, [&](size_t at) { f(base + at); });
+        fed += size;
+        if (keep == 0) {
+            return;
+        }
+        if (size >= keep) {
+            memcpy(carry.data(), data + size - keep, keep);
+            carried = keep;
+            return;
+        }
+        size_t kept = min(carried, keep - size);
+        memmove(carry.data(), carry.data() + carried - kept, kept);
+        memcpy(carry.data() + kept, data, size);
+        carried = kept + size;
+    }
+};
+
+#endif
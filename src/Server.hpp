@@ -0,0 +1,569 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "MemFS.hpp"
+#include "Protocol.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+class ServerOptions {
+public:
+    string socket_path = "/tmp/memfs.sock";
+    // Event loop threads. Each accepts connections and serves the ones it accepted.
+    size_t loops = 2;
+    // Largest file a read returns; a larger one is answered with TOO_LARGE. Capped at
+    // Protocol::MAX_RESPONSE, which is what a response can carry.
+    size_t max_read = Protocol::MAX_RESPONSE;
+};
+
+class ServerStatus {
+public:
+    bool ok = false;
+    string error;
+};
+
+// Serves one MemFS to many local clients over a Unix domain socket, using the
+// framing in Protocol.hpp.
+//
+// Every event loop owns an epoll set holding the listening socket (registered with
+// EPOLLEXCLUSIVE, so a new connection wakes one loop) and its own connections
+// (edge-triggered). A loop works in rounds. It reads whatever its ready connections
+// have sent, then serves the queued requests of all of them together:
+// - Reads, mkdirs, copies and renames are served on the loop itself. A read pins a
+//   version and copies it out, which costs less than handing it to another thread.
+// - Creates, writes and deletes from every connection go into one submit_ops batch on
+//   the MemFS worker pool, so a round of many small requests costs one dispatch and
+//   takes each shard lock once per chunk.
+// Responses must follow a connection's request order. So in one round a connection
+// contributes its inline requests first, then its mutations, and stops at the first
+// inline request that comes after a mutation; the rest wait for the next round.
+//
+// A watch request turns its connection into an event stream. The connection's
+// watcher signals an eventfd that sits in the loop's epoll set under the connection's
+// tag, so a change wakes the loop like input would, and each round moves the queued
+// events into the connection's output.
+//
+// Backpressure: a connection is not read while MAX_QUEUED_REQUESTS of its requests,
+// or MAX_QUEUED_INPUT bytes of requests and unparsed input, are waiting, and is not
+// served while MAX_PENDING_OUTPUT bytes of its responses are still unsent.
+class MemFSServer {
+private:
+    static const size_t READ_CHUNK = 64 * 1024;
+    static const size_t MAX_QUEUED_REQUESTS = 4096;
+    // Room for a few frames of the largest size (Protocol::MAX_BODY).
+    static const size_t MAX_QUEUED_INPUT = 4 << 20;
+    static const size_t MAX_PENDING_OUTPUT = 4 << 20;
+    // Requests one connection may have served per round, so it cannot starve the others.
+    static const size_t ROUND_REQUESTS = 512;
+    // Events taken from a watcher at a time, while its connection has room for output.
+    static const size_t ROUND_EVENTS = 1024;
+    static const int MAX_EVENTS = 256;
+
+    class Request {
+    public:
+        RequestOp op;
+        string name;
+        string content;
+    };
+
+    class Connection {
+    public:
+        int fd;
+        string in;
+        size_t in_start = 0;
+        deque<Request> requests;
+        // Name and content bytes of the queued requests.
+        size_t queued_bytes = 0;
+        string out;
+        size_t out_start = 0;
+        // Edge-triggered readiness not yet used up.
+        bool readable = true;
+        bool writable = true;
+        bool eof = false;
+        bool broken = false;
+        bool scheduled = false;
+        // This connection's mutations in the current round's batch.
+        size_t batch_begin = 0;
+        size_t batch_end = 0;
+        // Set by a watch request, with the eventfd it signals and the drops not yet
+        // reported to the client.
+        shared_ptr<Watcher> watcher;
+        int watch_fd = -1;
+        uint64_t dropped = 0;
+
+        explicit Connection(int fd) : fd(fd) {}
+
+        size_t pending_output() const {
+            return out.size() - out_start;
+        }
+
+        // Whether there is room to read more input.
+        bool accepting() const {
+            return requests.size() < MAX_QUEUED_REQUESTS && queued_bytes + in.size() - in_start < MAX_QUEUED_INPUT;
+        }
+
+        bool has_work() const {
+            return !broken && pending_output() < MAX_PENDING_OUTPUT && ((readable && accepting()) || !requests.empty() ||
+                    (watcher && !watcher->empty()));
+        }
+    };
+
+    class EventLoop {
+    public:
+        int epoll_fd = -1;
+        thread worker;
+        map<int, unique_ptr<Connection>> connections;
+        // Connections with buffered readiness or queued requests; the loop polls
+        // without blocking while there are any.
+        vector<Connection *> active;
+        vector<char> scratch;
+        vector<ChangeEvent> events;
+    };
+
+    MemFS &fs;
+    ServerOptions options;
+    int listen_fd = -1;
+    // Level-triggered and never drained once signalled, so every loop wakes to stop.
+    int stop_fd = -1;
+    atomic<bool> stopping{false};
+    vector<unique_ptr<EventLoop>> loops;
+
+    static ServerStatus failure(const string &what) {
+        ServerStatus status;
+        status.error = what + ": " + strerror(errno);
+        return status;
+    }
+
+    static bool batched(RequestOp op) {
+        return op == RequestOp::CREATE || op == RequestOp::WRITE || op == RequestOp::DELETE;
+    }
+
+    static OpType op_type(RequestOp op) {
+        return op == RequestOp::CREATE ? OpType::CREATE : op == RequestOp::WRITE ? OpType::WRITE : OpType::DELETE;
+    }
+
+    static ResponseStatus response_status(FileStatus status) {
+        return static_cast<ResponseStatus>(static_cast<uint8_t>(status));
+    }
+
+    static void schedule(EventLoop &loop, Connection *conn) {
+        if (!conn->scheduled) {
+            conn->scheduled = true;
+            loop.active.push_back(conn);
+        }
+    }
+
+    // Takes one connection per wake-up and leaves the rest ready for the other loops.
+    void accept_one(EventLoop &loop) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        unique_ptr<Connection> conn(new Connection(fd));
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn.get();
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            ::close(fd);
+            return;
+        }
+        schedule(loop, conn.get());
+        loop.connections[fd] = move(conn);
+    }
+
+    void stop_watch(EventLoop &loop, Connection &conn) {
+        if (conn.watcher) {
+            fs.unwatch(conn.watcher);
+            conn.watcher.reset();
+            epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, conn.watch_fd, nullptr);
+            ::close(conn.watch_fd);
+            conn.watch_fd = -1;
+        }
+    }
+
+    void close_connection(EventLoop &loop, Connection *conn) {
+        int fd = conn->fd;
+        stop_watch(loop, *conn);
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        loop.connections.erase(fd);
+    }
+
+    // Splits the buffered input into requests. A frame too large to be valid breaks
+    // the connection, since the stream can no longer be resynchronised.
+    static void parse(Connection &conn) {
+        while (conn.in.size() - conn.in_start >= Protocol::HEADER_BYTES) {
+            const char *frame = &conn.in[conn.in_start];
+            uint32_t body = Protocol::get<uint32_t>(frame);
+            uint16_t name_size = Protocol::get<uint16_t>(frame + 6);
+            if (body > Protocol::MAX_BODY || name_size > body) {
+                conn.broken = true;
+                return;
+            }
+            if (conn.in.size() - conn.in_start < Protocol::HEADER_BYTES + body) {
+                break;
+            }
+            Request request;
+            request.op = static_cast<RequestOp>(frame[4]);
+            request.name.assign(frame + Protocol::HEADER_BYTES, name_size);
+            request.content.assign(frame + Protocol::HEADER_BYTES + name_size, body - name_size);
+            conn.requests.push_back(move(request));
+            conn.queued_bytes += body;
+            conn.in_start += Protocol::HEADER_BYTES + body;
+        }
+        if (conn.in_start == conn.in.size()) {
+            conn.in.clear();
+            conn.in_start = 0;
+        } else if (conn.in_start > READ_CHUNK) {
+            conn.in.erase(0, conn.in_start);
+            conn.in_start = 0;
+        }
+    }
+
+    static void receive(EventLoop &loop, Connection &conn) {
+        while (conn.readable && !conn.broken && conn.accepting()) {
+            ssize_t got = ::read(conn.fd, loop.scratch.data(), loop.scratch.size());
+            if (got > 0) {
+                conn.in.append(loop.scratch.data(), static_cast<size_t>(got));
+                parse(conn);
+            } else if (got == 0) {
+                conn.eof = true;
+                conn.readable = false;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn.readable = false;
+            } else if (errno != EINTR) {
+                conn.broken = true;
+            }
+        }
+    }
+
+    static void send(Connection &conn) {
+        while (conn.writable && conn.out_start < conn.out.size()) {
+            ssize_t sent = ::send(conn.fd, conn.out.data() + conn.out_start, conn.out.size() - conn.out_start, MSG_NOSIGNAL);
+            if (sent > 0) {
+                conn.out_start += static_cast<size_t>(sent);
+            } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                conn.writable = false;
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else {
+                conn.broken = true;
+                return;
+            }
+        }
+        if (conn.out_start == conn.out.size()) {
+            conn.out.clear();
+            conn.out_start = 0;
+        }
+    }
+
+    // Subscribes the connection and answers OK, or breaks it if no eventfd can be had.
+    void start_watch(EventLoop &loop, Connection &conn, const string &prefix) {
+        int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &conn;
+        if (wake_fd < 0 || epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) < 0) {
+            if (wake_fd >= 0) {
+                ::close(wake_fd);
+            }
+            conn.broken = true;
+            return;
+        }
+        conn.watch_fd = wake_fd;
+        conn.watcher = fs.watch(prefix, MemFS::DEFAULT_WATCH_CAPACITY, wake_fd);
+        Protocol::append_response_header(conn.out, ResponseStatus::OK, 0);
+    }
+
+    // Moves queued events into the output, up to MAX_PENDING_OUTPUT; past that the
+    // watcher fills up and drops the newest, which the next event sent reports.
+    void send_events(Connection &conn, vector<ChangeEvent> &events) {
+        uint64_t count;
+        ssize_t ignored = ::read(conn.watch_fd, &count, sizeof(count));
+        (void)ignored;
+        while (conn.pending_output() < MAX_PENDING_OUTPUT) {
+            uint64_t lost = 0;
+            conn.watcher->poll(events, lost, ROUND_EVENTS);
+            conn.dropped += lost;
+            for (const auto &event : events) {
+                Protocol::append_event(conn.out, event, conn.dropped);
+                conn.dropped = 0;
+            }
+            if (events.size() < ROUND_EVENTS) {
+                break;
+            }
+        }
+    }
+
+    void serve_inline(EventLoop &loop, Connection &conn, const Request &request) {
+        if (request.op == RequestOp::WATCH && !conn.watcher) {
+            start_watch(loop, conn, request.name);
+            return;
+        }
+        if (!Protocol::valid_path(request.name.data(), request.name.size())) {
+            Protocol::append_response_header(conn.out, ResponseStatus::BAD_REQUEST, 0);
+            return;
+        }
+        if (request.op == RequestOp::READ) {
+            FileView view;
+            if (fs.read(request.name, view) != FileStatus::OK) {
+                Protocol::append_response_header(conn.out, ResponseStatus::NOT_FOUND, 0);
+                return;
+            }
+            if (view.size() > options.max_read) {
+                Protocol::append_response_header(conn.out, ResponseStatus::TOO_LARGE, 0);
+                return;
+            }
+            Protocol::append_response_header(conn.out, ResponseStatus::OK, view.size());
+            view.for_each_segment([&conn](const char *data, size_t len) { conn.out.append(data, len); });
+        } else if (request.op == RequestOp::MKDIR) {
+            Protocol::append_response_header(conn.out, response_status(fs.make_directory(request.name)), 0);
+        } else if ((request.op == RequestOp::COPY || request.op == RequestOp::RENAME) &&
+                   Protocol::valid_path(request.content.data(), request.content.size())) {
+            FileStatus status = request.op == RequestOp::COPY ? fs.copy_file(request.name, request.content)
+                                                               : fs.rename_file(request.name, request.content);
+            Protocol::append_response_header(conn.out, response_status(status), 0);
+        } else {
+            Protocol::append_response_header(conn.out, ResponseStatus::BAD_REQUEST, 0);
+        }
+    }
+
+    void run_round(EventLoop &loop, const vector<Connection *> &work) {
+        vector<OpType> ops;
+        vector<string> names;
+        vector<string> contents;
+        for (Connection *conn : work) {
+            conn->batch_begin = conn->batch_end = ops.size();
+            if (conn->broken || conn->pending_output() >= MAX_PENDING_OUTPUT) {
+                continue;
+            }
+            for (size_t taken = 0; !conn->requests.empty() && !conn->watcher && taken < ROUND_REQUESTS; ++taken) {
+                Request &request = conn->requests.front();
+                size_t bytes = request.name.size() + request.content.size();
+                if (batched(request.op) && Protocol::valid_path(request.name.data(), request.name.size())) {
+                    ops.push_back(op_type(request.op));
+                    names.push_back(move(request.name));
+                    contents.push_back(move(request.content));
+                } else if (ops.size() > conn->batch_begin) {
+                    break;
+                } else {
+                    serve_inline(loop, *conn, request);
+                }
+                conn->requests.pop_front();
+                conn->queued_bytes -= bytes;
+            }
+            if (conn->watcher) {
+                conn->requests.clear();
+                conn->queued_bytes = 0;
+            }
+            conn->batch_end = ops.size();
+        }
+        if (ops.empty()) {
+            return;
+        }
+        PendingBatch pending = fs.submit_ops(move(ops), move(names), move(contents));
+        vector<FileStatus> statuses = pending.results.get();
+        for (Connection *conn : work) {
+            for (size_t i = conn->batch_begin; i < conn->batch_end; ++i) {
+                Protocol::append_response_header(conn->out, response_status(statuses[i]), 0);
+            }
+        }
+    }
+
+    void serve(EventLoop &loop) {
+        vector<Connection *> work;
+        work.swap(loop.active);
+        for (Connection *conn : work) {
+            conn->scheduled = false;
+            send(*conn);
+            receive(loop, *conn);
+        }
+        run_round(loop, work);
+        for (Connection *conn : work) {
+            if (conn->watcher && !conn->broken) {
+                send_events(*conn, loop.events);
+            }
+            send(*conn);
+            if (conn->broken || (conn->eof && conn->requests.empty() && conn->pending_output() == 0)) {
+                close_connection(loop, conn);
+            } else if (conn->has_work()) {
+                schedule(loop, conn);
+            } else if (conn->watcher && conn->pending_output() < MAX_PENDING_OUTPUT && !conn->watcher->arm()) {
+                // An event came in after the check above; had it come after arm(), the
+                // eventfd would have been signalled.
+                schedule(loop, conn);
+            }
+        }
+    }
+
+    void run_loop(EventLoop &loop) {
+        epoll_event events[MAX_EVENTS];
+        while (!stopping.load()) {
+            int n = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, loop.active.empty() ? -1 : 0);
+            if (n < 0 && errno != EINTR) {
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                void *tag = events[i].data.ptr;
+                if (tag == &listen_fd) {
+                    accept_one(loop);
+                    continue;
+                }
+                if (tag == &stop_fd) {
+                    continue;
+                }
+                Connection *conn = static_cast<Connection *>(tag);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    conn->readable = true;
+                }
+                if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                    conn->writable = true;
+                }
+                schedule(loop, conn);
+            }
+            if (!stopping.load()) {
+                serve(loop);
+            }
+        }
+        for (auto &entry : loop.connections) {
+            stop_watch(loop, *entry.second);
+            ::close(entry.first);
+        }
+        loop.connections.clear();
+    }
+
+public:
+    MemFSServer(MemFS &fs, const ServerOptions &options) : fs(fs), options(options) {
+        if (this->options.max_read > Protocol::MAX_RESPONSE) {
+            this->options.max_read = Protocol::MAX_RESPONSE;
+        }
+    }
+
+    MemFSServer(const MemFSServer &) = delete;
+    MemFSServer &operator=(const MemFSServer &) = delete;
+
+    ~MemFSServer() {
+        stop();
+        wait();
+        for (auto &loop : loops) {
+            if (loop->epoll_fd >= 0) {
+                ::close(loop->epoll_fd);
+            }
+        }
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            ::unlink(options.socket_path.c_str());
+        }
+        if (stop_fd >= 0) {
+            ::close(stop_fd);
+        }
+    }
+
+    // Binds the socket (replacing a stale socket file left at the path, but nothing
+    // else) and starts the event loops.
+    ServerStatus start() {
+        ServerStatus status;
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (options.socket_path.empty() || options.socket_path.size() >= sizeof(address.sun_path)) {
+            status.error = "socket path must be 1 to " + to_string(sizeof(address.sun_path) - 1) + " characters";
+            return status;
+        }
+        memcpy(address.sun_path, options.socket_path.c_str(), options.socket_path.size());
+        struct stat existing;
+        if (lstat(options.socket_path.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                status.error = options.socket_path + " exists and is not a socket";
+                return status;
+            }
+            ::unlink(options.socket_path.c_str());
+        }
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            return failure("socket");
+        }
+        if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+            ServerStatus bind_failed = failure("bind " + options.socket_path);
+            ::close(listen_fd);
+            listen_fd = -1;
+            return bind_failed;
+        }
+        if (::listen(listen_fd, SOMAXCONN) < 0) {
+            return failure("listen");
+        }
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd < 0) {
+            return failure("eventfd");
+        }
+        size_t loop_count = options.loops == 0 ? 1 : options.loops;
+        for (size_t i = 0; i < loop_count; ++i) {
+            unique_ptr<EventLoop> loop(new EventLoop());
+            loop->scratch.resize(READ_CHUNK);
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (loop->epoll_fd < 0) {
+                return failure("epoll_create1");
+            }
+            epoll_event event;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.ptr = &listen_fd;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+                return failure("epoll_ctl");
+            }
+            event.events = EPOLLIN;
+            event.data.ptr = &stop_fd;
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) < 0) {
+                return failure("epoll_ctl");
+            }
+            loops.push_back(move(loop));
+        }
+        for (auto &loop : loops) {
+            EventLoop *target = loop.get();
+            loop->worker = thread([this, target]() { run_loop(*target); });
+        }
+        status.ok = true;
+        return status;
+    }
+
+    // Asks every loop to finish; open connections are closed without draining them.
+    // Only touches an atomic and writes an eventfd, so a signal handler may call it.
+    void stop() {
+        stopping.store(true);
+        if (stop_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = ::write(stop_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    // Blocks until every loop has stopped.
+    void wait() {
+        for (auto &loop : loops) {
+            if (loop->worker.joinable()) {
+                loop->worker.join();
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef SLABPOOL_HPP
+#define SLABPOOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// Fixed-size object pool. Objects are carved out of 64 KiB slabs and recycled through
+// a per-thread free list, so allocate/deallocate are O(1) pointer pops/pushes with no
+// lock in the common case. Threads spill half their cache to a shared list once it
+// grows past LOCAL_LIMIT and refill from it in batches. Slabs are kept for the life of
+// the process, so churn reuses memory instead of growing the heap.
+template <size_t SIZE>
+class SlabPool {
+private:
+    static_assert(SIZE >= sizeof(void *), "slab objects must fit a free-list pointer");
+
+    static const size_t SLAB_BYTES = 64 * 1024;
+    static const size_t LOCAL_LIMIT = 1024;
+    static const size_t REFILL_BATCH = 128;
+
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    struct Global {
+        mutex pool_mutex;
+        FreeNode *free_list = nullptr;
+        vector<char *> slabs;
+    };
+
+    struct Local {
+        FreeNode *free_list = nullptr;
+        size_t count = 0;
+
+        ~Local() {
+            if (free_list) {
+                give_back(*this, count);
+            }
+        }
+    };
+
+    static Global &global() {
+        static Global pool;
+        return pool;
+    }
+
+    static Local &local() {
+        static thread_local Local cache;
+        return cache;
+    }
+
+    static void give_back(Local &cache, size_t n) {
+        FreeNode *first = cache.free_list;
+        FreeNode *last = first;
+        for (size_t i = 1; i < n; ++i) {
+            last = last->next;
+        }
+        cache.free_list = last->next;
+        cache.count -= n;
+
+        Global &pool = global();
+        lock_guard<mutex> lock(pool.pool_mutex);
+        last->next = pool.free_list;
+        pool.free_list = first;
+    }
+
+    static void refill(Local &cache) {
+        Global &pool = global();
+        lock_guard<mutex> lock(pool.pool_mutex);
+        if (!pool.free_list) {
+            char *slab = static_cast<char *>(::operator new(SLAB_BYTES));
+            pool.slabs.push_back(slab);
+            for (size_t offset = 0; offset + SIZE <= SLAB_BYTES; offset += SIZE) {
+                FreeNode *node = reinterpret_cast<FreeNode *>(slab + offset);
+                node->next = pool.free_list;
+                pool.free_list = node;
+            }
+        }
+        for (size_t i = 0; i < REFILL_BATCH && pool.free_list; ++i) {
+            FreeNode *node = pool.free_list;
+            pool.free_list = node->next;
+            node->next = cache.free_list;
+            cache.free_list = node;
+            ++cache.count;
+        }
+    }
+
+public:
+    static void *allocate() {
+        Local &cache = local();
+        if (!cache.free_list) {
+            refill(cache);
+        }
+        FreeNode *node = cache.free_list;
+        cache.free_list = node->next;
+        --cache.count;
+        return node;
+    }
+
+    static void deallocate(void *ptr) {
+        Local &cache = local();
+        FreeNode *node = static_cast<FreeNode *>(ptr);
+        node->next = cache.free_list;
+        cache.free_list = node;
+        if (++cache.count > LOCAL_LIMIT) {
+            give_back(cache, LOCAL_LIMIT / 2);
+        }
+    }
+};
+
+// Storage for filenames too long to sit inline in a FileKey, drawn from size-classed
+// slab pools (anything past the largest class falls back to the heap).
+class NameArena {
+public:
+    static char *allocate(size_t len) {
+        if (len <= 32) {
+            return static_cast<char *>(SlabPool<32>::allocate());
+        } else if (len <= 64) {
+            return static_cast<char *>(SlabPool<64>::allocate());
+        } else if (len <= 128) {
+            return static_cast<char *>(SlabPool<128>::allocate());
+        }
+        return new char[len];
+    }
+
+    // Bytes actually set aside for a name of length len.
+    static size_t footprint(size_t len) {
+        if (len <= 32) {
+            return 32;
+        } else if (len <= 64) {
+            return 64;
+        } else if (len <= 128) {
+            return 128;
+        }
+        return len;
+    }
+
+    static void deallocate(char *ptr, size_t len) {
+        if (len <= 32) {
+            SlabPool<32>::deallocate(ptr);
+        } else if (len <= 64) {
+            SlabPool<64>::deallocate(ptr);
+        } else if (len <= 128) {
+            SlabPool<128>::deallocate(ptr);
+        } else {
+            delete[] ptr;
+        }
+    }
+};
+
+// Fixed-size unit of file content. Blocks are shared between successive versions of a
+// file and reference counted; `used` records how much of the block has been claimed,
+// which lets the writer holding the newest version append into the free tail instead
+// of copying (see FileVersion::append).
+class Block {
+public:
+    static const size_t SIZE = 256;
+    static const size_t CAPACITY = SIZE - 2 * sizeof(uint32_t);
+
+    atomic<uint32_t> refs;
+    atomic<uint32_t> used;
+    char data[CAPACITY];
+
+    static Block *create() {
+        return new (SlabPool<SIZE>::allocate()) Block();
+    }
+
+    void retain() {
+        refs.fetch_add(1, memory_order_relaxed);
+    }
+
+    void release() {
+        if (refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            this->~Block();
+            SlabPool<SIZE>::deallocate(this);
+        }
+    }
+
+private:
+    Block() : refs(1), used(0) {}
+};
+
+static_assert(sizeof(Block) == Block::SIZE, "Block must fill exactly one slab slot");
+
+#endif
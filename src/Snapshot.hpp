@@ -0,0 +1,177 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Snapshot image layout, in native byte order:
+//
+//   SnapshotHeader
+//   SnapshotEntry[file_count]
+//   every filename, back to back
+//   every file's content, back to back
+//
+// Offsets are from the start of the image, timestamps are nanoseconds since the epoch.
+// Content is stored flat so a restored file can point straight into the mapping.
+// log_position is how far into the write-ahead log the image is up to date (0 when
+// the log was off); replay on top of the image starts there. Directories are entries
+// too, flagged DIRECTORY and listed before every file, parents before children.
+// expires_at is a file's expiry deadline, 0 if it has none. Formats 2 and 3 still
+// load: format 2 images predate directories, and both predate expiry, with entries
+// that end before expires_at.
+class SnapshotHeader {
+public:
+    static const uint32_t FORMAT = 4;
+    static const uint32_t OLDEST_FORMAT = 2;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    uint64_t file_count;
+    uint64_t image_size;
+    uint64_t log_position;
+
+    static const char *expected_magic() {
+        return "MEMFSIMG";
+    }
+};
+
+class SnapshotEntry {
+public:
+    static const uint32_t DIRECTORY = 1;
+
+    uint64_t name_offset;
+    uint64_t content_offset;
+    uint64_t content_size;
+    int64_t created_at;
+    int64_t updated_at;
+    uint32_t name_size;
+    uint32_t flags;
+    int64_t expires_at;
+};
+
+static_assert(sizeof(SnapshotHeader) == 40, "snapshot header layout changed");
+static_assert(sizeof(SnapshotEntry) == 56, "snapshot entry layout changed");
+
+class SnapshotStatus {
+public:
+    bool ok = false;
+    size_t files = 0;
+    uint64_t log_position = 0;
+    string error;
+};
+
+// Read-only private mapping of a snapshot image. Restored files keep it alive through
+// their FileVersions for as long as any of them still points into it.
+class MappedImage {
+private:
+    const char *base;
+    size_t length;
+
+    MappedImage(const char *base, size_t length) : base(base), length(length) {}
+
+    bool within(uint64_t offset, uint64_t size) const {
+        return offset <= length && size <= length - offset;
+    }
+
+public:
+    MappedImage(const MappedImage &) = delete;
+    MappedImage &operator=(const MappedImage &) = delete;
+
+    ~MappedImage() {
+        munmap(const_cast<char *>(base), length);
+    }
+
+    static shared_ptr<const MappedImage> open(const string &path, string &error) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            error = "cannot stat " + path + ": " + strerror(errno);
+            close(fd);
+            return nullptr;
+        }
+        size_t length = static_cast<size_t>(info.st_size);
+        if (length < sizeof(SnapshotHeader)) {
+            error = path + " is not a snapshot image";
+            close(fd);
+            return nullptr;
+        }
+        void *base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            error = "cannot map " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        shared_ptr<MappedImage> image(new MappedImage(static_cast<const char *>(base), length));
+        if (!image->check(error)) {
+            error = path + ": " + error;
+            return nullptr;
+        }
+        return image;
+    }
+
+    const SnapshotHeader &header() const {
+        return *reinterpret_cast<const SnapshotHeader *>(base);
+    }
+
+    // Bytes per entry in this image.
+    size_t entry_size() const {
+        return header().format >= 4 ? sizeof(SnapshotEntry) : offsetof(SnapshotEntry, expires_at);
+    }
+
+    // Entry i, with the fields older formats lack set to 0.
+    SnapshotEntry entry(size_t i) const {
+        SnapshotEntry e = SnapshotEntry();
+        memcpy(&e, base + sizeof(SnapshotHeader) + i * entry_size(), entry_size());
+        return e;
+    }
+
+    const char *at(uint64_t offset) const {
+        return base + offset;
+    }
+
+    // Verifies the header and that every name and content range lies inside the
+    // image, so restoring never has to bounds-check again.
+    bool check(string &error) const {
+        const SnapshotHeader &h = header();
+        if (memcmp(h.magic, SnapshotHeader::expected_magic(), sizeof(h.magic)) != 0) {
+            error = "not a snapshot image";
+            return false;
+        }
+        if (h.byte_order != SnapshotHeader::BYTE_ORDER_MARK || h.format < SnapshotHeader::OLDEST_FORMAT ||
+            h.format > SnapshotHeader::FORMAT) {
+            error = "unsupported snapshot format";
+            return false;
+        }
+        if (h.image_size != length ||
+            h.file_count > (length - sizeof(SnapshotHeader)) / entry_size()) {
+            error = "truncated snapshot image";
+            return false;
+        }
+        for (size_t i = 0; i < h.file_count; ++i) {
+            SnapshotEntry e = entry(i);
+            if (e.name_size == 0 || !within(e.name_offset, e.name_size) || !within(e.content_offset, e.content_size)) {
+                error = "corrupt entry " + to_string(i);
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include "Metrics.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Completion latch for one batch split into a known number of parts. Each part fills
+// its own result slots and then arrives; whichever part arrives last fulfils the
+// promise, so a caller only ever waits for its own batch, never for unrelated work
+// sharing the pool.
+template <typename R>
+class BatchLatch {
+private:
+    vector<R> results;
+    atomic<size_t> remaining;
+    promise<vector<R>> done;
+
+public:
+    BatchLatch(size_t result_count, size_t parts) : results(result_count), remaining(parts) {
+        if (parts == 0) {
+            done.set_value(move(results));
+        }
+    }
+
+    future<vector<R>> get_future() {
+        return done.get_future();
+    }
+
+    R &operator[](size_t index) {
+        return results[index];
+    }
+
+    void arrive() {
+        if (--remaining == 0) {
+            done.set_value(move(results));
+        }
+    }
+};
+
+// Work-stealing pool: every worker owns a deque it pops from the back, and an idle
+// worker steals from the front of the others' deques. Submissions are spread over the
+// deques round-robin, so there is no single queue lock for all workers to fight over.
+// A worker that finds nothing spins for a while before parking, and submitters only
+// wake as many parked workers as they have tasks for. Given PoolMetrics, it counts
+// every task and times one in LatencySampler::SAMPLE_EVERY (queue wait and run time;
+// busy time is extrapolated from the sampled runs).
+class ThreadPool {
+private:
+    static const unsigned SPIN_ROUNDS = 128;
+
+    class Task {
+    public:
+        function<void()> run;
+        steady_clock::time_point queued;
+    };
+
+    class WorkerQueue {
+    public:
+        mutex queue_mutex;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> next_queue{0};
+    atomic<size_t> pending{0};
+    atomic<bool> shutdown{false};
+
+    mutex park_mutex;
+    condition_variable park_cv;
+    atomic<size_t> sleepers{0};
+    PoolMetrics *metrics;
+
+    bool pop_own(size_t index, Task &task) {
+        WorkerQueue &queue = *queues[index];
+        lock_guard<mutex> lock(queue.queue_mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t index, Task &task) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            WorkerQueue &victim = *queues[(index + k) % queues.size()];
+            lock_guard<mutex> lock(victim.queue_mutex);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool try_take(size_t index, Task &task) {
+        if (pending.load() == 0) {
+            return false;
+        }
+        if (pop_own(index, task) || steal(index, task)) {
+            --pending;
+            return true;
+        }
+        return false;
+    }
+
+    void wake(size_t count) {
+        if (sleepers.load() == 0) {
+            return;
+        }
+        lock_guard<mutex> lock(park_mutex);
+        if (count >= sleepers.load()) {
+            park_cv.notify_all();
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                park_cv.notify_one();
+            }
+        }
+    }
+
+    void run_task(Task &task) {
+        if (!metrics) {
+            task.run();
+        } else if (!LatencySampler::sample()) {
+            task.run();
+            metrics->tasks.add(1);
+        } else {
+            steady_clock::time_point start = steady_clock::now();
+            task.run();
+            uint64_t busy = nanoseconds_between(start, steady_clock::now());
+            metrics->queue_wait.record(nanoseconds_between(task.queued, start));
+            metrics->run_time.record(busy);
+            metrics->busy_ns.add(static_cast<int64_t>(busy * LatencySampler::SAMPLE_EVERY));
+            metrics->tasks.add(1);
+        }
+        task.run = nullptr;
+    }
+
+    void worker_function(size_t index) {
+        Task task;
+        while (true) {
+            if (try_take(index, task)) {
+                run_task(task);
+                continue;
+            }
+            bool found = false;
+            for (unsigned spin = 0; spin < SPIN_ROUNDS && !found; ++spin) {
+                this_thread::yield();
+                found = try_take(index, task);
+            }
+            if (found) {
+                run_task(task);
+                continue;
+            }
+            unique_lock<mutex> lock(park_mutex);
+            ++sleepers;
+            park_cv.wait(lock, [this]() { return pending.load() > 0 || shutdown.load(); });
+            --sleepers;
+            if (shutdown.load() && pending.load() == 0) {
+                break;
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t thread_count, PoolMetrics *metrics = nullptr) : metrics(metrics) {
+        if (thread_count == 0) {
+            thread_count = 1;
+        }
+        for (size_t i = 0; i < thread_count; ++i) {
+            queues.emplace_back(new WorkerQueue());
+        }
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers.emplace_back(&ThreadPool::worker_function, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Runs every task already submitted, then joins the workers.
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(park_mutex);
+            shutdown = true;
+        }
+        park_cv.notify_all();
+        for (thread &worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Tasks queued and not yet picked up by a worker.
+    size_t depth() const {
+        return pending.load();
+    }
+
+    void submit(function<void()> task) {
+        Task queued;
+        queued.run = move(task);
+        // pending is raised before the push so it never drops below the real count.
+        size_t depth = ++pending;
+        if (metrics) {
+            queued.queued = steady_clock::now();
+            metrics->observe_depth(depth);
+        }
+        WorkerQueue &queue = *queues[next_queue++ % queues.size()];
+        {
+            lock_guard<mutex> lock(queue.queue_mutex);
+            queue.tasks.push_back(move(queued));
+        }
+        wake(1);
+    }
+
+    // Deals the batch out over all worker deques, taking each deque lock once.
+    void submit_batch(vector<function<void()>> &&tasks) {
+        if (tasks.empty()) {
+            return;
+        }
+        size_t depth = pending += tasks.size();
+        Task queued;
+        if (metrics) {
+            queued.queued = steady_clock::now();
+            metrics->observe_depth(depth);
+        }
+        size_t n = queues.size();
+        size_t start = next_queue.fetch_add(1);
+        for (size_t q = 0; q < n && q < tasks.size(); ++q) {
+            WorkerQueue &queue = *queues[(start + q) % n];
+            lock_guard<mutex> lock(queue.queue_mutex);
+            for (size_t i = q; i < tasks.size(); i += n) {
+                queued.run = move(tasks[i]);
+                queue.tasks.push_back(move(queued));
+            }
+        }
+        wake(tasks.size());
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// Links and deadline a timer needs to sit in a TimerWheel. Derive the timer type from
+// it; the wheel never allocates or frees one.
+class TimerLink {
+public:
+    TimerLink *prev = nullptr;
+    TimerLink *next = nullptr;
+    // In ticks of the wheel's clock.
+    uint64_t deadline = 0;
+
+    bool linked() const {
+        return next != nullptr;
+    }
+
+    void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+// Hierarchical timing wheel (Varghese and Lauck): LEVELS wheels of SLOTS slots, where a
+// slot of level l spans SLOTS^l ticks. A timer is put in the lowest level whose range
+// covers the distance to its deadline, in the slot its deadline falls in, so insert and
+// cancel are a list splice each, whatever the number of timers. Advancing fires level
+// 0's slot for each tick; whenever a level wraps, the next level's current slot is
+// cascaded, its timers re-inserted by their remaining distance, so each timer moves
+// down at most LEVELS - 1 times. Timers past the top level's range (SLOTS^LEVELS
+// ticks) wait in its farthest slot and are re-inserted from there. Not thread-safe.
+template <typename Timer>
+class TimerWheel {
+private:
+    static const unsigned SLOT_BITS = 6;
+    static const size_t SLOTS = size_t(1) << SLOT_BITS;
+    static const unsigned LEVELS = 4;
+    static const uint64_t RANGE = uint64_t(1) << (SLOT_BITS * LEVELS);
+
+    // Each slot is a circular list through a sentinel.
+    TimerLink slots[LEVELS][SLOTS];
+    uint64_t current = 0;
+    size_t count = 0;
+
+    // Links a timer in for its deadline, or for tick `earliest` if that is later.
+    void place(TimerLink *timer, uint64_t earliest) {
+        uint64_t deadline = timer->deadline > earliest ? timer->deadline : earliest;
+        uint64_t distance = deadline - current;
+        if (distance >= RANGE) {
+            deadline = current + RANGE - 1;
+            distance = RANGE - 1;
+        }
+        unsigned level = 0;
+        while (level + 1 < LEVELS && distance >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+            ++level;
+        }
+        TimerLink &head = slots[level][(deadline >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        timer->prev = head.prev;
+        timer->next = &head;
+        head.prev->next = timer;
+        head.prev = timer;
+    }
+
+    // Re-inserts the timers of a level's slot by their remaining distance. Runs before
+    // level 0's slot for the current tick fires, so timers due now still go into it.
+    void cascade(unsigned level) {
+        TimerLink &head = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        TimerLink pending;
+        if (head.next == &head) {
+            return;
+        }
+        pending.next = head.next;
+        pending.prev = head.prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head.next = head.prev = &head;
+        while (pending.next != &pending) {
+            TimerLink *timer = pending.next;
+            timer->unlink();
+            place(timer, current);
+        }
+    }
+
+public:
+    // The clock starts at tick `start`.
+    explicit TimerWheel(uint64_t start = 0) : current(start) {
+        for (auto &level : slots) {
+            for (auto &head : level) {
+                head.next = head.prev = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    uint64_t now() const {
+        return current;
+    }
+
+    // Timers waiting to fire.
+    size_t size() const {
+        return count;
+    }
+
+    // Arms a timer that is not in the wheel, for timer->deadline; one already due fires
+    // on the next tick.
+    void insert(Timer *timer) {
+        place(timer, current + 1);
+        ++count;
+    }
+
+    // Disarms a timer that is in the wheel.
+    void cancel(Timer *timer) {
+        timer->unlink();
+        --count;
+    }
+
+    // Moves the clock on to `tick`, calling fire(timer) for every timer whose deadline
+    // it passes, each taken out of the wheel first. fire may insert timers again.
+    template <typename F>
+    void advance(uint64_t tick, F fire) {
+        if (count == 0) {
+            current = tick > current ? tick : current;
+            return;
+        }
+        while (current < tick) {
+            ++current;
+            // Every level that wrapped on this tick hands its current slot down, the top
+            // one first.
+            unsigned wrapped = 0;
+            while (wrapped + 1 < LEVELS && (current & ((uint64_t(1) << (SLOT_BITS * (wrapped + 1))) - 1)) == 0) {
+                ++wrapped;
+            }
+            for (unsigned level = wrapped; level > 0; --level) {
+                cascade(level);
+            }
+            TimerLink &head = slots[0][current & (SLOTS - 1)];
+            while (head.next != &head) {
+                TimerLink *timer = head.next;
+                timer->unlink();
+                --count;
+                fire(static_cast<Timer *>(timer));
+            }
+            if (count == 0) {
+                current = tick;
+            }
+        }
+    }
+
+    // Takes every timer out, without firing any.
+    void clear() {
+        for (auto &level : slots) {
+            for (auto &head : level) {
+                while (head.next != &head) {
+                    head.next->unlink();
+                }
+            }
+        }
+        count = 0;
+    }
+};
+
+#endif
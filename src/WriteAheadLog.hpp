@@ -0,0 +1,493 @@
+#ifndef WRITEAHEADLOG_HPP
+#define WRITEAHEADLOG_HPP
+
+#include <cerrno>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// How long an operation waits for its log record to reach disk.
+//   SYNC:    the pool worker that applied a chunk waits for its fsync before moving on.
+//   BATCHED: workers never wait; a batch's results are released by the log thread
+//            once the fsync covering its last record is done.
+//   ASYNC:   nothing waits; the log is written and synced every ASYNC_INTERVAL_MS, so
+//            a crash can lose the last few milliseconds of changes.
+// Single-file commands wait for their record in SYNC and BATCHED mode.
+enum class LogMode {
+    SYNC,
+    BATCHED,
+    ASYNC
+};
+
+// Record types as stored on disk; the values must not change.
+enum class LogOp : uint8_t {
+    CREATE = 1,
+    WRITE = 2,
+    DELETE = 3,
+    MKDIR = 4,
+    // Content: the u64 offset, then the bytes written there.
+    PWRITE = 5,
+    // Content: the u64 new size.
+    TRUNCATE = 6,
+    // Content: the new name.
+    RENAME = 7,
+    // No name. Content: the operations of a committed transaction, each a u8 op
+    // (CREATE, WRITE or DELETE), u32 name length, name, u32 content length, content;
+    // then, if it set an expiry, an EXPIRE entry with no name and its deadline.
+    TRANSACTION = 8,
+    // Content: the i64 deadline, nanoseconds since the epoch, or 0 for none.
+    EXPIRE = 9,
+    // Name: the source. Content: the target, created as a copy of the source.
+    COPY = 10
+};
+
+class LogStatus {
+public:
+    bool ok = false;
+    size_t records = 0;
+    string error;
+};
+
+// Append-only redo log of successful create/write/delete operations.
+//
+// File layout: a 24-byte header (magic, format, base position), then records of
+//   u32 payload length | u32 CRC-32 of payload | u8 op | u32 name length | name | content
+// Positions (LSNs) count record bytes from the start of the log's history, so they
+// stay meaningful after the log is compacted; a snapshot stores the position it
+// covers and replay starts there. Appenders copy their record into a shared buffer;
+// a dedicated thread writes out whatever has accumulated and fsyncs it, so
+// concurrent operations share one fsync (group commit). A change that must reach the
+// log in the order it took effect (see append_if) is ordered by a stripe lock chosen
+// by its key, not by the log lock, so changes to different files go in parallel and
+// only meet for the copy into the buffer.
+//
+// If a write or fsync fails, the file is cut back to the end of the last record that
+// made it, and the log stops: nothing from then on is written, and every wait for a
+// position past the last durable one reports the failure.
+class WriteAheadLog {
+private:
+    static const size_t HEADER_BYTES = 24;
+    static const size_t FRAME_BYTES = 8;
+    static const uint32_t FORMAT = 1;
+    static const unsigned ASYNC_INTERVAL_MS = 10;
+    static const unsigned STRIPE_BITS = 8;
+
+    class Stripe {
+    public:
+        mutex lock;
+        char padding[64];
+    };
+
+    int fd;
+    LogMode mode;
+    mutex log_mutex;
+    condition_variable work_cv;
+    condition_variable durable_cv;
+    // Encoded records not yet taken by the log thread.
+    string buffer;
+    uint64_t next_lsn;
+    uint64_t durable_lsn;
+    // Length of the file up to the end of the last record written and synced.
+    off_t durable_bytes;
+    vector<pair<uint64_t, function<void(bool)>>> callbacks;
+    bool stopping = false;
+    atomic<bool> failed{false};
+    Stripe stripes[1u << STRIPE_BITS];
+    thread writer;
+
+    static const char *magic() {
+        return "MEMFSWAL";
+    }
+
+    static uint32_t crc32(const char *data, size_t len) {
+        static const vector<uint32_t> table = []() {
+            vector<uint32_t> t(256);
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < len; ++i) {
+            crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    template <typename T>
+    static void put(string &out, T value) {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static T get(const char *in) {
+        T value;
+        memcpy(&value, in, sizeof(value));
+        return value;
+    }
+
+    static string header(uint64_t base) {
+        string out(magic(), 8);
+        put<uint32_t>(out, FORMAT);
+        put<uint32_t>(out, 0);
+        put<uint64_t>(out, base);
+        return out;
+    }
+
+    static bool write_all(int fd, const string &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, string &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::pread(fd, &data[done], data.size() - done, static_cast<off_t>(done));
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // Writes header + body to path.tmp, syncs it and renames it over path.
+    static int replace(const string &path, const string &contents, string &error) {
+        string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || !write_all(fd, contents) || fsync(fd) != 0 || rename(temp.c_str(), path.c_str()) != 0) {
+            error = "cannot rewrite " + path + ": " + strerror(errno);
+            if (fd >= 0) {
+                close(fd);
+                unlink(temp.c_str());
+            }
+            return -1;
+        }
+        close(fd);
+        return ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+
+    WriteAheadLog(int fd, LogMode mode, uint64_t lsn)
+        : fd(fd), mode(mode), next_lsn(lsn), durable_lsn(lsn), durable_bytes(lseek(fd, 0, SEEK_END)),
+          writer(&WriteAheadLog::run, this) {}
+
+    // Runs the callbacks waiting for a position up to `end`, or, with `durable` false,
+    // all of them. Caller holds `lock`, which is released while they run.
+    void run_callbacks(unique_lock<mutex> &lock, uint64_t end, bool durable) {
+        vector<function<void(bool)>> ready;
+        size_t kept = 0;
+        for (size_t i = 0; i < callbacks.size(); ++i) {
+            if (!durable || callbacks[i].first <= end) {
+                ready.push_back(move(callbacks[i].second));
+            } else {
+                callbacks[kept++] = move(callbacks[i]);
+            }
+        }
+        callbacks.resize(kept);
+        if (!ready.empty()) {
+            lock.unlock();
+            for (auto &callback : ready) {
+                callback(durable);
+            }
+            lock.lock();
+        }
+    }
+
+    void run() {
+        const milliseconds interval(static_cast<unsigned>(ASYNC_INTERVAL_MS));
+        string writing;
+        unique_lock<mutex> lock(log_mutex);
+        while (true) {
+            if (mode == LogMode::ASYNC) {
+                work_cv.wait_for(lock, interval, [this]() { return stopping; });
+            } else {
+                work_cv.wait(lock, [this]() { return !buffer.empty() || stopping; });
+            }
+            if (buffer.empty()) {
+                if (stopping) {
+                    break;
+                }
+                continue;
+            }
+            // Everything appended while this write and fsync run goes out in the next round.
+            writing.swap(buffer);
+            uint64_t end = next_lsn;
+            lock.unlock();
+            bool ok = write_all(fd, writing) && fdatasync(fd) == 0;
+            int error = errno;
+            off_t written = static_cast<off_t>(writing.size());
+            writing.clear();
+
+            if (!ok) {
+                // Drop whatever part of the round did reach the file, so a restart
+                // replays up to the last durable record and finds nothing after it.
+                int ignored = ftruncate(fd, durable_bytes);
+                (void)ignored;
+            }
+
+            lock.lock();
+            if (!ok) {
+                failed = true;
+                buffer.clear();
+                cerr << "Error: write-ahead log failed: " << strerror(error)
+                     << "; no further changes are logged, and they fail" << endl;
+            } else {
+                durable_lsn = end;
+                durable_bytes += written;
+            }
+            durable_cv.notify_all();
+            run_callbacks(lock, end, ok);
+        }
+    }
+
+    // Frames and checksums a record into a per-thread scratch buffer, so only the
+    // copy into the shared buffer happens under the log lock.
+    static const string &encode(LogOp op, const string &name, const string &content) {
+        static thread_local string record;
+        uint32_t payload = static_cast<uint32_t>(1 + sizeof(uint32_t) + name.size() + content.size());
+        record.clear();
+        put<uint32_t>(record, payload);
+        put<uint32_t>(record, 0);
+        record.push_back(static_cast<char>(op));
+        put<uint32_t>(record, static_cast<uint32_t>(name.size()));
+        record.append(name);
+        record.append(content);
+        uint32_t crc = crc32(&record[FRAME_BYTES], payload);
+        memcpy(&record[sizeof(uint32_t)], &crc, sizeof(crc));
+        return record;
+    }
+
+    // Caller holds log_mutex. Once the log has failed the record is dropped, but it
+    // still gets a position, which is never reported durable.
+    uint64_t push(const string &record) {
+        next_lsn += record.size();
+        if (failed) {
+            return next_lsn;
+        }
+        bool idle = buffer.empty();
+        buffer.append(record);
+        if (idle && mode != LogMode::ASYNC) {
+            work_cv.notify_one();
+        }
+        return next_lsn;
+    }
+
+public:
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    // Writes out and syncs whatever is still buffered, then stops the log thread.
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> lock(log_mutex);
+            stopping = true;
+        }
+        work_cv.notify_one();
+        writer.join();
+        close(fd);
+    }
+
+    // Opens (or creates) the log at path and calls apply(op, name, content) for every
+    // record past `start`, the position covered by the snapshot loaded beforehand.
+    // Replay stops at the first torn or corrupt record. If that left garbage at the
+    // end, or records before `start` can be dropped, the log is rewritten first.
+    template <typename F>
+    static unique_ptr<WriteAheadLog> open(const string &path, LogMode mode, uint64_t start, F apply,
+                                          LogStatus &status) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            status.error = "cannot open " + path + ": " + strerror(errno);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return nullptr;
+        }
+        string contents(static_cast<size_t>(info.st_size), '\0');
+        bool readable = read_all(fd, contents);
+        close(fd);
+        if (!readable) {
+            status.error = "cannot read " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        if (contents.empty()) {
+            fd = replace(path, header(start), status.error);
+            if (fd < 0) {
+                return nullptr;
+            }
+            status.ok = true;
+            return unique_ptr<WriteAheadLog>(new WriteAheadLog(fd, mode, start));
+        }
+        if (contents.size() < HEADER_BYTES || contents.compare(0, 8, magic()) != 0 ||
+            get<uint32_t>(&contents[8]) != FORMAT) {
+            status.error = path + " is not a write-ahead log";
+            return nullptr;
+        }
+
+        uint64_t base = get<uint64_t>(&contents[16]);
+        if (base > start) {
+            status.error = path + " starts at position " + to_string(base) + " but the snapshot only covers " +
+                           to_string(start) + "; load a newer snapshot";
+            return nullptr;
+        }
+        uint64_t lsn = base;
+        size_t keep_from = string::npos;
+        if (start == base) {
+            keep_from = HEADER_BYTES;
+        }
+        size_t pos = HEADER_BYTES;
+        string name;
+        string content;
+        while (pos + FRAME_BYTES <= contents.size()) {
+            uint32_t payload = get<uint32_t>(&contents[pos]);
+            const char *data = &contents[pos + FRAME_BYTES];
+            if (payload < 1 + sizeof(uint32_t) || payload > contents.size() - pos - FRAME_BYTES ||
+                crc32(data, payload) != get<uint32_t>(&contents[pos + sizeof(uint32_t)])) {
+                break;
+            }
+            uint32_t name_size = get<uint32_t>(data + 1);
+            if (name_size > payload - 1 - sizeof(uint32_t)) {
+                break;
+            }
+            pos += FRAME_BYTES + payload;
+            lsn += FRAME_BYTES + payload;
+            if (lsn > start) {
+                name.assign(data + 1 + sizeof(uint32_t), name_size);
+                content.assign(data + 1 + sizeof(uint32_t) + name_size, payload - 1 - sizeof(uint32_t) - name_size);
+                apply(static_cast<LogOp>(data[0]), name, content);
+                ++status.records;
+            } else if (lsn == start) {
+                keep_from = pos;
+            }
+        }
+        if (keep_from == string::npos) {
+            status.error = "the snapshot covers position " + to_string(start) + " but " + path + " ends at " +
+                           to_string(lsn);
+            return nullptr;
+        }
+
+        if (keep_from != HEADER_BYTES || pos != contents.size()) {
+            fd = replace(path, header(start) + contents.substr(keep_from, pos - keep_from), status.error);
+        } else {
+            fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (fd < 0) {
+                status.error = "cannot open " + path + ": " + strerror(errno);
+            }
+        }
+        if (fd < 0) {
+            return nullptr;
+        }
+        status.ok = true;
+        return unique_ptr<WriteAheadLog>(new WriteAheadLog(fd, mode, lsn));
+    }
+
+    LogMode durability() const {
+        return mode;
+    }
+
+    // Queues a record and returns its position; wait(position) blocks until it is on disk.
+    uint64_t append(LogOp op, const string &name, const string &content) {
+        const string &record = encode(op, name, content);
+        lock_guard<mutex> lock(log_mutex);
+        return push(record);
+    }
+
+    // Runs commit() and logs the record only if it returns true (returning its
+    // position, or 0 otherwise). Used to publish a write: calls with the same key run
+    // one at a time, so concurrent writes to one file reach the log in the order they
+    // took effect. Calls with other keys do not wait for this one.
+    template <typename F>
+    uint64_t append_if(size_t key, LogOp op, const string &name, const string &content, F commit) {
+        const string &record = encode(op, name, content);
+        lock_guard<mutex> ordered(stripes[(key * 0x9E3779B97F4A7C15ull) >> (64 - STRIPE_BITS)].lock);
+        if (!commit()) {
+            return 0;
+        }
+        lock_guard<mutex> lock(log_mutex);
+        return push(record);
+    }
+
+    // Runs f with appends held off, including any append_if between its commit and
+    // its record, and returns the log position at that moment.
+    template <typename F>
+    uint64_t cut(F f) {
+        for (auto &stripe : stripes) {
+            stripe.lock.lock();
+        }
+        uint64_t position;
+        {
+            lock_guard<mutex> lock(log_mutex);
+            f();
+            position = next_lsn;
+        }
+        for (auto &stripe : stripes) {
+            stripe.lock.unlock();
+        }
+        return position;
+    }
+
+    // True once a write or fsync has failed; see the class comment.
+    bool broken() const {
+        return failed.load(memory_order_relaxed);
+    }
+
+    // Blocks until position lsn is on disk and returns true, or returns false once the
+    // log has failed before getting there.
+    bool wait(uint64_t lsn) {
+        unique_lock<mutex> lock(log_mutex);
+        durable_cv.wait(lock, [this, lsn]() { return durable_lsn >= lsn || failed; });
+        return durable_lsn >= lsn;
+    }
+
+    // Runs f(true) on the log thread once position lsn is on disk, or f(false) if the
+    // log fails first; right away if either has happened already.
+    void when_durable(uint64_t lsn, function<void(bool)> f) {
+        bool durable;
+        {
+            lock_guard<mutex> lock(log_mutex);
+            durable = durable_lsn >= lsn;
+            if (!durable && !failed) {
+                callbacks.push_back(make_pair(lsn, move(f)));
+                return;
+            }
+        }
+        f(durable);
+    }
+};
+
+#endif
@@ -1,52 +1,232 @@
 #include "MemFS.hpp"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
 
 using namespace std;
+using namespace std::chrono;
 
-class CpuUsage {
+// Operation kinds a client issues. BATCH is one submit_ops call carrying `batch`
+// mutations (only when --batch is above 1).
+enum class BenchOp {
+    READ,
+    WRITE,
+    CREATE,
+    DELETE,
+    BATCH
+};
+
+static const size_t BENCH_OP_COUNT = 5;
+
+const char *op_name(BenchOp op) {
+    switch (op) {
+    case BenchOp::READ:
+        return "read";
+    case BenchOp::WRITE:
+        return "write";
+    case BenchOp::CREATE:
+        return "create";
+    case BenchOp::DELETE:
+        return "delete";
+    case BenchOp::BATCH:
+        break;
+    }
+    return "batch";
+}
+
+// Percentages of reads, writes, creates and deletes; they add up to 100.
+class WorkloadMix {
 public:
-    double total_jiffies;
-    double work_jiffies;
-    CpuUsage(double total_jiffies, double work_jiffies) : total_jiffies(total_jiffies), work_jiffies(work_jiffies) {}
+    string name;
+    int read;
+    int write;
+    int create;
+    int remove;
+
+    BenchOp pick(int roll) const {
+        if (roll < read) {
+            return BenchOp::READ;
+        } else if (roll < read + write) {
+            return BenchOp::WRITE;
+        } else if (roll < read + write + create) {
+            return BenchOp::CREATE;
+        }
+        return BenchOp::DELETE;
+    }
 };
 
-CpuUsage *get_cpu_usage() {
-    ifstream statusFile("/proc/stat");
-    if (!statusFile.is_open()) {
-        cerr << "Failed to open /proc/stat" << endl;
-        return nullptr;
+vector<WorkloadMix> known_mixes() {
+    return {
+        {"read-heavy", 90, 10, 0, 0},
+        {"write-heavy", 10, 90, 0, 0},
+        {"churn", 10, 20, 35, 35},
+    };
+}
+
+// Zipfian ranks over [0, n) after Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases" (the generator YCSB uses). Ranks are scrambled with a hash so
+// the hot keys are spread over the key space, and hence over shards.
+class ZipfGenerator {
+private:
+    size_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+
+    static double zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) {
+            sum += 1.0 / pow(static_cast<double>(i), theta);
+        }
+        return sum;
     }
-    string line;
-    getline(statusFile, line);
-    statusFile.close();
 
-    istringstream iss(line);
-    string cpuLabel;
-    long user, nice, system, idle, iowait, irq, softirq, steal;
+public:
+    ZipfGenerator(size_t n, double theta) : n(n), theta(theta) {
+        alpha = 1.0 / (1.0 - theta);
+        zetan = zeta(n, theta);
+        double zeta2 = zeta(2, theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template <typename RNG>
+    size_t next(RNG &rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        size_t rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < 1.0 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = static_cast<size_t>(n * pow(eta * u - eta + 1, alpha));
+        }
+        uint64_t h = 14695981039346656037ull;
+        for (int i = 0; i < 8; ++i) {
+            h = (h ^ ((rank >> (i * 8)) & 0xFF)) * 1099511628211ull;
+        }
+        return h % n;
+    }
+};
+
+// Log-linear latency histogram in nanoseconds: each power of two is split into
+// SUB_BUCKETS buckets, so any percentile is off by at most 1/SUB_BUCKETS.
+class LatencyHistogram {
+private:
+    static const size_t SUB_BITS = 5;
+    static const size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
 
-    iss >> cpuLabel >> user >> nice >> system >> idle >> iowait >> irq >> softirq >> steal;
+    vector<uint64_t> counts;
 
-    if (cpuLabel != "cpu") {
-        cerr << "Unexpected format in /proc/stat" << endl;
-        return nullptr;
+    static size_t bucket_of(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return static_cast<size_t>(ns);
+        }
+        size_t magnitude = 63 - __builtin_clzll(ns);
+        size_t shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((ns >> shift) - SUB_BUCKETS);
     }
-    long total_jiffies = user + nice + system + idle + iowait + irq + softirq + steal;
-    long work_jiffies = user + nice + system;
-    return new CpuUsage(total_jiffies, work_jiffies);
-}
 
-long get_memory_usage_kb() {
-    ifstream statusFile("/proc/self/status");
-    if (!statusFile.is_open()) {
-        cerr << "Failed to open /proc/self/status" << endl;
-        return -1;
+    // Largest value that falls into bucket b.
+    static uint64_t bucket_top(size_t b) {
+        if (b < SUB_BUCKETS) {
+            return b;
+        }
+        size_t shift = b / SUB_BUCKETS - 1;
+        uint64_t base = (SUB_BUCKETS + b % SUB_BUCKETS) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
     }
 
+public:
+    uint64_t total = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+
+    LatencyHistogram() : counts((64 - SUB_BITS + 1) * SUB_BUCKETS, 0) {}
+
+    void record(uint64_t ns) {
+        ++counts[bucket_of(ns)];
+        ++total;
+        sum_ns += ns;
+        max_ns = max(max_ns, ns);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (size_t i = 0; i < counts.size(); ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum_ns += other.sum_ns;
+        max_ns = max(max_ns, other.max_ns);
+    }
+
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(ceil(q * total));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < counts.size(); ++b) {
+            seen += counts[b];
+            if (seen >= max<uint64_t>(rank, 1)) {
+                return min(bucket_top(b), max_ns);
+            }
+        }
+        return max_ns;
+    }
+
+    double mean() const {
+        return total == 0 ? 0 : static_cast<double>(sum_ns) / total;
+    }
+};
+
+class BenchConfig {
+public:
+    vector<size_t> clients = {1, 2, 4, 8};
+    vector<WorkloadMix> mixes = known_mixes();
+    vector<string> distributions = {"uniform", "zipf"};
+    size_t pool_threads = 4;
+    size_t files = 10000;
+    size_t ops = 20000;
+    size_t warmup = 2000;
+    size_t batch = 1;
+    size_t content_size = 16;
+    double zipf_theta = 0.99;
+    bool metrics = true;
+    uint64_t seed = 42;
+    string format = "text";
+    string output = "-";
+};
+
+class BenchResult {
+public:
+    string mix;
+    string distribution;
+    size_t clients;
+    double seconds;
+    uint64_t operations;
+    uint64_t failed;
+    double cpu_seconds;
+    long rss_kb;
+    size_t memfs_bytes;
+    LatencyHistogram all;
+    vector<LatencyHistogram> by_op = vector<LatencyHistogram>(BENCH_OP_COUNT);
+};
+
+long get_memory_usage_kb() {
+    ifstream statusFile("/proc/self/status");
     string line;
     while (getline(statusFile, line)) {
         if (line.find("VmRSS:") == 0) {
@@ -54,88 +234,413 @@ long get_memory_usage_kb() {
             string label;
             long memory_kb;
             iss >> label >> memory_kb;
-            statusFile.close();
             return memory_kb;
         }
     }
-    statusFile.close();
-    cerr << "VmRSS not found in /proc/self/status" << endl;
     return -1;
 }
 
-string random_string() {
-    string str("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz");
-    random_shuffle(str.begin(), str.end());
-    return str.substr(0, 10);
+double cpu_seconds() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
 }
 
-int main() {
-    vector<int> threads = {1,
-                           2,
-                           4,
-                           8,
-                           16};
-    vector<int> work_loads = {
-        100,
-        1000,
-        10000};
-
-    ofstream out_file;
-    // if the out_file exist remove it and create a new one
-    out_file.open("benchmark.txt", ios::out | ios::trunc);
-    if (!out_file.is_open()) {
-        cerr << "Failed to open benchmark.txt" << endl;
-        return 1;
+// One client thread's loop. Mutations go straight to the single-file API, or with
+// --batch > 1 are collected into one submit_ops call of that many operations; reads
+// always go through MemFS::read, touching the bytes but printing nothing.
+class Client {
+public:
+    MemFS &fs;
+    const BenchConfig &config;
+    const WorkloadMix &mix;
+    const vector<string> &names;
+    const ZipfGenerator *zipf;
+    mt19937_64 rng;
+    string content;
+    vector<LatencyHistogram> by_op = vector<LatencyHistogram>(BENCH_OP_COUNT);
+    uint64_t operations = 0;
+    uint64_t failed = 0;
+    uint64_t checksum = 0;
+
+    vector<OpType> pending_ops;
+    vector<string> pending_names;
+    vector<string> pending_contents;
+
+    Client(MemFS &fs, const BenchConfig &config, const WorkloadMix &mix, const vector<string> &names,
+           const ZipfGenerator *zipf, uint64_t seed)
+        : fs(fs), config(config), mix(mix), names(names), zipf(zipf), rng(seed), content(config.content_size, 'x') {}
+
+    const string &pick_name() {
+        size_t key = zipf ? zipf->next(rng) : uniform_int_distribution<size_t>(0, names.size() - 1)(rng);
+        return names[key];
     }
 
-    for (int thread : threads) {
-        for (int work_load : work_loads) {
-            MemFS fs{static_cast<size_t>(thread)};
-            vector<string> filenames;
-            vector<string> contents;
-            for (int i = 0; i < 10000; ++i) {
-                filenames.push_back("file" + to_string(i) + ".txt");
+    FileStatus apply(BenchOp op, const string &name) {
+        switch (op) {
+        case BenchOp::READ: {
+            FileView view;
+            FileStatus status = fs.read(name, view);
+            view.for_each_segment([this](const char *data, size_t len) { checksum += len + static_cast<unsigned char>(data[0]); });
+            return status;
+        }
+        case BenchOp::WRITE:
+            return fs.write_file(name, content);
+        case BenchOp::CREATE:
+            return fs.create_file(name);
+        case BenchOp::DELETE:
+        case BenchOp::BATCH:
+            break;
+        }
+        return fs.delete_file(name);
+    }
+
+    void flush_batch(bool record) {
+        if (pending_ops.empty()) {
+            return;
+        }
+        size_t count = pending_ops.size();
+        auto start = steady_clock::now();
+        PendingBatch batch = fs.submit_ops(move(pending_ops), move(pending_names), move(pending_contents));
+        vector<FileStatus> statuses = batch.results.get();
+        uint64_t ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        pending_ops.clear();
+        pending_names.clear();
+        pending_contents.clear();
+        if (record) {
+            by_op[static_cast<size_t>(BenchOp::BATCH)].record(ns);
+            operations += count;
+            for (FileStatus status : statuses) {
+                failed += status != FileStatus::OK;
             }
-            for (int i = 0; i < 10000; ++i) {
-                contents.push_back(random_string());
+        }
+    }
+
+    void step(bool record) {
+        BenchOp op = mix.pick(uniform_int_distribution<int>(0, 99)(rng));
+        const string &name = pick_name();
+        if (config.batch > 1 && op != BenchOp::READ) {
+            pending_ops.push_back(op == BenchOp::WRITE ? OpType::WRITE : op == BenchOp::CREATE ? OpType::CREATE : OpType::DELETE);
+            pending_names.push_back(name);
+            pending_contents.push_back(op == BenchOp::WRITE ? content : string());
+            if (pending_ops.size() >= config.batch) {
+                flush_batch(record);
             }
+            return;
+        }
+        auto start = steady_clock::now();
+        FileStatus status = apply(op, name);
+        uint64_t ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        if (record) {
+            by_op[static_cast<size_t>(op)].record(ns);
+            ++operations;
+            failed += status != FileStatus::OK;
+        }
+    }
+};
+
+BenchResult run_scenario(const BenchConfig &config, const WorkloadMix &mix, const string &distribution, size_t clients) {
+    MemFSOptions options;
+    // Writes append, so give files room to grow for the whole run.
+    options.max_file_size = SIZE_MAX;
+    options.metrics = config.metrics;
+    MemFS fs(config.pool_threads, options);
+
+    vector<string> names;
+    names.reserve(config.files);
+    for (size_t i = 0; i < config.files; ++i) {
+        names.push_back("file" + to_string(i) + ".txt");
+    }
+    fs.submit_creates(names).get();
+    fs.submit_writes(names, vector<string>(names.size(), string(64, 'i'))).get();
+
+    unique_ptr<ZipfGenerator> zipf;
+    if (distribution == "zipf") {
+        zipf.reset(new ZipfGenerator(config.files, config.zipf_theta));
+    }
+
+    vector<unique_ptr<Client>> workers;
+    for (size_t c = 0; c < clients; ++c) {
+        workers.emplace_back(new Client(fs, config, mix, names, zipf.get(), config.seed + c));
+    }
+
+    // Every client warms up, then all start the measured phase together.
+    atomic<size_t> ready{0};
+    atomic<bool> go{false};
+    steady_clock::time_point start;
+    double cpu_start = 0;
+    vector<thread> threads;
+    for (size_t c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c]() {
+            Client &client = *workers[c];
+            for (size_t i = 0; i < config.warmup; ++i) {
+                client.step(false);
+            }
+            client.flush_batch(false);
+            ++ready;
+            while (!go.load()) {
+                this_thread::yield();
+            }
+            for (size_t i = 0; i < config.ops; ++i) {
+                client.step(true);
+            }
+            client.flush_batch(true);
+        });
+    }
+    while (ready.load() < clients) {
+        this_thread::yield();
+    }
+    cpu_start = cpu_seconds();
+    start = steady_clock::now();
+    go = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    BenchResult result;
+    result.seconds = duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e9;
+    result.cpu_seconds = cpu_seconds() - cpu_start;
+    result.mix = mix.name;
+    result.distribution = distribution;
+    result.clients = clients;
+    result.operations = 0;
+    result.failed = 0;
+    for (auto &client : workers) {
+        result.operations += client->operations;
+        result.failed += client->failed;
+        for (size_t op = 0; op < BENCH_OP_COUNT; ++op) {
+            result.by_op[op].merge(client->by_op[op]);
+            result.all.merge(client->by_op[op]);
+        }
+    }
+    result.rss_kb = get_memory_usage_kb();
+    result.memfs_bytes = fs.memory_used();
+    return result;
+}
+
+double micros(uint64_t ns) {
+    return ns / 1000.0;
+}
 
-            CpuUsage *start_cpu = get_cpu_usage();
-            // get the intial memory usage
+// Output is deterministic apart from the measurements themselves (fixed key order,
+// fixed precision, no timestamps), so results from two builds diff line by line.
+void write_text(ostream &out, const BenchConfig &config, const vector<BenchResult> &results) {
+    out << "files=" << config.files << " ops/client=" << config.ops << " warmup/client=" << config.warmup
+        << " pool=" << config.pool_threads << " batch=" << config.batch << " content=" << config.content_size
+        << "B zipf_theta=" << config.zipf_theta
+        << " metrics=" << (config.metrics ? "on" : "off") << endl
+        << endl;
+    out << left << setw(12) << "mix" << setw(9) << "dist" << right << setw(8) << "clients" << setw(8) << "op"
+        << setw(12) << "count" << setw(12) << "ops/s" << setw(10) << "p50 us" << setw(10) << "p99 us"
+        << setw(10) << "p999 us" << setw(10) << "max us" << setw(8) << "failed" << endl;
+    out << fixed << setprecision(1);
+    for (const BenchResult &r : results) {
+        auto row = [&](const string &op, const LatencyHistogram &h, double rate, uint64_t failed) {
+            out << left << setw(12) << r.mix << setw(9) << r.distribution << right << setw(8) << r.clients
+                << setw(8) << op << setw(12) << h.total << setw(12) << rate << setw(10) << micros(h.percentile(0.5))
+                << setw(10) << micros(h.percentile(0.99)) << setw(10) << micros(h.percentile(0.999))
+                << setw(10) << micros(h.max_ns) << setw(8) << (op == "all" ? to_string(failed) : "-") << endl;
+        };
+        row("all", r.all, r.operations / r.seconds, r.failed);
+        for (size_t op = 0; op < BENCH_OP_COUNT; ++op) {
+            if (r.by_op[op].total > 0) {
+                row(op_name(static_cast<BenchOp>(op)), r.by_op[op], r.by_op[op].total / r.seconds, 0);
+            }
+        }
+    }
+}
 
-            auto start_create = chrono::high_resolution_clock::now();
-            fs.create_files(10000, filenames);
-            auto duration_create = chrono::high_resolution_clock::now() - start_create;
+void write_csv(ostream &out, const vector<BenchResult> &results) {
+    out << "mix,distribution,clients,op,count,seconds,ops_per_sec,p50_us,p99_us,p999_us,max_us,mean_us,failed,cpu_seconds,rss_kb,memfs_bytes" << endl;
+    out << fixed << setprecision(3);
+    for (const BenchResult &r : results) {
+        auto row = [&](const string &op, const LatencyHistogram &h, uint64_t count) {
+            out << r.mix << ',' << r.distribution << ',' << r.clients << ',' << op << ',' << count << ','
+                << r.seconds << ',' << count / r.seconds << ',' << micros(h.percentile(0.5)) << ','
+                << micros(h.percentile(0.99)) << ',' << micros(h.percentile(0.999)) << ',' << micros(h.max_ns)
+                << ',' << micros(static_cast<uint64_t>(h.mean())) << ',' << (op == "all" ? r.failed : 0) << ','
+                << r.cpu_seconds << ',' << r.rss_kb << ',' << r.memfs_bytes << endl;
+        };
+        row("all", r.all, r.operations);
+        for (size_t op = 0; op < BENCH_OP_COUNT; ++op) {
+            if (r.by_op[op].total > 0) {
+                row(op_name(static_cast<BenchOp>(op)), r.by_op[op], r.by_op[op].total);
+            }
+        }
+    }
+}
 
-            auto start_write = chrono::high_resolution_clock::now();
-            fs.write_files(10000, filenames, contents);
-            auto duration_write = chrono::high_resolution_clock::now() - start_write;
+void write_latency_json(ostream &out, const LatencyHistogram &h, uint64_t count, double seconds) {
+    out << "{\"count\": " << count << ", \"ops_per_sec\": " << count / seconds
+        << ", \"p50_us\": " << micros(h.percentile(0.5)) << ", \"p99_us\": " << micros(h.percentile(0.99))
+        << ", \"p999_us\": " << micros(h.percentile(0.999)) << ", \"max_us\": " << micros(h.max_ns)
+        << ", \"mean_us\": " << micros(static_cast<uint64_t>(h.mean())) << "}";
+}
 
-            auto start_read = chrono::high_resolution_clock::now();
-            for (int i = 0; i < 10000; ++i) {
-                fs.read_file("file" + to_string(i) + ".txt");
+void write_json(ostream &out, const BenchConfig &config, const vector<BenchResult> &results) {
+    out << fixed << setprecision(3);
+    out << "{" << endl
+        << "  \"config\": {\"files\": " << config.files << ", \"ops_per_client\": " << config.ops
+        << ", \"warmup_per_client\": " << config.warmup << ", \"pool_threads\": " << config.pool_threads
+        << ", \"batch\": " << config.batch << ", \"content_size\": " << config.content_size
+        << ", \"zipf_theta\": " << config.zipf_theta << ", \"metrics\": " << (config.metrics ? "true" : "false")
+        << ", \"seed\": " << config.seed << "}," << endl
+        << "  \"results\": [" << endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        out << "    {\"mix\": \"" << r.mix << "\", \"distribution\": \"" << r.distribution
+            << "\", \"clients\": " << r.clients << ", \"seconds\": " << r.seconds << ", \"failed\": " << r.failed
+            << ", \"cpu_seconds\": " << r.cpu_seconds << ", \"rss_kb\": " << r.rss_kb
+            << ", \"memfs_bytes\": " << r.memfs_bytes << "," << endl
+            << "     \"all\": ";
+        write_latency_json(out, r.all, r.operations, r.seconds);
+        for (size_t op = 0; op < BENCH_OP_COUNT; ++op) {
+            if (r.by_op[op].total > 0) {
+                out << "," << endl
+                    << "     \"" << op_name(static_cast<BenchOp>(op)) << "\": ";
+                write_latency_json(out, r.by_op[op], r.by_op[op].total, r.seconds);
             }
-            auto duration_read = chrono::high_resolution_clock::now() - start_read;
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl
+        << "}" << endl;
+}
 
-            auto start_delete = chrono::high_resolution_clock::now();
-            fs.delete_files(10000, filenames);
-            auto duration_delete = chrono::high_resolution_clock::now() - start_delete;
+void usage(const char *program) {
+    cerr << "usage: " << program << " [options]" << endl
+         << "  --clients <n,n,...>     client thread counts to run (default 1,2,4,8)" << endl
+         << "  --mix <name,...|all>    read-heavy, write-heavy, churn (default all)" << endl
+         << "  --dist <name,...|all>   uniform, zipf (default all)" << endl
+         << "  --zipf-theta <x>        Zipf skew (default 0.99)" << endl
+         << "  --files <n>             key space, all created before the run (default 10000)" << endl
+         << "  --ops <n>               measured operations per client (default 20000)" << endl
+         << "  --warmup <n>            unmeasured operations per client first (default 2000)" << endl
+         << "  --pool <n>              MemFS worker threads (default 4)" << endl
+         << "  --batch <n>             mutations per submit_ops call; 1 uses the single-file API (default 1)" << endl
+         << "  --content-size <bytes>  bytes appended per write (default 16)" << endl
+         << "  --metrics <on|off>      MemFS built-in metrics, to measure their cost (default on)" << endl
+         << "  --seed <n>              random seed (default 42)" << endl
+         << "  --format <text|csv|json> (default text)" << endl
+         << "  --output <file|->       (default -, standard output)" << endl;
+}
 
-            CpuUsage *end_cpu = get_cpu_usage();
-            this_thread::sleep_for(chrono::seconds(1));
-            long memory_usage = get_memory_usage_kb();
+vector<string> split(const string &list) {
+    vector<string> parts;
+    stringstream in(list);
+    for (string part; getline(in, part, ',');) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+bool parse_args(int argc, char *argv[], BenchConfig &config) {
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (flag == "--clients") {
+                config.clients.clear();
+                for (const string &part : split(value)) {
+                    config.clients.push_back(stoul(part));
+                }
+            } else if (flag == "--mix") {
+                if (value != "all") {
+                    vector<WorkloadMix> chosen;
+                    for (const string &part : split(value)) {
+                        auto known = known_mixes();
+                        auto it = find_if(known.begin(), known.end(), [&part](const WorkloadMix &m) { return m.name == part; });
+                        if (it == known.end()) {
+                            return false;
+                        }
+                        chosen.push_back(*it);
+                    }
+                    config.mixes = chosen;
+                }
+            } else if (flag == "--dist") {
+                if (value != "all") {
+                    config.distributions = split(value);
+                    for (const string &d : config.distributions) {
+                        if (d != "uniform" && d != "zipf") {
+                            return false;
+                        }
+                    }
+                }
+            } else if (flag == "--zipf-theta") {
+                config.zipf_theta = stod(value);
+            } else if (flag == "--files") {
+                config.files = stoul(value);
+            } else if (flag == "--ops") {
+                config.ops = stoul(value);
+            } else if (flag == "--warmup") {
+                config.warmup = stoul(value);
+            } else if (flag == "--pool") {
+                config.pool_threads = stoul(value);
+            } else if (flag == "--batch") {
+                config.batch = stoul(value);
+            } else if (flag == "--content-size") {
+                config.content_size = stoul(value);
+            } else if (flag == "--metrics") {
+                if (value != "on" && value != "off") {
+                    return false;
+                }
+                config.metrics = value == "on";
+            } else if (flag == "--seed") {
+                config.seed = stoull(value);
+            } else if (flag == "--format") {
+                if (value != "text" && value != "csv" && value != "json") {
+                    return false;
+                }
+                config.format = value;
+            } else if (flag == "--output") {
+                config.output = value;
+            } else {
+                return false;
+            }
+        } catch (const exception &) {
+            return false;
+        }
+    }
+    return config.files > 0 && !config.clients.empty() && config.zipf_theta > 0 && config.zipf_theta < 1;
+}
 
-            double cpu_utilization = (end_cpu->work_jiffies - start_cpu->work_jiffies) / (end_cpu->total_jiffies - start_cpu->total_jiffies) * 100;
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    if (!parse_args(argc, argv, config)) {
+        usage(argv[0]);
+        return 1;
+    }
 
-            out_file << "Benchmarking with " << thread << " threads and " << work_load << " work load" << endl;
-            out_file << "Create: " << chrono::duration_cast<chrono::milliseconds>(duration_create).count() << "ms" << endl;
-            out_file << "Write: " << chrono::duration_cast<chrono::milliseconds>(duration_write).count() << "ms" << endl;
-            out_file << "Read: " << chrono::duration_cast<chrono::milliseconds>(duration_read).count() << "ms" << endl;
-            out_file << "Delete: " << chrono::duration_cast<chrono::milliseconds>(duration_delete).count() << "ms" << endl;
-            out_file << "CPU Utilization: " << cpu_utilization << "%" << endl;
-            out_file << "Memory Usage: " << memory_usage << "KB" << endl;
-            out_file << endl;
+    vector<BenchResult> results;
+    for (const WorkloadMix &mix : config.mixes) {
+        for (const string &distribution : config.distributions) {
+            for (size_t clients : config.clients) {
+                cerr << "running " << mix.name << " / " << distribution << " / " << clients << " clients" << endl;
+                results.push_back(run_scenario(config, mix, distribution, clients));
+            }
         }
     }
+
+    ofstream file;
+    if (config.output != "-") {
+        file.open(config.output, ios::out | ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Failed to open " << config.output << endl;
+            return 1;
+        }
+    }
+    ostream &out = config.output == "-" ? cout : file;
+    if (config.format == "json") {
+        write_json(out, config, results);
+    } else if (config.format == "csv") {
+        write_csv(out, results);
+    } else {
+        write_text(out, config, results);
+    }
     return 0;
 }
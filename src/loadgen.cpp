@@ -0,0 +1,259 @@
+#include "Client.hpp"
+#include "Metrics.hpp"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// Closed-loop load generator for the server. Every connection keeps `pipeline`
+// requests in flight: it sends that many, then waits for all of their responses
+// before sending more. A thread drives its share of the connections, sending on all
+// of them before collecting any responses, so hundreds of connections need only a
+// few threads.
+enum class LoadOp {
+    READ,
+    WRITE,
+    CREATE,
+    DELETE
+};
+
+static const size_t LOAD_OP_COUNT = 4;
+
+const char *load_op_name(size_t op) {
+    static const char *names[LOAD_OP_COUNT] = {"read", "write", "create", "delete"};
+    return names[op];
+}
+
+// Percentages of reads, writes and creates; deletes take the rest.
+class LoadMix {
+public:
+    string name;
+    int read;
+    int write;
+    int create;
+
+    LoadOp pick(int roll) const {
+        if (roll < read) {
+            return LoadOp::READ;
+        } else if (roll < read + write) {
+            return LoadOp::WRITE;
+        } else if (roll < read + write + create) {
+            return LoadOp::CREATE;
+        }
+        return LoadOp::DELETE;
+    }
+};
+
+class LoadConfig {
+public:
+    string socket_path = "/tmp/memfs.sock";
+    size_t connections = 64;
+    size_t threads = 4;
+    size_t pipeline = 16;
+    double seconds = 5;
+    LoadMix mix = {"read-heavy", 90, 10, 0};
+    size_t files = 10000;
+    size_t value_size = 64;
+};
+
+class LoadStats {
+public:
+    ShardedHistogram latency[LOAD_OP_COUNT];
+    ShardedCounter failed[LOAD_OP_COUNT];
+};
+
+string key_name(size_t key) {
+    return "loadgen/k" + to_string(key) + ".dat";
+}
+
+// Creates the directory and every file up front, pipelined in chunks.
+bool populate(const LoadConfig &config, string &error) {
+    MemFSClient client;
+    if (!client.connect(config.socket_path, error)) {
+        return false;
+    }
+    client.mkdir("loadgen");
+    string value(config.value_size, 'v');
+    Response response;
+    for (size_t begin = 0; begin < config.files; begin += 1024) {
+        size_t end = min(config.files, begin + 1024);
+        for (size_t key = begin; key < end; ++key) {
+            client.send(RequestOp::CREATE, key_name(key));
+            client.send(RequestOp::WRITE, key_name(key), value);
+        }
+        while (client.outstanding() > 0) {
+            if (!client.receive(response)) {
+                error = "connection lost while populating";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void drive(const LoadConfig &config, size_t thread_index, steady_clock::time_point deadline, LoadStats &stats,
+           atomic<size_t> &failures) {
+    vector<unique_ptr<MemFSClient>> clients;
+    for (size_t c = thread_index; c < config.connections; c += config.threads) {
+        unique_ptr<MemFSClient> client(new MemFSClient());
+        string error;
+        if (!client->connect(config.socket_path, error)) {
+            cerr << "Error: " << error << endl;
+            ++failures;
+            return;
+        }
+        clients.push_back(move(client));
+    }
+    mt19937_64 rng(thread_index * 7919 + 17);
+    uniform_int_distribution<int> roll(0, 99);
+    uniform_int_distribution<size_t> key(0, config.files - 1);
+    string value(config.value_size, 'w');
+    vector<vector<pair<LoadOp, steady_clock::time_point>>> sent(clients.size());
+    Response response;
+    while (steady_clock::now() < deadline) {
+        for (size_t c = 0; c < clients.size(); ++c) {
+            sent[c].clear();
+            for (size_t p = 0; p < config.pipeline; ++p) {
+                LoadOp op = config.mix.pick(roll(rng));
+                string name = key_name(key(rng));
+                switch (op) {
+                case LoadOp::READ:
+                    clients[c]->send(RequestOp::READ, name);
+                    break;
+                case LoadOp::WRITE:
+                    clients[c]->send(RequestOp::WRITE, name, value);
+                    break;
+                case LoadOp::CREATE:
+                    clients[c]->send(RequestOp::CREATE, name);
+                    break;
+                case LoadOp::DELETE:
+                    clients[c]->send(RequestOp::DELETE, name);
+                    break;
+                }
+                sent[c].push_back(make_pair(op, steady_clock::now()));
+            }
+            clients[c]->flush();
+        }
+        for (size_t c = 0; c < clients.size(); ++c) {
+            for (auto &request : sent[c]) {
+                if (!clients[c]->receive(response)) {
+                    cerr << "Error: connection lost" << endl;
+                    ++failures;
+                    return;
+                }
+                size_t op = static_cast<size_t>(request.first);
+                stats.latency[op].record(nanoseconds_between(request.second, steady_clock::now()));
+                if (response.status != ResponseStatus::OK) {
+                    stats.failed[op].add(1);
+                }
+            }
+        }
+    }
+}
+
+void usage(const char *program) {
+    cerr << "usage: " << program << " [--socket <path>] [--connections <n>] [--threads <n>] [--pipeline <n>]"
+         << " [--seconds <s>] [--mix read-heavy|write-heavy|churn] [--files <n>] [--value-size <bytes>]" << endl;
+}
+
+bool parse_args(int argc, char *argv[], LoadConfig &config) {
+    for (int i = 1; i < argc; ++i) {
+        string flag = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        string value = argv[++i];
+        try {
+            if (flag == "--socket") {
+                config.socket_path = value;
+            } else if (flag == "--mix") {
+                if (value == "read-heavy") {
+                    config.mix = {"read-heavy", 90, 10, 0};
+                } else if (value == "write-heavy") {
+                    config.mix = {"write-heavy", 10, 90, 0};
+                } else if (value == "churn") {
+                    config.mix = {"churn", 10, 20, 35};
+                } else {
+                    return false;
+                }
+            } else if (flag == "--seconds") {
+                config.seconds = stod(value);
+            } else if (flag == "--connections") {
+                config.connections = stoull(value);
+            } else if (flag == "--threads") {
+                config.threads = stoull(value);
+            } else if (flag == "--pipeline") {
+                config.pipeline = stoull(value);
+            } else if (flag == "--files") {
+                config.files = stoull(value);
+            } else if (flag == "--value-size") {
+                config.value_size = stoull(value);
+            } else {
+                return false;
+            }
+        } catch (const exception &) {
+            return false;
+        }
+    }
+    return config.connections > 0 && config.threads > 0 && config.pipeline > 0 && config.files > 0 &&
+           config.seconds > 0;
+}
+
+int main(int argc, char *argv[]) {
+    LoadConfig config;
+    if (!parse_args(argc, argv, config)) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.threads = min(config.threads, config.connections);
+    string error;
+    if (!populate(config, error)) {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+
+    LoadStats stats;
+    atomic<size_t> failures{0};
+    steady_clock::time_point start = steady_clock::now();
+    steady_clock::time_point deadline = start + duration_cast<steady_clock::duration>(duration<double>(config.seconds));
+    vector<thread> threads;
+    for (size_t t = 0; t < config.threads; ++t) {
+        threads.emplace_back(drive, cref(config), t, deadline, ref(stats), ref(failures));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+    if (failures > 0) {
+        return 1;
+    }
+
+    cout << config.connections << " connections x " << config.pipeline << " in flight, " << config.threads
+         << " threads, mix " << config.mix.name << ", " << config.files << " files of " << config.value_size
+         << " bytes, " << fixed << setprecision(1) << elapsed << " s" << endl;
+    cout << left << setw(8) << "op" << right << setw(12) << "count" << setw(12) << "ops/s" << setw(10) << "p50 us"
+         << setw(10) << "p99 us" << setw(10) << "p999 us" << setw(10) << "max us" << setw(10) << "failed" << endl;
+    uint64_t total = 0;
+    for (size_t op = 0; op < LOAD_OP_COUNT; ++op) {
+        LatencySummary summary = stats.latency[op].summary();
+        if (summary.samples == 0) {
+            continue;
+        }
+        total += summary.samples;
+        cout << left << setw(8) << load_op_name(op) << right << setw(12) << summary.samples << setw(12)
+             << static_cast<uint64_t>(summary.samples / elapsed) << setprecision(1) << setw(10) << summary.p50_us
+             << setw(10) << summary.p99_us << setw(10) << summary.p999_us << setw(10) << summary.max_us << setw(10)
+             << stats.failed[op].value() << endl;
+    }
+    cout << left << setw(8) << "all" << right << setw(12) << total << setw(12) << static_cast<uint64_t>(total / elapsed)
+         << endl;
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include "CommandInterpreter.hpp"
+#include "Options.hpp"
+#include <fstream>
 #include <iostream>
 #include <signal.h>
 #include <string>
@@ -15,12 +17,47 @@ void handle_sigint(int) {
     cout.flush();
 }
 
+void usage(const char *program) {
+    cerr << "usage: " << program << " " << options_usage() << " [--script <file|->]" << endl;
+}
+
 int main(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
+    MemFSOptions options;
+    string script;
+    string image;
+    bool parsed = parse_options(argc, argv, options, image, [&script](const string &flag, const string &value) {
+        if (flag != "--script") {
+            return false;
+        }
+        script = value;
+        return true;
+    });
+    if (!parsed) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CommandInterpreter parser(4, options);
+    if ((!image.empty() && !parser.restore(image)) || !parser.open_log()) {
+        return 1;
+    }
+
+    if (!script.empty()) {
+        if (script == "-") {
+            parser.run_script(cin);
+            return 0;
+        }
+        ifstream in(script);
+        if (!in.is_open()) {
+            cerr << "Failed to open " << script << endl;
+            return 1;
+        }
+        parser.run_script(in);
+        return 0;
+    }
+
     signal(SIGINT, handle_sigint);
     cout << "\033[2J\033[1;1H";
-    CommandInterpreter parser(4);
     for (string line; cout << getHeader() && getline(cin, line);) {
         if (!line.empty()) {
             parser.process(line);
@@ -0,0 +1,75 @@
+#include "Options.hpp"
+#include "Server.hpp"
+#include <iostream>
+#include <signal.h>
+#include <string>
+
+using namespace std;
+
+static MemFSServer *running = nullptr;
+
+void handle_stop(int) {
+    if (running) {
+        running->stop();
+    }
+}
+
+void usage(const char *program) {
+    cerr << "usage: " << program << " [--socket <path>] [--loops <n>] [--threads <n>] " << options_usage() << endl;
+}
+
+int main(int argc, char *argv[]) {
+    MemFSOptions options;
+    ServerOptions server_options;
+    size_t threads = 4;
+    string image;
+    bool parsed = parse_options(argc, argv, options, image, [&](const string &flag, const string &value) {
+        if (flag == "--socket") {
+            server_options.socket_path = value;
+            return true;
+        }
+        if (flag == "--loops") {
+            return parse_count(value, server_options.loops);
+        }
+        if (flag == "--threads") {
+            return parse_count(value, threads);
+        }
+        return false;
+    });
+    if (!parsed) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    MemFS fs(threads, options);
+    if (!image.empty()) {
+        SnapshotStatus status = fs.load_snapshot(image);
+        if (!status.ok) {
+            cerr << "Error: " << status.error << endl;
+            return 1;
+        }
+    }
+    LogStatus log_status = fs.open_log();
+    if (!log_status.ok) {
+        cerr << "Error: " << log_status.error << endl;
+        return 1;
+    }
+
+    MemFSServer server(fs, server_options);
+    ServerStatus status = server.start();
+    if (!status.ok) {
+        cerr << "Error: " << status.error << endl;
+        return 1;
+    }
+    running = &server;
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    cout << "memfs server listening on " << server_options.socket_path << " (" << server_options.loops
+         << " event loops, " << threads << " workers); Ctrl + c to stop" << endl;
+    server.wait();
+    running = nullptr;
+    if (options.metrics) {
+        fs.stats();
+    }
+    return 0;
+}
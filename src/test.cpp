@@ -0,0 +1,952 @@
+#include "Client.hpp"
+#include "MemFS.hpp"
+#include "Server.hpp"
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Consistency checks run by `make test`. Each prints the checks that fail; the program
+// exits non-zero if any did.
+
+static int failures = 0;
+static int checks = 0;
+
+static void check(bool ok, const string &what) {
+    ++checks;
+    if (!ok) {
+        ++failures;
+        cerr << "FAILED: " << what << endl;
+    }
+}
+
+// The budget must hold exactly what the tables and tree add up to.
+static void check_budget(MemFS &fs, const string &after) {
+    size_t used = fs.memory_used();
+    size_t recounted = fs.recount_memory();
+    check(used == recounted,
+          "budget after " + after + ": charged " + to_string(used) + ", recounted " + to_string(recounted));
+}
+
+static void test_budget() {
+    MemFSOptions options;
+    options.shard_count = 1;
+    options.max_file_size = 1 << 16;
+    MemFS fs(2, options);
+    check_budget(fs, "start-up");
+
+    for (int i = 0; i < 12; ++i) {
+        fs.create_file("f" + to_string(i) + ".txt");
+    }
+    for (int i = 0; i < 40; ++i) {
+        check(fs.create_file("f0.txt") == FileStatus::ALREADY_EXISTS, "create of an existing file fails");
+    }
+    check_budget(fs, "repeated creates of an existing file");
+
+    string image = "/tmp/memfs_test_" + to_string(getpid()) + ".img";
+    for (int i = 0; i < 5; ++i) {
+        fs.create_file("f0.txt");
+        check(fs.save_snapshot(image).ok, "save");
+        check(fs.load_snapshot(image).ok, "load");
+        check_budget(fs, "save and load");
+    }
+    ::unlink(image.c_str());
+
+    fs.make_directory("dir");
+    fs.make_directory("dir/sub");
+    for (int i = 0; i < 50; ++i) {
+        string name = "dir/sub/file_with_a_long_name_" + to_string(i) + ".txt";
+        fs.create_file(name);
+        fs.write_file(name, string(100 + i * 7, 'a' + i % 26));
+    }
+    check_budget(fs, "creates and writes in directories");
+
+    fs.copy_file("dir/sub/file_with_a_long_name_1.txt", "copy.txt");
+    fs.copy_file("dir/sub/file_with_a_long_name_2.txt", "f1.txt");
+    fs.rename_file("dir/sub/file_with_a_long_name_3.txt", "moved.txt");
+    fs.rename_file("dir/sub/file_with_a_long_name_4.txt", "f2.txt");
+    fs.pwrite_file("copy.txt", 10, "overwritten");
+    fs.truncate_file("moved.txt", 3);
+    for (int i = 10; i < 30; ++i) {
+        fs.delete_file("dir/sub/file_with_a_long_name_" + to_string(i) + ".txt");
+    }
+    check_budget(fs, "copies, renames, pwrites, truncates and deletes");
+    for (int i = 0; i < 40; ++i) {
+        check(fs.rename_file("f6.txt", "f7.txt") == FileStatus::ALREADY_EXISTS, "rename onto an existing file fails");
+    }
+    check_budget(fs, "repeated renames onto an existing file");
+
+    Transaction tx;
+    tx.create("tx_new.txt");
+    tx.write("tx_new.txt", "written in a transaction");
+    tx.write("f3.txt", "more");
+    tx.remove("f4.txt");
+    check(fs.commit(tx).status == FileStatus::OK, "transaction commits");
+    fs.create_file("timed.txt", 3600);
+    fs.expire_file("f5.txt", 3600);
+    fs.compact_cold(0);
+    check_budget(fs, "transactions, expiries and compaction");
+}
+
+static string content_of(MemFS &fs, const string &filename) {
+    FileView view;
+    return fs.read(filename, view) == FileStatus::OK ? view.str() : "<missing>";
+}
+
+static string file_bytes(const string &path) {
+    ifstream in(path, ios::binary);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static void put_bytes(const string &path, const string &bytes) {
+    ofstream out(path, ios::binary | ios::trunc);
+    out.write(bytes.data(), static_cast<streamsize>(bytes.size()));
+}
+
+// A saved image loads back with every name, content, directory, mtime and expiry, and
+// a damaged one is refused without touching the files already loaded.
+static void test_snapshot_round_trip() {
+    MemFSOptions options;
+    options.max_file_size = 1 << 20;
+    MemFS fs(2, options);
+    fs.make_directory("logs");
+    fs.make_directory("logs/old");
+    fs.make_directory("empty");
+    vector<string> names = {"top.txt", "logs/a.txt", "logs/old/b.txt", "blank.txt", "packed.txt", "copy.txt"};
+    for (auto &name : names) {
+        fs.create_file(name);
+    }
+    fs.write_file("top.txt", string("binary\0content\n", 15));
+    fs.write_file("logs/a.txt", string(5000, 'a'));
+    fs.write_file("logs/old/b.txt", "b");
+    fs.write_file("packed.txt", string(3000, 'p'));
+    fs.compact_cold(0);
+    fs.copy_file("logs/a.txt", "copy.txt");
+    fs.expire_file("logs/a.txt", 3600);
+    vector<string> contents;
+    vector<system_clock::time_point> updated;
+    vector<int64_t> expiries;
+    for (auto &name : names) {
+        FileView view;
+        fs.read(name, view);
+        contents.push_back(view.str());
+        updated.push_back(view.updated_at());
+        int64_t expires_at = 0;
+        fs.expiry(name, expires_at);
+        expiries.push_back(expires_at);
+    }
+
+    string image = "/tmp/memfs_test_" + to_string(getpid()) + ".img";
+    check(fs.save_snapshot(image).ok, "save");
+    MemFS loaded(2, options);
+    SnapshotStatus status = loaded.load_snapshot(image);
+    check(status.ok && status.files == names.size(), "load the saved image");
+    for (size_t i = 0; i < names.size(); ++i) {
+        FileView view;
+        int64_t expires_at = -1;
+        bool found = loaded.read(names[i], view) == FileStatus::OK && loaded.expiry(names[i], expires_at) == FileStatus::OK;
+        check(found && view.str() == contents[i], names[i] + " keeps its content");
+        check(found && view.updated_at() == updated[i], names[i] + " keeps its mtime");
+        check(expires_at == expiries[i], names[i] + " keeps its expiry");
+    }
+    check(loaded.make_directory("logs/old") == FileStatus::ALREADY_EXISTS, "directories are restored");
+    check(loaded.create_file("empty/new.txt") == FileStatus::OK, "an empty directory is restored");
+    check(loaded.write_file("logs/a.txt", "+") == FileStatus::OK && content_of(loaded, "logs/a.txt") == contents[1] + "+",
+          "a restored file takes appends");
+    check_budget(loaded, "loading an image");
+
+    // Each damaged copy must be refused, and leave `loaded` as it was.
+    string good = file_bytes(image);
+    SnapshotHeader header;
+    memcpy(&header, good.data(), sizeof(header));
+    vector<pair<string, string>> damaged;
+    damaged.push_back(make_pair("empty image", string()));
+    damaged.push_back(make_pair("truncated image", good.substr(0, good.size() - 1)));
+    damaged.push_back(make_pair("image cut inside its entries", good.substr(0, sizeof(header) + 10)));
+    string bytes = good;
+    bytes[0] = 'X';
+    damaged.push_back(make_pair("bad magic", bytes));
+    bytes = good;
+    uint32_t format = SnapshotHeader::FORMAT + 1;
+    memcpy(&bytes[offsetof(SnapshotHeader, format)], &format, sizeof(format));
+    damaged.push_back(make_pair("unknown format", bytes));
+    bytes = good;
+    uint64_t count = header.file_count * 1000;
+    memcpy(&bytes[offsetof(SnapshotHeader, file_count)], &count, sizeof(count));
+    damaged.push_back(make_pair("entry count past the end", bytes));
+    bytes = good;
+    uint64_t past_end = good.size();
+    size_t last = sizeof(header) + (header.file_count - 1) * sizeof(SnapshotEntry);
+    memcpy(&bytes[last + offsetof(SnapshotEntry, content_offset)], &past_end, sizeof(past_end));
+    damaged.push_back(make_pair("content past the end", bytes));
+    for (size_t i = 0; i < header.file_count; ++i) {
+        SnapshotEntry entry;
+        size_t at = sizeof(header) + i * sizeof(SnapshotEntry);
+        memcpy(&entry, &good[at], sizeof(entry));
+        if (good.compare(entry.name_offset, entry.name_size, "logs") == 0) {
+            bytes = good;
+            entry.flags = 0;
+            memcpy(&bytes[at], &entry, sizeof(entry));
+            damaged.push_back(make_pair("a parent directory turned into a file", bytes));
+        }
+    }
+    // `loaded` still reads from the good image's mapping, so damage a copy of it.
+    string copy = image + ".bad";
+    for (auto &damage : damaged) {
+        put_bytes(copy, damage.second);
+        check(!loaded.load_snapshot(copy).ok, "load refuses an image with " + damage.first);
+        check(content_of(loaded, "logs/old/b.txt") == "b" && content_of(loaded, "empty/new.txt").empty(),
+              "a refused image with " + damage.first + " leaves the files");
+    }
+    check_budget(loaded, "refused loads");
+    ::unlink(copy.c_str());
+    ::unlink(image.c_str());
+}
+
+static string pread_of(MemFS &fs, int fd, size_t offset, size_t length) {
+    FileView view;
+    return fs.pread(fd, offset, length, view) == FileStatus::OK ? view.str() : "<failed>";
+}
+
+// Reads and writes through descriptors land at their offsets, zero-fill past the end,
+// and a descriptor stops working once it is closed or its file is deleted.
+static void test_handles() {
+    MemFSOptions options;
+    options.max_file_size = 4096;
+    MemFS fs(2, options);
+    fs.create_file("h.txt");
+    fs.write_file("h.txt", "0123456789");
+    int fd = -1;
+    check(fs.open_file("h.txt", fd) == FileStatus::OK, "open a file");
+    check(pread_of(fs, fd, 2, 3) == "234", "pread inside the file");
+    check(pread_of(fs, fd, 8, 10) == "89", "pread across the end stops there");
+    check(pread_of(fs, fd, 20, 5).empty(), "pread past the end reads nothing");
+
+    check(fs.pwrite(fd, 3, "abc") == FileStatus::OK, "pwrite inside the file");
+    check(content_of(fs, "h.txt") == "012abc6789", "pwrite overwrites in place");
+    check(fs.pwrite(fd, 15, "xy") == FileStatus::OK, "pwrite past the end");
+    string expected = "012abc6789" + string(5, '\0') + "xy";
+    check(content_of(fs, "h.txt") == expected, "pwrite past the end fills the gap with zeros");
+    check(fs.truncate(fd, 4) == FileStatus::OK && content_of(fs, "h.txt") == "012a", "truncate shrinks");
+    check(fs.truncate(fd, 8) == FileStatus::OK && content_of(fs, "h.txt") == "012a" + string(4, '\0'),
+          "truncate grows with zeros");
+
+    // Across block boundaries, by descriptor and by name.
+    string big(1000, '.');
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = static_cast<char>('a' + i % 26);
+    }
+    fs.truncate(fd, 0);
+    fs.pwrite(fd, 0, big);
+    string patch(300, '#');
+    check(fs.pwrite(fd, 200, patch) == FileStatus::OK, "pwrite across blocks");
+    big.replace(200, patch.size(), patch);
+    check(content_of(fs, "h.txt") == big, "pwrite across blocks keeps the bytes around it");
+    check(pread_of(fs, fd, 240, 300) == big.substr(240, 300), "pread across blocks");
+    check(fs.pwrite_file("h.txt", 1500, "end") == FileStatus::OK, "pwrite by name");
+    big += string(500, '\0') + "end";
+    check(content_of(fs, "h.txt") == big, "pwrite by name past the end");
+    check(fs.truncate_file("h.txt", 250) == FileStatus::OK && content_of(fs, "h.txt") == big.substr(0, 250),
+          "truncate by name");
+    check(fs.pwrite(fd, 4095, "xy") == FileStatus::SIZE_LIMIT_EXCEEDED, "pwrite over the size limit fails");
+    check(fs.truncate(fd, 4097) == FileStatus::SIZE_LIMIT_EXCEEDED, "truncate over the size limit fails");
+    check(content_of(fs, "h.txt") == big.substr(0, 250), "failed writes leave the content");
+
+    // A closed descriptor is refused until open_file hands the number out again.
+    check(fs.close_file(fd) == FileStatus::OK, "close");
+    check(fs.close_file(fd) == FileStatus::BAD_DESCRIPTOR, "close twice");
+    FileView view;
+    check(fs.pread(fd, 0, 1, view) == FileStatus::BAD_DESCRIPTOR, "pread on a closed descriptor");
+    check(fs.pwrite(fd, 0, "z") == FileStatus::BAD_DESCRIPTOR, "pwrite on a closed descriptor");
+    check(fs.truncate(fd, 0) == FileStatus::BAD_DESCRIPTOR, "truncate on a closed descriptor");
+    check(fs.pread(-1, 0, 1, view) == FileStatus::BAD_DESCRIPTOR, "pread on a negative descriptor");
+    check(fs.pread(1 << 20, 0, 1, view) == FileStatus::BAD_DESCRIPTOR, "pread on a descriptor never opened");
+    fs.create_file("other.txt");
+    fs.write_file("other.txt", "other");
+    int reused = -1;
+    check(fs.open_file("other.txt", reused) == FileStatus::OK && reused == fd, "a closed descriptor is reused");
+    check(pread_of(fs, reused, 0, 5) == "other", "a reused descriptor reaches its new file");
+
+    // A deleted file's descriptors stop working, even once the name is created again.
+    int gone = -1;
+    fs.create_file("gone.txt");
+    check(fs.open_file("gone.txt", gone) == FileStatus::OK, "open a file to delete");
+    fs.delete_file("gone.txt");
+    check(fs.pread(gone, 0, 1, view) == FileStatus::NOT_FOUND, "pread on a deleted file");
+    fs.create_file("gone.txt");
+    check(fs.pwrite(gone, 0, "new") == FileStatus::NOT_FOUND, "pwrite on a deleted file, recreated");
+    check(content_of(fs, "gone.txt").empty(), "the recreated file is untouched");
+    check(fs.close_file(gone) == FileStatus::OK, "close a descriptor of a deleted file");
+    check(fs.open_file("missing.txt", gone) == FileStatus::NOT_FOUND, "open a missing file");
+    check_budget(fs, "handle operations");
+}
+
+// A watcher sees only the changes under its prefix, in order and numbered from 1;
+// once its ring is full it drops the newest and reports how many it lost.
+static void test_watcher_overflow() {
+    MemFSOptions options;
+    MemFS fs(2, options);
+    fs.make_directory("logs");
+    shared_ptr<Watcher> watcher = fs.watch("logs/", 3);
+    shared_ptr<Watcher> everything = fs.watch("");
+    check(watcher->capacity() == 4, "watcher capacity rounds up to a power of two");
+    fs.create_file("logs/a.txt");
+    fs.write_file("logs/a.txt", "xy");
+    fs.create_file("other.txt");
+    fs.delete_file("logs/a.txt");
+    for (int i = 0; i < 6; ++i) {
+        fs.create_file("logs/f" + to_string(i) + ".txt");
+    }
+
+    vector<ChangeEvent> events;
+    uint64_t lost = 0;
+    check(watcher->poll(events, lost, 2) == 2 && lost == 5, "a full ring reports the events it dropped");
+    check(events[0].sequence == 1 && events[0].kind == ChangeKind::CREATE && events[0].filename == "logs/a.txt",
+          "first event");
+    check(events[1].sequence == 2 && events[1].kind == ChangeKind::WRITE && events[1].size == 2, "second event");
+    check(watcher->poll(events, lost) == 2 && lost == 0, "the rest of the ring, with no new drops");
+    check(events[0].sequence == 3 && events[0].kind == ChangeKind::DELETE && events[0].size == 0, "third event");
+    check(events[1].sequence == 4 && events[1].filename == "logs/f0.txt", "the oldest events are the ones kept");
+    check(watcher->dropped_total() == 5, "dropped total");
+    fs.write_file("logs/f1.txt", "abc");
+    check(watcher->poll(events, lost) == 1 && lost == 0 && events[0].sequence == 5 && events[0].size == 3,
+          "numbering carries on once the ring has room");
+    check(watcher->empty(), "a drained watcher is empty");
+
+    check(everything->poll(events, lost) == 11 && lost == 0, "an empty prefix sees every file");
+    bool numbered = true;
+    for (size_t i = 0; i < events.size(); ++i) {
+        numbered = numbered && events[i].sequence == i + 1;
+    }
+    check(numbered && events[2].filename == "other.txt", "events arrive in order");
+    fs.unwatch(everything);
+
+    // Producers on many threads, a consumer polling meanwhile: nothing is lost without
+    // being counted, and each file's changes arrive in the order they were made.
+    const int THREADS = 4;
+    const int ROUNDS = 2000;
+    shared_ptr<Watcher> busy = fs.watch("busy/", 64);
+    fs.make_directory("busy");
+    for (int t = 0; t < THREADS; ++t) {
+        fs.create_file("busy/" + to_string(t) + ".txt");
+    }
+    atomic<bool> running(true);
+    vector<thread> writers;
+    for (int t = 0; t < THREADS; ++t) {
+        writers.emplace_back([&fs, t]() {
+            for (int i = 0; i < ROUNDS; ++i) {
+                fs.write_file("busy/" + to_string(t) + ".txt", "x");
+            }
+        });
+    }
+    uint64_t received = 0;
+    uint64_t dropped = 0;
+    uint64_t next_sequence = 1;
+    size_t disorders = 0;
+    vector<uint64_t> last_size(THREADS, 0);
+    auto drain = [&]() {
+        busy->poll(events, lost);
+        dropped += lost;
+        for (auto &event : events) {
+            disorders += event.sequence != next_sequence++;
+            if (event.kind == ChangeKind::WRITE) {
+                size_t t = static_cast<size_t>(event.filename[5] - '0');
+                disorders += event.size <= last_size[t];
+                last_size[t] = event.size;
+            }
+            ++received;
+        }
+    };
+    thread consumer([&]() {
+        while (running) {
+            drain();
+        }
+    });
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    running = false;
+    consumer.join();
+    drain();
+    check(received + dropped == THREADS + THREADS * ROUNDS,
+          "events received plus dropped: " + to_string(received + dropped));
+    check(disorders == 0, "events out of order: " + to_string(disorders));
+}
+
+static bool round_trips(const string &input) {
+    string packed;
+    LZCodec::compress(input.data(), input.size(), packed);
+    string output(input.size(), '\0');
+    return packed.size() <= LZCodec::bound(input.size()) &&
+           LZCodec::decompress(packed.data(), packed.size(), &output[0], output.size()) && output == input;
+}
+
+// The codec gives back what it was given, whatever the input, and refuses input that
+// is cut short or decodes to another size. A compacted file reads back and takes
+// writes like any other.
+static void test_compression() {
+    unsigned seed = 777;
+    auto next = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 16;
+    };
+    string random(100000, '\0');
+    for (auto &c : random) {
+        c = static_cast<char>(next());
+    }
+    string text;
+    while (text.size() < 200000) {
+        text += "line " + to_string(next() % 1000) + ": the quick brown fox jumps over the lazy dog\n";
+    }
+    vector<pair<string, string>> inputs;
+    inputs.push_back(make_pair("empty input", string()));
+    inputs.push_back(make_pair("one byte", string("x")));
+    inputs.push_back(make_pair("short input", string("abcdefghi")));
+    inputs.push_back(make_pair("incompressible input", random));
+    inputs.push_back(make_pair("one byte repeated", string(1 << 20, 'a')));
+    inputs.push_back(make_pair("a short pattern repeated", string(300, 'a') + "bcbcbcbcbcbcbcbcbcbcbcbcbc" + "zz"));
+    inputs.push_back(make_pair("text", text));
+    inputs.push_back(make_pair("a repeat 64 KB back", random.substr(0, 70000) + random.substr(4000, 3000)));
+    for (size_t length = 1; length < 600; length += 37) {
+        inputs.push_back(make_pair("literal and match lengths around 15 and 255",
+                                   random.substr(0, length) + string(length, 'm') + random.substr(length, length)));
+    }
+    for (auto &input : inputs) {
+        check(round_trips(input.second), input.first + " round-trips");
+    }
+    string packed;
+    LZCodec::compress(string(1 << 20, 'a').data(), 1 << 20, packed);
+    check(packed.size() < 8192, "a repeated byte compresses well");
+
+    LZCodec::compress(text.data(), text.size(), packed);
+    string output(text.size() + 1, '\0');
+    check(!LZCodec::decompress(packed.data(), packed.size() - 1, &output[0], text.size()),
+          "cut-short input is refused");
+    check(!LZCodec::decompress(packed.data(), packed.size(), &output[0], text.size() - 1), "a smaller size is refused");
+    check(!LZCodec::decompress(packed.data(), packed.size(), &output[0], text.size() + 1), "a larger size is refused");
+    string garbage = packed;
+    garbage[garbage.size() / 2] ^= 0x5a;
+    garbage[garbage.size() / 3] ^= 0x33;
+    bool refused = !LZCodec::decompress(garbage.data(), garbage.size(), &output[0], text.size());
+    check(refused || output.compare(0, text.size(), text) != 0, "damaged input never decodes to the content");
+
+    MemFSOptions options;
+    options.max_file_size = 1 << 20;
+    MemFS fs(2, options);
+    fs.create_file("text.txt");
+    fs.write_file("text.txt", text.substr(0, 100000));
+    fs.create_file("random.txt");
+    fs.write_file("random.txt", random.substr(0, 5000));
+    fs.create_file("tiny.txt");
+    fs.write_file("tiny.txt", "t");
+    check(fs.compact_cold(0) == 3, "compaction packs the files");
+    check(content_of(fs, "text.txt") == text.substr(0, 100000) &&
+              content_of(fs, "random.txt") == random.substr(0, 5000) && content_of(fs, "tiny.txt") == "t",
+          "packed files read back");
+    check(fs.write_file("text.txt", "appended") == FileStatus::OK &&
+              content_of(fs, "text.txt") == text.substr(0, 100000) + "appended",
+          "a packed file takes appends");
+    fs.compact_cold(0);
+    string expected = text.substr(0, 100000) + "appended";
+    expected.replace(50000, 5, "PATCH");
+    check(fs.pwrite_file("text.txt", 50000, "PATCH") == FileStatus::OK && content_of(fs, "text.txt") == expected,
+          "a packed file takes a pwrite");
+    fs.compact_cold(0);
+    check(fs.truncate_file("text.txt", 1000) == FileStatus::OK &&
+              content_of(fs, "text.txt") == expected.substr(0, 1000),
+          "a packed file truncates");
+    fs.compact_cold(0);
+    vector<GrepMatch> found = fs.grep("PATCH");
+    check(found.empty(), "grep of a truncated packed file");
+    found = fs.grep("quick brown");
+    check(found.size() == 1 && found[0].filename == "text.txt", "grep finds text in a packed file");
+    check_budget(fs, "compaction");
+}
+
+// A copy is logged as one record; replaying the log must give the copy the content it
+// had, not what the source held later.
+static void test_copy_replay() {
+    MemFSOptions options;
+    options.log_path = "/tmp/memfs_test_" + to_string(getpid()) + ".log";
+    options.log_mode = LogMode::SYNC;
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "open a new log");
+        fs.create_file("source.txt");
+        fs.write_file("source.txt", "before the copy");
+        fs.copy_file("source.txt", "copy.txt");
+        fs.create_file("empty.txt");
+        fs.copy_file("empty.txt", "empty_copy.txt");
+        fs.write_file("source.txt", ", after it");
+        fs.rename_file("copy.txt", "renamed.txt");
+    }
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "replay the log");
+        check(content_of(fs, "source.txt") == "before the copy, after it", "source replayed");
+        check(content_of(fs, "renamed.txt") == "before the copy", "copy replayed with the content it was made with");
+        check(content_of(fs, "copy.txt") == "<missing>", "renamed copy gone under its old name");
+        check(content_of(fs, "empty_copy.txt").empty(), "copy of an empty file replayed");
+        check_budget(fs, "replaying a log");
+    }
+    ::unlink(options.log_path.c_str());
+}
+
+// Repacking a file is not a change: a transaction that read it still commits, and
+// blind transactions never conflict however busy their files are.
+static void test_transaction_conflicts() {
+    MemFSOptions options;
+    options.shard_count = 4;
+    options.max_file_size = 1 << 20;
+    options.memory_limit = 1 << 20;
+    MemFS fs(2, options);
+    fs.create_file("read.txt");
+    fs.write_file("read.txt", string(4000, 'r'));
+    fs.create_file("other.txt");
+    check(fs.compact_cold(0) == 1, "compaction packs the file");
+
+    // With no room to unpack it, the transaction reads a private copy and the file
+    // stays packed; once there is room, a plain read unpacks it in place.
+    fs.create_file("filler.txt");
+    while (fs.write_file("filler.txt", string(1000, 'f')) == FileStatus::OK) {
+    }
+    Transaction tx;
+    FileView view;
+    check(fs.read(tx, "read.txt", view) == FileStatus::OK && view.size() == 4000, "read through a transaction");
+    fs.delete_file("filler.txt");
+    check(fs.read("read.txt", view) == FileStatus::OK, "read unpacks the file");
+    tx.write("other.txt", "x");
+    check(fs.commit(tx).status == FileStatus::OK, "a repacked read does not conflict");
+
+    Transaction changed;
+    check(fs.read(changed, "read.txt", view) == FileStatus::OK, "read through a transaction");
+    fs.write_file("read.txt", "y");
+    changed.write("other.txt", "x");
+    check(fs.commit(changed).status == FileStatus::CONFLICT, "a changed read conflicts");
+
+    const int THREADS = 6;
+    const int ROUNDS = 2000;
+    fs.create_file("a.txt");
+    fs.create_file("b.txt");
+    atomic<int> conflicts(0);
+    atomic<bool> running(true);
+    vector<thread> workers;
+    for (int t = 0; t < THREADS; ++t) {
+        workers.emplace_back([&fs, &conflicts]() {
+            for (int i = 0; i < ROUNDS; ++i) {
+                Transaction blind;
+                blind.write("a.txt", "a");
+                blind.write("b.txt", "b");
+                FileStatus status = fs.commit(blind).status;
+                if (status != FileStatus::OK) {
+                    ++conflicts;
+                }
+                fs.write_file(i % 2 ? "a.txt" : "b.txt", "c");
+            }
+        });
+    }
+    thread churn([&fs, &running]() {
+        FileView view;
+        while (running) {
+            fs.read("a.txt", view);
+            fs.compact_cold(0);
+        }
+    });
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    running = false;
+    churn.join();
+    check(conflicts == 0, "blind transactions fail " + to_string(conflicts.load()) + " times");
+    size_t expected = THREADS * ROUNDS + THREADS * ROUNDS / 2;
+    check(content_of(fs, "a.txt").size() == expected, "every write to a.txt applied");
+    check(content_of(fs, "b.txt").size() == expected, "every write to b.txt applied");
+}
+
+// Writers exclude everyone, readers only writers, including once waiters have gone to
+// sleep behind sections long enough to make them park.
+static void test_rwlock() {
+    const int THREADS = 8;
+    const int ROUNDS = 3000;
+    RWLock lock;
+    long counter = 0;
+    atomic<int> writers(0);
+    atomic<int> readers(0);
+    atomic<int> violations(0);
+    vector<thread> workers;
+    for (int t = 0; t < THREADS; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < ROUNDS; ++i) {
+                if ((i + t) % 4 == 0) {
+                    lock_guard<RWLock> guard(lock);
+                    if (writers.fetch_add(1) != 0 || readers.load() != 0) {
+                        ++violations;
+                    }
+                    ++counter;
+                    if (i % 500 == 0) {
+                        this_thread::sleep_for(milliseconds(2));
+                    }
+                    writers.fetch_sub(1);
+                } else {
+                    SharedLock guard(lock);
+                    readers.fetch_add(1);
+                    if (writers.load() != 0) {
+                        ++violations;
+                    }
+                    readers.fetch_sub(1);
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    check(violations == 0, "lock exclusion violated " + to_string(violations.load()) + " times");
+    check(counter == THREADS * ROUNDS / 4, "every writer got the lock");
+}
+
+// Concurrent writes to one file must replay in the order they took effect, whatever
+// the writes to other files do meanwhile.
+static void test_log_order() {
+    MemFSOptions options;
+    options.max_file_size = 1 << 20;
+    options.log_path = "/tmp/memfs_test_" + to_string(getpid()) + ".log";
+    options.log_mode = LogMode::ASYNC;
+    const int THREADS = 4;
+    const int ROUNDS = 500;
+    vector<string> names;
+    for (int t = 0; t < THREADS; ++t) {
+        names.push_back("own" + to_string(t) + ".txt");
+    }
+    names.push_back("shared.txt");
+    vector<string> contents;
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "open a new log");
+        for (auto &name : names) {
+            fs.create_file(name);
+        }
+        vector<thread> workers;
+        for (int t = 0; t < THREADS; ++t) {
+            workers.emplace_back([&fs, &names, t]() {
+                for (int i = 0; i < ROUNDS; ++i) {
+                    string mark(1 + i % 7, static_cast<char>('a' + t));
+                    fs.write_file("shared.txt", mark);
+                    fs.write_file(names[t], mark);
+                    if (i % 50 == 0) {
+                        fs.pwrite_file("shared.txt", i, mark);
+                    }
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        for (auto &name : names) {
+            contents.push_back(content_of(fs, name));
+        }
+    }
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "replay the log");
+        for (size_t k = 0; k < names.size(); ++k) {
+            check(content_of(fs, names[k]) == contents[k], names[k] + " replayed as written");
+        }
+    }
+    ::unlink(options.log_path.c_str());
+}
+
+// A log that cannot be written stops at its last complete record, and the changes it
+// failed to keep, and all after them, fail instead of being reported durable.
+static void test_log_failure() {
+    MemFSOptions options;
+    options.max_file_size = 1 << 20;
+    options.log_path = "/tmp/memfs_test_" + to_string(getpid()) + ".log";
+    options.log_mode = LogMode::BATCHED;
+    struct stat good;
+    struct stat after;
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "open a new log");
+        fs.create_file("kept.txt");
+        check(fs.write_file("kept.txt", "durable") == FileStatus::OK, "write before the failure");
+        ::stat(options.log_path.c_str(), &good);
+        // Cap the size of files this process writes, so the next record is cut short
+        // and the write after it fails.
+        struct rlimit saved;
+        getrlimit(RLIMIT_FSIZE, &saved);
+        struct rlimit capped = saved;
+        capped.rlim_cur = static_cast<rlim_t>(good.st_size) + 100;
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &capped);
+        check(fs.write_file("kept.txt", string(1000, 'x')) == FileStatus::LOG_FAILED, "a write the log lost fails");
+        check(fs.create_file("after.txt") == FileStatus::LOG_FAILED, "a create after the failure fails");
+        vector<FileStatus> batch = fs.submit_creates(vector<string>{"batch.txt"}).get();
+        check(batch.size() == 1 && batch[0] == FileStatus::LOG_FAILED, "a batch after the failure fails");
+        check(fs.create_file("after.txt") == FileStatus::ALREADY_EXISTS, "failures other than the log's still show");
+        setrlimit(RLIMIT_FSIZE, &saved);
+        signal(SIGXFSZ, SIG_DFL);
+        ::stat(options.log_path.c_str(), &after);
+        check(after.st_size == good.st_size, "the log is cut back to its last complete record");
+    }
+    {
+        MemFS fs(2, options);
+        check(fs.open_log().ok, "replay the log");
+        check(content_of(fs, "kept.txt") == "durable", "what the log kept is replayed");
+        check(content_of(fs, "after.txt") == "<missing>", "what it lost is not");
+    }
+    ::unlink(options.log_path.c_str());
+}
+
+// A HashIndex whose entries pile up on a few home slots, some at the end of the table
+// so their runs wrap around, keeps every entry findable through inserts and erases.
+static void test_hash_index() {
+    unsigned seed = 4242;
+    auto next = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 16;
+    };
+    auto hash_of = [](unsigned k) { return k % 3 == 0 ? SIZE_MAX - k % 5 : static_cast<size_t>(k % 7); };
+    FileIndex<unsigned> index;
+    map<string, unsigned> expected;
+    bool consistent = true;
+    for (int round = 0; round < 20000; ++round) {
+        unsigned k = next() % 300;
+        string name = "f" + to_string(k);
+        if (next() % 3 == 0) {
+            consistent = consistent && index.erase(name, hash_of(k)) == (expected.erase(name) == 1);
+        } else {
+            bool added = index.emplace(name, hash_of(k), k).second;
+            consistent = consistent && added == expected.insert(make_pair(name, k)).second;
+        }
+        if (round % 100 == 0) {
+            for (unsigned j = 0; j < 300; ++j) {
+                string other = "f" + to_string(j);
+                unsigned *found = index.find(other, hash_of(j));
+                consistent = consistent && (found ? *found == j && expected.count(other) : !expected.count(other));
+            }
+        }
+    }
+    check(consistent && index.size() == expected.size(), "colliding entries survive inserts and erases");
+}
+
+// Scanning content whole, or fed in segments of any size, finds what string::find finds.
+static void test_segment_search() {
+    unsigned seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return seed >> 16;
+    };
+    int mismatches = 0;
+    for (int round = 0; round < 200; ++round) {
+        string content;
+        size_t length = next() % 600;
+        for (size_t i = 0; i < length; ++i) {
+            content.push_back("ab"[next() % 2]);
+        }
+        string pattern;
+        size_t pattern_length = 1 + next() % 6;
+        for (size_t i = 0; i < pattern_length; ++i) {
+            pattern.push_back("ab"[next() % 2]);
+        }
+        vector<size_t> expected;
+        for (size_t at = content.find(pattern); at != string::npos; at = content.find(pattern, at + 1)) {
+            expected.push_back(at);
+        }
+        SubstringSearch search(pattern, static_cast<SearchKernel>(round % 3));
+        vector<size_t> whole;
+        search.scan(content.data(), content.size(), [&whole](size_t at) { whole.push_back(at); });
+        vector<size_t> found;
+        SegmentSearch scanner(search);
+        for (size_t at = 0; at < content.size();) {
+            size_t size = min(content.size() - at, static_cast<size_t>(next() % (round % 2 ? 12 : 100)));
+            scanner.feed(content.data() + at, size, [&found](size_t offset) { found.push_back(offset); });
+            at += size;
+        }
+        if (whole != expected || found != expected) {
+            ++mismatches;
+        }
+    }
+    check(mismatches == 0, "segmented search misses or adds matches in " + to_string(mismatches) + " rounds");
+}
+
+// A create with a time to live whose timer does not fit fails before the file is
+// created, so watchers never see it come and go.
+static void test_timed_create_limit() {
+    MemFSOptions options;
+    options.shard_count = 1;
+    options.memory_limit = 1 << 18;
+    MemFS fs(1, options);
+    shared_ptr<Watcher> watcher = fs.watch("");
+    string name(300, 'n');
+    fs.create_file(name);
+    // Fill the budget with ever shorter names, until not even a short one fits; what
+    // is left is less than a timer for `name` costs.
+    int made = 0;
+    for (size_t length = 300; length >= 10; --length) {
+        while (true) {
+            string filler = to_string(made++);
+            filler.resize(length, 'f');
+            if (fs.create_file(filler) != FileStatus::OK) {
+                break;
+            }
+        }
+    }
+    fs.delete_file(name);
+    vector<ChangeEvent> events;
+    uint64_t lost = 0;
+    watcher->poll(events, lost);
+    check(fs.create_file(name, 60) == FileStatus::MEMORY_LIMIT_EXCEEDED, "a timed create runs out of memory");
+    watcher->poll(events, lost);
+    check(events.empty() && lost == 0, "a failed timed create sends no events");
+    check(fs.create_file(name) == FileStatus::OK, "the same name fits without a timer");
+    check_budget(fs, "a failed timed create");
+}
+
+// Same for a write with a time to live: if its timer does not fit, the content is
+// not written either.
+static void test_timed_write_limit() {
+    MemFSOptions options;
+    options.shard_count = 1;
+    options.memory_limit = 1 << 18;
+    MemFS fs(1, options);
+    string name(1000, 't');
+    fs.create_file(name);
+    string pad(300, 'p');
+    fs.create_file(pad);
+    int made = 0;
+    for (size_t length = 300; length >= 10; --length) {
+        while (true) {
+            string filler = to_string(made++);
+            filler.resize(length, 'f');
+            if (fs.create_file(filler) != FileStatus::OK) {
+                break;
+            }
+        }
+    }
+    // Room for a one-block write, but not for it and a timer for the long name.
+    fs.delete_file(pad);
+    shared_ptr<Watcher> watcher = fs.watch("");
+    check(fs.write_file(name, "x", 60) == FileStatus::MEMORY_LIMIT_EXCEEDED, "a timed write runs out of memory");
+    check(content_of(fs, name).empty(), "a failed timed write leaves the content");
+    vector<ChangeEvent> events;
+    uint64_t lost = 0;
+    watcher->poll(events, lost);
+    check(events.empty() && lost == 0, "a failed timed write sends no events");
+    check(fs.write_file(name, "x") == FileStatus::OK, "the same write fits without a timer");
+    check(fs.write_file("missing.txt", "x", 60) == FileStatus::NOT_FOUND, "a timed write to no file fails");
+    check_budget(fs, "a failed timed write");
+}
+
+// The server answers pipelined requests in order, and a bad request, a read too large
+// to send or a flood of requests leaves the connection's framing intact.
+static void test_server() {
+    MemFSOptions options;
+    options.max_file_size = 16 << 20;
+    MemFS fs(2, options);
+    ServerOptions server_options;
+    server_options.socket_path = "/tmp/memfs_test_" + to_string(getpid()) + ".sock";
+    server_options.max_read = 1 << 20;
+    MemFSServer server(fs, server_options);
+    check(server.start().ok, "start the server");
+    MemFSClient client;
+    string error;
+    check(client.connect(server_options.socket_path, error), "connect to the server");
+
+    string binary("a\0b\nc", 5);
+    vector<pair<ResponseStatus, string>> expected;
+    auto send = [&](RequestOp op, const string &name, const string &content, ResponseStatus status,
+                    const string &returned) {
+        client.send(op, name, content);
+        expected.push_back(make_pair(status, returned));
+    };
+    send(RequestOp::CREATE, "p.txt", "", ResponseStatus::OK, "");
+    send(RequestOp::WRITE, "p.txt", binary, ResponseStatus::OK, "");
+    send(RequestOp::READ, "p.txt", "", ResponseStatus::OK, binary);
+    send(RequestOp::WRITE, "p.txt", "more", ResponseStatus::OK, "");
+    send(RequestOp::READ, "p.txt", "", ResponseStatus::OK, binary + "more");
+    send(RequestOp::READ, "/p.txt", "", ResponseStatus::BAD_REQUEST, "");
+    send(static_cast<RequestOp>(99), "p.txt", "", ResponseStatus::BAD_REQUEST, "");
+    send(RequestOp::CREATE, "p.txt", "", ResponseStatus::ALREADY_EXISTS, "");
+    send(RequestOp::DELETE, "p.txt", "", ResponseStatus::OK, "");
+    send(RequestOp::READ, "p.txt", "", ResponseStatus::NOT_FOUND, "");
+    send(RequestOp::MKDIR, "d", "", ResponseStatus::OK, "");
+    send(RequestOp::CREATE, "d/q.txt", "", ResponseStatus::OK, "");
+    send(RequestOp::COPY, "d/q.txt", "r.txt", ResponseStatus::OK, "");
+    send(RequestOp::READ, "r.txt", "", ResponseStatus::OK, "");
+    size_t mismatches = 0;
+    for (auto &answer : expected) {
+        Response response;
+        if (!client.receive(response) || response.status != answer.first || response.content != answer.second) {
+            ++mismatches;
+        }
+    }
+    check(mismatches == 0, "pipelined responses out of order or wrong: " + to_string(mismatches));
+
+    // More requests and request bytes than the server queues for a connection; it
+    // stops reading until it has caught up, and loses none of them.
+    const size_t FLOOD = 50000;
+    const size_t FILES = 50;
+    const string chunk(100, 'x');
+    size_t created = 0;
+    for (size_t i = 0; i < FILES; ++i) {
+        created += client.create("flood" + to_string(i) + ".txt") == ResponseStatus::OK;
+    }
+    check(created == FILES, "create over the socket");
+    for (size_t i = 0; i < FLOOD; ++i) {
+        client.send(RequestOp::WRITE, "flood" + to_string(i % FILES) + ".txt", chunk);
+    }
+    size_t written = 0;
+    Response response;
+    while (client.receive(response)) {
+        written += response.status == ResponseStatus::OK;
+    }
+    check(written == FLOOD, "flooded writes acknowledged: " + to_string(written));
+    size_t applied = 0;
+    for (size_t i = 0; i < FILES; ++i) {
+        applied += content_of(fs, "flood" + to_string(i) + ".txt").size();
+    }
+    check(applied == FLOOD * chunk.size(), "every flooded write applied");
+
+    string content;
+    fs.create_file("large.txt");
+    fs.write_file("large.txt", string(server_options.max_read + 1, 'l'));
+    check(client.read("large.txt", content) == ResponseStatus::TOO_LARGE, "a read over the limit is refused");
+    check(client.read("d/q.txt", content) == ResponseStatus::OK && content.empty(), "the connection still works");
+    check(client.write("d/q.txt", "tail") == ResponseStatus::OK && client.read("d/q.txt", content) == ResponseStatus::OK &&
+              content == "tail",
+          "a round trip after the refused read");
+}
+
+int main() {
+    test_hash_index();
+    test_segment_search();
+    test_log_order();
+    test_log_failure();
+    test_rwlock();
+    test_budget();
+    test_snapshot_round_trip();
+    test_handles();
+    test_watcher_overflow();
+    test_compression();
+    test_copy_replay();
+    test_transaction_conflicts();
+    test_timed_create_limit();
+    test_timed_write_limit();
+    test_server();
+    if (failures > 0) {
+        cerr << failures << " of " << checks << " checks failed" << endl;
+        return 1;
+    }
+    cout << "all " << checks << " checks passed" << endl;
+    return 0;
+}